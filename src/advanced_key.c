@@ -65,11 +65,11 @@ static inline bool advanced_key_update_analog_rapid_mode(AdvancedKey* advanced_k
 static inline bool advanced_key_update_analog_speed_mode(AdvancedKey* advanced_key)
 {
     bool state = advanced_key->key.state;
-    if (advanced_key->difference > advanced_key->config.trigger_speed)
+    if (advanced_key->velocity > ((int32_t)advanced_key->config.trigger_speed << ADVANCED_KEY_VELOCITY_Q))
     {
         state = true;
     }
-    if (-advanced_key->difference > advanced_key->config.release_speed)
+    if (-advanced_key->velocity > ((int32_t)advanced_key->config.release_speed << ADVANCED_KEY_VELOCITY_Q))
     {
         state = false;
     }
@@ -84,11 +84,23 @@ static inline bool advanced_key_update_analog_speed_mode(AdvancedKey* advanced_k
     return state;
 }
 
+// Predict one tick ahead, then correct position and velocity by a share of the residual
+static inline void advanced_key_update_velocity(AdvancedKey* advanced_key, AnalogValue value)
+{
+    int32_t predicted = advanced_key->estimate + advanced_key->velocity;
+    int32_t residual = ((int32_t)value << ADVANCED_KEY_VELOCITY_Q) - predicted;
+    int32_t velocity = advanced_key->velocity + (residual >> ADVANCED_KEY_VELOCITY_BETA_SHIFT);
+    advanced_key->estimate = predicted + (residual >> ADVANCED_KEY_VELOCITY_ALPHA_SHIFT);
+    advanced_key->acceleration = (velocity - advanced_key->velocity) >> ADVANCED_KEY_VELOCITY_Q;
+    advanced_key->velocity = velocity;
+}
+
 bool advanced_key_update(AdvancedKey* advanced_key, AnalogValue value)
 {
     if (advanced_key->config.mode == ADVANCED_KEY_DIGITAL_MODE)
     {
         advanced_key->difference = value - advanced_key->value;
+        advanced_key_update_velocity(advanced_key, value);
         advanced_key->value = value;
         return advanced_key_update_state(advanced_key, advanced_key_update_digital_mode(advanced_key));
     }
@@ -99,6 +111,7 @@ bool advanced_key_update(AdvancedKey* advanced_key, AnalogValue value)
     value = hysteresis_filter(&g_analog_hysteresis_filters[advanced_key->key.id], value);
 #endif
     advanced_key->difference = value - advanced_key->value;
+    advanced_key_update_velocity(advanced_key, value);
     advanced_key->value = value;
     bool state = advanced_key->key.state;
     switch (advanced_key->config.mode)
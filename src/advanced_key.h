@@ -26,6 +26,17 @@ typedef uint16_t AnalogRawValue;
 
 #define ANALOG_VALUE_RANGE (ANALOG_VALUE_MAX - ANALOG_VALUE_MIN)
 
+// Alpha-beta velocity estimator gains as right shifts, 0 and 0 give the plain one-sample difference
+// Alpha 1/2 and beta 1/4 track a steady stroke within a few ticks and damp sample noise about tenfold
+#ifndef ADVANCED_KEY_VELOCITY_ALPHA_SHIFT
+#define ADVANCED_KEY_VELOCITY_ALPHA_SHIFT 1
+#endif
+#ifndef ADVANCED_KEY_VELOCITY_BETA_SHIFT
+#define ADVANCED_KEY_VELOCITY_BETA_SHIFT 2
+#endif
+#define ADVANCED_KEY_VELOCITY_Q 8
+#define ADVANCED_KEY_VELOCITY(advanced_key) ((advanced_key)->velocity >> ADVANCED_KEY_VELOCITY_Q)
+
 #define ANALOG_VALUE_NORMALIZE(x) ((x)/(float)ANALOG_VALUE_RANGE)
 #define ANALOG_VALUE_ANTI_NORMALIZE(x) ((AnalogValue)(((float)(x))*ANALOG_VALUE_RANGE))
 
@@ -76,6 +87,9 @@ typedef struct __AdvancedKey
     AnalogValue filtered_raw;
     AnalogValue extremum;
     int16_t difference;
+    int16_t acceleration;       //per tick squared
+    int32_t velocity;           //Q8 per tick
+    int32_t estimate;           //Q8
     int32_t q_scale_to_index;
     AdvancedKeyConfiguration config;
 
@@ -6,105 +6,104 @@
 #include "color.h"
 #include "string.h"
 
+// Exact floor(x / 255) for 0 <= x < 65535
+#define COLOR_DIV255(x) (((x) + 1 + ((x) >> 8)) >> 8)
+
 void rgb_to_hsv(ColorHSV * restrict hsv, const ColorRGB * restrict rgb)
 {
-	float max;
-	float min;
-	max=rgb->r;
-	min=rgb->r;
-	max=rgb->g>max?rgb->g:max;
-	min=rgb->g<min?rgb->g:min;
-	max=rgb->b>max?rgb->b:max;
-	min=rgb->b<min?rgb->b:min;
-	if(max==min)
-	{
-		hsv->h=0;
-	}
-	else if(max==rgb->r&&rgb->g>=rgb->b)
-	{
-		hsv->h=60*(rgb->g-rgb->b)/(max-min);
-	}
-	else if(max==rgb->r && rgb->g<rgb->b)
-	{
-		hsv->h=60*(rgb->g-rgb->b)/(max-min)+360;
-	}
-	else if(max==rgb->g)
-	{
-		hsv->h=60*(rgb->b-rgb->r)/(max-min)+120;
-	}
-	else if(max==rgb->b)
-	{
-		hsv->h=60*(rgb->r-rgb->g)/(max-min)+240;
-	}
-	if(max==0)
-	{
-		hsv->s=0;
-	}
-	else
-	{
-		hsv->s=100*(1-min/max);
-	}
-	hsv->v=max*100/255;
+    int32_t r = rgb->r;
+    int32_t g = rgb->g;
+    int32_t b = rgb->b;
+    int32_t max = r > g ? r : g;
+    int32_t min = r < g ? r : g;
+    max = b > max ? b : max;
+    min = b < min ? b : min;
+    int32_t delta = max - min;
+    if (delta == 0)
+    {
+        hsv->h = 0;
+    }
+    else if (max == r)
+    {
+        hsv->h = ((60 * (g - b) + 360 * delta) / delta) % 360;
+    }
+    else if (max == g)
+    {
+        hsv->h = (60 * (b - r) + 120 * delta) / delta;
+    }
+    else
+    {
+        hsv->h = (60 * (r - g) + 240 * delta) / delta;
+    }
+    hsv->s = max == 0 ? 0 : 100 * delta / max;
+    hsv->v = max * 100 / 255;
 }
 
 void hsv_to_rgb(ColorRGB * restrict rgb, const ColorHSV * restrict hsv)
 {
-    float c = 0;
-    float x = 0;
-    float y = 0;
-    float z = 0;
-    float h = (float)(hsv->h);
-    float s = ((float)(hsv->s))/100.0;
-    float v = ((float)(hsv->v))/100.0;
-    if(s < 1e-6)
+    ColorHSV16 hsv16;
+    hsv_to_hsv16(&hsv16, hsv);
+    hsv16_to_rgb(rgb, &hsv16);
+}
+
+void hsv_to_hsv16(ColorHSV16 * restrict hsv16, const ColorHSV * restrict hsv)
+{
+    hsv16->h = COLOR_HUE16_FROM_DEGREE(hsv->h % 360);
+    hsv16->s = hsv->s >= 100 ? 255 : (hsv->s * 255 + 50) / 100;
+    hsv16->v = hsv->v >= 100 ? 255 : (hsv->v * 255 + 50) / 100;
+}
+
+void hsv16_to_rgb(ColorRGB * restrict rgb, const ColorHSV16 * restrict hsv)
+{
+    const uint32_t v = hsv->v;
+    const uint32_t s = hsv->s;
+    // Six sectors of 65536 steps each, fraction is the position inside the sector
+    const uint32_t scaled = (uint32_t)hsv->h * 6;
+    const uint8_t sector = scaled >> 16;
+    const uint32_t fraction = (scaled & 0xFFFF) >> 8;
+    const uint8_t x = COLOR_DIV255(v * (255 - s));
+    const uint8_t y = COLOR_DIV255(v * (255 - COLOR_DIV255(s * fraction)));
+    const uint8_t z = COLOR_DIV255(v * (255 - COLOR_DIV255(s * (255 - fraction))));
+    switch (sector)
     {
-        rgb->r=hsv->v*255.0/100.0;
-        rgb->g=hsv->v*255.0/100.0;
-        rgb->b=hsv->v*255.0/100.0;
+        case 0:
+            rgb->r = v;
+            rgb->g = z;
+            rgb->b = x;
+            break;
+        case 1:
+            rgb->r = y;
+            rgb->g = v;
+            rgb->b = x;
+            break;
+        case 2:
+            rgb->r = x;
+            rgb->g = v;
+            rgb->b = z;
+            break;
+        case 3:
+            rgb->r = x;
+            rgb->g = y;
+            rgb->b = v;
+            break;
+        case 4:
+            rgb->r = z;
+            rgb->g = x;
+            rgb->b = v;
+            break;
+        default:
+            rgb->r = v;
+            rgb->g = x;
+            rgb->b = y;
+            break;
     }
-    else
-    {
-        h=h/60;
-        c=h-(int)h;
+}
 
-        x = v*(1-s);
-        y = v*(1-s*c);
-        z = v*(1-s*(1-c));
-        switch (hsv->h/60)
-        {
-            case 0:
-                rgb->r = hsv->v*255.0/100.0;
-                rgb->g = z*255;
-                rgb->b = x*255;
-                break;
-            case 1:
-                rgb->r = y*255;
-                rgb->g = hsv->v*255.0/100.0;
-                rgb->b = x*255;
-                break;
-            case 2:
-                rgb->r = x*255;
-                rgb->g = hsv->v*255.0/100.0;
-                rgb->b = z*255;
-                break;
-            case 3:
-                rgb->r = x*255;
-                rgb->g = y*255;
-                rgb->b = hsv->v*255.0/100.0;
-                break;
-            case 4:
-                rgb->r = z*255;
-                rgb->g = x*255;
-                rgb->b = hsv->v*255.0/100.0;
-                break;
-            case 5:
-                rgb->r = hsv->v*255.0/100.0;
-                rgb->g = x*255;
-                rgb->b = y*255;
-                break;
-            default:
-                break;
-        }
+void hsv16_to_rgb_array(ColorRGB * restrict rgb, const ColorHSV16 * restrict hsv, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        hsv16_to_rgb(&rgb[i], &hsv[i]);
     }
 }
 
@@ -47,8 +47,21 @@ typedef struct __ColorHSV
     uint8_t v;
 } ColorHSV;
 
+// Fixed-point HSV: h covers the full circle in 0-65535, s and v are 0-255
+typedef struct __ColorHSV16
+{
+    uint16_t h;
+    uint8_t s;
+    uint8_t v;
+} ColorHSV16;
+
+#define COLOR_HUE16_FROM_DEGREE(degree) ((uint16_t)(((uint32_t)(degree) << 16) / 360))
+
 void rgb_to_hsv(ColorHSV * restrict hsv, const ColorRGB * restrict rgb);
 void hsv_to_rgb(ColorRGB * restrict rgb, const ColorHSV * restrict hsv);
+void hsv_to_hsv16(ColorHSV16 * restrict hsv16, const ColorHSV * restrict hsv);
+void hsv16_to_rgb(ColorRGB * restrict rgb, const ColorHSV16 * restrict hsv);
+void hsv16_to_rgb_array(ColorRGB * restrict rgb, const ColorHSV16 * restrict hsv, size_t count);
 void color_get_rgb(const Color * restrict color, ColorRGB * restrict rgb);
 void color_set_rgb(Color * restrict color, const ColorRGB * restrict rgb);
 void colorf_set_rgb(ColorFloat * restrict color, const ColorRGB * restrict rgb);
@@ -137,6 +137,12 @@ __WEAK int led_set(uint16_t index, uint8_t r, uint8_t g, uint8_t b)
     return 0;
 }
 
+// Boards without 16-bit PWM fall back to the 8-bit path
+__WEAK int led_set_16bit(uint16_t index, uint16_t r, uint16_t g, uint16_t b)
+{
+    return led_set(index, r >> 8, g >> 8, b >> 8);
+}
+
 __WEAK int led_flush(void)
 {
     return 0;
@@ -30,6 +30,7 @@ int flash_write(uint32_t addr, uint32_t size, const uint8_t *data);
 int flash_erase(uint32_t addr, uint32_t size);
 
 int led_set(uint16_t index, uint8_t r, uint8_t g, uint8_t b);
+int led_set_16bit(uint16_t index, uint16_t r, uint16_t g, uint16_t b);
 int led_flush(void);
 
 
@@ -6,35 +6,243 @@
 
 #include "dynamic_key.h"
 #include "layer.h"
+#include "scheduler.h"
+#include "string.h"
 
-#define DK_TAP_DURATION KEYBOARD_TIME_TO_TICK(5)
+#define DK_TAP_DURATION_US 5000
 
-#define DYNAMIC_KEY_NOT_MATCH(dynamic_key, key) (KEYCODE_GET_MAIN(layer_cache_get_keycode((key)->id)) != DYNAMIC_KEY || \
-        &g_dynamic_keys[KEYCODE_GET_SUB(layer_cache_get_keycode((key)->id))] != ((DynamicKey*)(dynamic_key)))
+#define DYNAMIC_KEY_INDEX_NONE 0xFF
+
+#define DYNAMIC_KEY_NOT_MATCH(dynamic_key, key) (dynamic_key_index[(key)->id] != (uint8_t)((DynamicKey*)(dynamic_key) - g_dynamic_keys))
 
 DynamicKey g_dynamic_keys[DYNAMIC_KEY_NUM];
 
+// Dynamic key each key id currently maps to through the layer cache
+static uint8_t dynamic_key_index[TOTAL_KEY_NUM];
+// Dynamic keys whose bound keys all map back to them
+static uint8_t dynamic_key_active[DYNAMIC_KEY_NUM];
+static uint8_t dynamic_key_active_num;
+
+static bool dynamic_key_is_bound(uint8_t index, uint16_t id)
+{
+    return id < TOTAL_KEY_NUM && dynamic_key_index[id] == index;
+}
+
+// Whether every key bound to the dynamic key maps back to it
+static bool dynamic_key_check_bound(uint8_t index)
+{
+    DynamicKey *dynamic_key = &g_dynamic_keys[index];
+    switch (dynamic_key->type)
+    {
+    case DYNAMIC_KEY_STROKE:
+        return dynamic_key_is_bound(index, dynamic_key->dks.key_id);
+    case DYNAMIC_KEY_MOD_TAP:
+        return dynamic_key_is_bound(index, dynamic_key->mt.key_id);
+    case DYNAMIC_KEY_TOGGLE_KEY:
+        return dynamic_key_is_bound(index, dynamic_key->tk.key_id);
+    case DYNAMIC_KEY_MUTEX:
+        return dynamic_key_is_bound(index, dynamic_key->m.key_id[0]) && dynamic_key_is_bound(index, dynamic_key->m.key_id[1]);
+    case DYNAMIC_KEY_MULTI_THRESHOLD:
+        return dynamic_key_is_bound(index, dynamic_key->mth.key_id);
+    case DYNAMIC_KEY_TAP_DANCE:
+        return dynamic_key_is_bound(index, dynamic_key->td.key_id);
+    default:
+        return false;
+    }
+}
+
+static void dynamic_key_update_active(void)
+{
+    dynamic_key_active_num = 0;
+    for (uint8_t i = 0; i < DYNAMIC_KEY_NUM; i++)
+    {
+        if (dynamic_key_check_bound(i))
+        {
+            dynamic_key_active[dynamic_key_active_num++] = i;
+        }
+    }
+}
+
+// Adds or removes one dynamic key, the active list stays sorted by index
+static void dynamic_key_update_one_active(uint8_t index)
+{
+    uint8_t pos = 0;
+    if (index >= DYNAMIC_KEY_NUM)
+    {
+        return;
+    }
+    while (pos < dynamic_key_active_num && dynamic_key_active[pos] < index)
+    {
+        pos++;
+    }
+    bool listed = pos < dynamic_key_active_num && dynamic_key_active[pos] == index;
+    bool bound = dynamic_key_check_bound(index);
+    if (bound && !listed)
+    {
+        memmove(dynamic_key_active + pos + 1, dynamic_key_active + pos, dynamic_key_active_num - pos);
+        dynamic_key_active[pos] = index;
+        dynamic_key_active_num++;
+    }
+    else if (!bound && listed)
+    {
+        dynamic_key_active_num--;
+        memmove(dynamic_key_active + pos, dynamic_key_active + pos + 1, dynamic_key_active_num - pos);
+    }
+}
+
+static void dynamic_key_update_one_index(uint16_t id)
+{
+    Keycode keycode = layer_cache_get_keycode(id);
+    dynamic_key_index[id] = (KEYCODE_GET_MAIN(keycode) == DYNAMIC_KEY && KEYCODE_GET_SUB(keycode) < DYNAMIC_KEY_NUM) ?
+        KEYCODE_GET_SUB(keycode) : DYNAMIC_KEY_INDEX_NONE;
+}
+
+void dynamic_key_update_index(void)
+{
+    for (uint16_t i = 0; i < TOTAL_KEY_NUM; i++)
+    {
+        dynamic_key_update_one_index(i);
+    }
+    dynamic_key_update_active();
+}
+
+// Only the dynamic keys the id moved between can change their active state
+void dynamic_key_update_key_index(uint16_t id)
+{
+    uint8_t previous = dynamic_key_index[id];
+    dynamic_key_update_one_index(id);
+    if (dynamic_key_index[id] == previous)
+    {
+        return;
+    }
+    dynamic_key_update_one_active(previous);
+    dynamic_key_update_one_active(dynamic_key_index[id]);
+}
+
+// Only edges are dispatched, held bindings reach the report through dynamic_key_add_buffer()
+static inline void dynamic_key_emit_edge(Keycode keycode, bool state, bool next_state, Key *key)
+{
+    if (state != next_state)
+    {
+        keyboard_event_handler(MK_EVENT(keycode, CALC_EVENT(state, next_state), key));
+    }
+}
+
+static void dynamic_key_process_one(DynamicKey *dynamic_key)
+{
+    switch (dynamic_key->type)
+    {
+    case DYNAMIC_KEY_STROKE:
+        dynamic_key_s_process((DynamicKeyStroke4x4*)dynamic_key);
+        break;
+    case DYNAMIC_KEY_MOD_TAP:
+        dynamic_key_mt_process((DynamicKeyModTap*)dynamic_key);
+        break;
+    case DYNAMIC_KEY_TOGGLE_KEY:
+        dynamic_key_tk_process((DynamicKeyToggleKey*)dynamic_key);
+        break;
+    case DYNAMIC_KEY_MUTEX:
+        dynamic_key_m_process((DynamicKeyMutex*)dynamic_key);
+        break;
+    case DYNAMIC_KEY_MULTI_THRESHOLD:
+        dynamic_key_mth_process((DynamicKeyMultiThreshold*)dynamic_key);
+        break;
+    case DYNAMIC_KEY_TAP_DANCE:
+        dynamic_key_td_process((DynamicKeyTapDance*)dynamic_key);
+        break;
+    default:
+        break;
+    }
+}
+
+// Woken by the shared scheduler when the earliest tap or hold deadline of the dynamic key is due
+static void dynamic_key_timer(void *owner)
+{
+    dynamic_key_process_one((DynamicKey*)owner);
+}
+
+// Every dynamic key owns a scheduler slot, SCHEDULER_MAX_TASKS is checked against DYNAMIC_KEY_NUM at build time
+static void dynamic_key_arm(void *dynamic_key, uint32_t deadline)
+{
+    scheduler_set(dynamic_key, dynamic_key_timer, deadline);
+}
+
+static inline uint32_t dynamic_key_deadline(uint32_t now, uint32_t duration_us)
+{
+    uint32_t deadline = now + duration_us;
+    // DK_NO_DEADLINE marks held bindings
+    return deadline == DK_NO_DEADLINE ? 0 : deadline;
+}
+
+// Whether the bound keys moved since the last update, timers are run by the scheduler
+static bool dynamic_key_is_dirty(DynamicKey *dynamic_key)
+{
+    switch (dynamic_key->type)
+    {
+    case DYNAMIC_KEY_STROKE:
+        return keyboard_get_key_analog_value(keyboard_get_key(dynamic_key->dks.key_id)) != dynamic_key->dks.value;
+    case DYNAMIC_KEY_MOD_TAP:
+        return keyboard_get_key(dynamic_key->mt.key_id)->state != dynamic_key->mt.key_state;
+    case DYNAMIC_KEY_TOGGLE_KEY:
+        return keyboard_get_key(dynamic_key->tk.key_id)->state != dynamic_key->tk.key_state;
+    case DYNAMIC_KEY_MUTEX:
+    {
+        DynamicKeyMutex *dynamic_key_m = &dynamic_key->m;
+        // Distance based modes follow the analog values, not just the states
+        if ((dynamic_key_m->mode & 0x0F) == DK_MUTEX_DISTANCE_PRIORITY || (dynamic_key_m->mode & 0xF0))
+        {
+            return true;
+        }
+        return keyboard_get_key(dynamic_key_m->key_id[0])->state != dynamic_key_m->key_state[0] ||
+            keyboard_get_key(dynamic_key_m->key_id[1])->state != dynamic_key_m->key_state[1];
+    }
+    case DYNAMIC_KEY_MULTI_THRESHOLD:
+        return keyboard_get_key_analog_value(keyboard_get_key(dynamic_key->mth.key_id)) != dynamic_key->mth.value;
+    case DYNAMIC_KEY_TAP_DANCE:
+        return keyboard_get_key(dynamic_key->td.key_id)->state != dynamic_key->td.key_state;
+    default:
+        return false;
+    }
+}
+
+// The scan rewrites report states every tick, idle dynamic keys put theirs back
+static void dynamic_key_restore_report_state(DynamicKey *dynamic_key)
+{
+    switch (dynamic_key->type)
+    {
+    case DYNAMIC_KEY_STROKE:
+        keyboard_key_set_report_state(keyboard_get_key(dynamic_key->dks.key_id), dynamic_key->dks.key_state > 0);
+        break;
+    case DYNAMIC_KEY_MOD_TAP:
+        keyboard_key_set_report_state(keyboard_get_key(dynamic_key->mt.key_id), dynamic_key->mt.key_report_state);
+        break;
+    case DYNAMIC_KEY_MUTEX:
+        keyboard_key_set_report_state(keyboard_get_key(dynamic_key->m.key_id[0]), dynamic_key->m.key_report_state[0]);
+        keyboard_key_set_report_state(keyboard_get_key(dynamic_key->m.key_id[1]), dynamic_key->m.key_report_state[1]);
+        break;
+    case DYNAMIC_KEY_MULTI_THRESHOLD:
+        keyboard_key_set_report_state(keyboard_get_key(dynamic_key->mth.key_id), dynamic_key->mth.level > 0);
+        break;
+    case DYNAMIC_KEY_TAP_DANCE:
+        keyboard_key_set_report_state(keyboard_get_key(dynamic_key->td.key_id), dynamic_key->td.action != KEY_NO_EVENT);
+        break;
+    default:
+        break;
+    }
+}
+
 void dynamic_key_process(void)
 {
-    for (int i = 0; i < DYNAMIC_KEY_NUM && g_dynamic_keys[i].type != DYNAMIC_KEY_NONE; i++)
+    for (uint8_t i = 0; i < dynamic_key_active_num; i++)
     {
-        DynamicKey * dynamic_key = &g_dynamic_keys[i];
-        switch (dynamic_key->type)
+        DynamicKey *dynamic_key = &g_dynamic_keys[dynamic_key_active[i]];
+        if (dynamic_key_is_dirty(dynamic_key))
         {
-        case DYNAMIC_KEY_STROKE:
-            dynamic_key_s_process((DynamicKeyStroke4x4*)dynamic_key);
-            break;
-        case DYNAMIC_KEY_MOD_TAP:
-            dynamic_key_mt_process((DynamicKeyModTap*)dynamic_key);
-            break;
-        case DYNAMIC_KEY_TOGGLE_KEY:
-            dynamic_key_tk_process((DynamicKeyToggleKey*)dynamic_key);
-            break;
-        case DYNAMIC_KEY_MUTEX:
-            dynamic_key_m_process((DynamicKeyMutex*)dynamic_key);
-            break;
-        default:
-            break;
+            dynamic_key_process_one(dynamic_key);
+        }
+        else
+        {
+            dynamic_key_restore_report_state(dynamic_key);
         }
     }
 }
@@ -80,6 +288,25 @@ void _dynamic_key_add_buffer(DynamicKey*dynamic_key)
             keyboard_add_buffer(MK_EVENT(dynamic_key_m->key_binding[1], KEYBOARD_EVENT_NO_EVENT,  keyboard_get_key(dynamic_key_m->key_id[1])));
         break;
     }
+    case DYNAMIC_KEY_MULTI_THRESHOLD:
+    {
+        DynamicKeyMultiThreshold*dynamic_key_mth=(DynamicKeyMultiThreshold*)dynamic_key;
+        for (uint8_t i = 0; i < dynamic_key_mth->level; i++)
+        {
+            if (dynamic_key_mth->mode == DK_MULTI_THRESHOLD_ALL || i + 1 == dynamic_key_mth->level)
+                keyboard_add_buffer(MK_EVENT(dynamic_key_mth->key_binding[i], KEYBOARD_EVENT_NO_EVENT, keyboard_get_key(dynamic_key_mth->key_id)));
+        }
+        break;
+    }
+    case DYNAMIC_KEY_TAP_DANCE:
+    {
+        DynamicKeyTapDance*dynamic_key_td=(DynamicKeyTapDance*)dynamic_key;
+        if (dynamic_key_td->action)
+        {
+            keyboard_add_buffer(MK_EVENT(dynamic_key_td->action, KEYBOARD_EVENT_NO_EVENT, keyboard_get_key(dynamic_key_td->key_id)));
+        }
+        break;
+    }
     default:
         break;
     }
@@ -87,10 +314,9 @@ void _dynamic_key_add_buffer(DynamicKey*dynamic_key)
 
 void dynamic_key_add_buffer(void)
 {
-    for (int i = 0; i < DYNAMIC_KEY_NUM && g_dynamic_keys[i].type != DYNAMIC_KEY_NONE; i++)
+    for (uint8_t i = 0; i < dynamic_key_active_num; i++)
     {
-        DynamicKey*dynamic_key = &g_dynamic_keys[i];
-        _dynamic_key_add_buffer(dynamic_key);
+        _dynamic_key_add_buffer(&g_dynamic_keys[dynamic_key_active[i]]);
     }
 }
 
@@ -100,7 +326,7 @@ void dynamic_key_add_buffer(void)
 #define DKS_RELEASE_FULLY 6
 #define DKS_GET_KEY_CONTROL(key_ctrl, n) (((key_ctrl) >> (n)) & 0x03)
 
-static inline void dynamic_key_s_update_state(DynamicKeyStroke4x4 *dk, uint8_t stage_shift)
+static inline void dynamic_key_s_update_state(DynamicKeyStroke4x4 *dk, uint8_t stage_shift, uint32_t now)
 {
     for (int i = 0; i < 4; i++)
     {
@@ -110,11 +336,11 @@ static inline void dynamic_key_s_update_state(DynamicKeyStroke4x4 *dk, uint8_t s
             BIT_RESET(dk->key_state, i);
             break;
         case DKS_TAP:
-            dk->key_end_tick[i] = g_keyboard_tick + DK_TAP_DURATION;
+            dk->key_end_time[i] = dynamic_key_deadline(now, DK_TAP_DURATION_US);
             BIT_SET(dk->key_state, i);
             break;
         case DKS_HOLD:
-            dk->key_end_tick[i] = 0xFFFFFFFF;
+            dk->key_end_time[i] = DK_NO_DEADLINE;
             BIT_SET(dk->key_state, i);
             break;
         default:
@@ -135,6 +361,7 @@ void dynamic_key_s_process(DynamicKeyStroke4x4*dynamic_key)
     AnalogValue last_value = dynamic_key_s->value;
     AnalogValue current_value = keyboard_get_key_analog_value(key);
     uint8_t last_key_state = dynamic_key_s->key_state;
+    const uint32_t now = scheduler_get_time_us();
 
     AnalogValue current_relative_value = current_value - ANALOG_VALUE_MIN;
     AnalogValue last_relative_value = last_value - ANALOG_VALUE_MIN;
@@ -143,32 +370,49 @@ void dynamic_key_s_process(DynamicKeyStroke4x4*dynamic_key)
     {
         if (current_relative_value >= dynamic_key_s->press_begin_distance && last_relative_value < dynamic_key_s->press_begin_distance)
         {
-            dynamic_key_s_update_state(dynamic_key, DKS_PRESS_BEGIN);
+            dynamic_key_s_update_state(dynamic_key, DKS_PRESS_BEGIN, now);
         }
         if (current_relative_value >= dynamic_key_s->press_fully_distance && last_relative_value < dynamic_key_s->press_fully_distance)
         {
-            dynamic_key_s_update_state(dynamic_key, DKS_PRESS_FULLY);
+            dynamic_key_s_update_state(dynamic_key, DKS_PRESS_FULLY, now);
         }
     }
     else if (current_value < last_value)
     {
         if (current_relative_value <= dynamic_key_s->release_begin_distance && last_relative_value > dynamic_key_s->release_begin_distance)
         {
-            dynamic_key_s_update_state(dynamic_key, DKS_RELEASE_BEGIN);
+            dynamic_key_s_update_state(dynamic_key, DKS_RELEASE_BEGIN, now);
         }
         if (current_relative_value <= dynamic_key_s->release_fully_distance && last_relative_value > dynamic_key_s->release_fully_distance)
         {
-            dynamic_key_s_update_state(dynamic_key, DKS_RELEASE_FULLY);
+            dynamic_key_s_update_state(dynamic_key, DKS_RELEASE_FULLY, now);
         }
     }
+    bool pending = false;
+    uint32_t deadline = 0;
     for (int i = 0; i < 4; i++)
     {
-        if (g_keyboard_tick > dynamic_key_s->key_end_tick[i])
+        if (BIT_GET(dynamic_key_s->key_state, i) && dynamic_key_s->key_end_time[i] != DK_NO_DEADLINE)
         {
-            BIT_RESET(dynamic_key_s->key_state, i);
+            if (SCHEDULER_IS_DUE(dynamic_key_s->key_end_time[i], now))
+            {
+                BIT_RESET(dynamic_key_s->key_state, i);
+            }
+            else if (!pending || (int32_t)(dynamic_key_s->key_end_time[i] - deadline) < 0)
+            {
+                pending = true;
+                deadline = dynamic_key_s->key_end_time[i];
+            }
         }
-        keyboard_event_handler(MK_EVENT(dynamic_key_s->key_binding[i], 
-            CALC_EVENT(BIT_GET(last_key_state, i), BIT_GET(dynamic_key_s->key_state, i)), key));
+        dynamic_key_emit_edge(dynamic_key_s->key_binding[i], BIT_GET(last_key_state, i), BIT_GET(dynamic_key_s->key_state, i), key);
+    }
+    if (pending)
+    {
+        dynamic_key_arm(dynamic_key_s, deadline);
+    }
+    else
+    {
+        scheduler_cancel(dynamic_key_s);
     }
     keyboard_key_set_report_state(key, dynamic_key_s->key_state > 0);
     dynamic_key_s->value = current_value;
@@ -184,15 +428,17 @@ void dynamic_key_mt_process(DynamicKeyModTap*dynamic_key)
     }
     bool last_report_state = dynamic_key_mt->key_report_state;
     bool next_report_state = dynamic_key_mt->key_report_state;
+    const uint32_t now = scheduler_get_time_us();
+    const uint32_t duration = SCHEDULER_TICK_TO_US(dynamic_key_mt->duration);
     if (IS_POS_EDGE(dynamic_key_mt->key_state , key->state))
     {
-        dynamic_key_mt->begin_tick = g_keyboard_tick;
+        dynamic_key_mt->begin_time = now;
     }
     if (IS_NEG_EDGE(dynamic_key_mt->key_state, key->state))
     {
-        if (g_keyboard_tick - dynamic_key_mt->begin_tick < dynamic_key_mt->duration)
+        if (now - dynamic_key_mt->begin_time < duration)
         {
-            dynamic_key_mt->end_tick = g_keyboard_tick+DK_TAP_DURATION;
+            dynamic_key_mt->end_time = dynamic_key_deadline(now, DK_TAP_DURATION_US);
             dynamic_key_mt->state = DYNAMIC_KEY_ACTION_TAP;
             next_report_state = true;
         }
@@ -200,23 +446,34 @@ void dynamic_key_mt_process(DynamicKeyModTap*dynamic_key)
         {
             next_report_state = false;
         }
-        dynamic_key_mt->begin_tick = g_keyboard_tick;
+        dynamic_key_mt->begin_time = now;
     }
-    if (key->state && !last_report_state && (g_keyboard_tick - dynamic_key_mt->begin_tick > dynamic_key_mt->duration))
+    if (key->state && !last_report_state && now - dynamic_key_mt->begin_time >= duration)
     {
-        dynamic_key_mt->end_tick = 0xFFFFFFFF;
+        dynamic_key_mt->end_time = DK_NO_DEADLINE;
         dynamic_key_mt->state = DYNAMIC_KEY_ACTION_HOLD;
         next_report_state = true;
     }
-    if (g_keyboard_tick > dynamic_key_mt->end_tick && last_report_state)
+    if (last_report_state && dynamic_key_mt->end_time != DK_NO_DEADLINE && SCHEDULER_IS_DUE(dynamic_key_mt->end_time, now))
     {
         next_report_state = false;
     }
-    keyboard_event_handler(MK_EVENT(dynamic_key_mt->key_binding[DYNAMIC_KEY_ACTION_TAP], 
-        CALC_EVENT(dynamic_key_mt->state == DYNAMIC_KEY_ACTION_TAP && last_report_state, dynamic_key_mt->state == DYNAMIC_KEY_ACTION_TAP && next_report_state), key));
+    // The tap ends at its deadline, a press that is not reported yet turns into a hold
+    if (next_report_state && dynamic_key_mt->end_time != DK_NO_DEADLINE)
+    {
+        dynamic_key_arm(dynamic_key_mt, dynamic_key_mt->end_time);
+    }
+    else if (key->state && !next_report_state)
+    {
+        dynamic_key_arm(dynamic_key_mt, dynamic_key_mt->begin_time + duration);
+    }
+    else
+    {
+        scheduler_cancel(dynamic_key_mt);
+    }
+    dynamic_key_emit_edge(dynamic_key_mt->key_binding[DYNAMIC_KEY_ACTION_TAP], dynamic_key_mt->state == DYNAMIC_KEY_ACTION_TAP && last_report_state, dynamic_key_mt->state == DYNAMIC_KEY_ACTION_TAP && next_report_state, key);
     keyboard_key_set_report_state(key, next_report_state);
-    keyboard_event_handler(MK_EVENT(dynamic_key_mt->key_binding[DYNAMIC_KEY_ACTION_HOLD], 
-        CALC_EVENT(dynamic_key_mt->state == DYNAMIC_KEY_ACTION_HOLD && last_report_state, dynamic_key_mt->state == DYNAMIC_KEY_ACTION_HOLD && next_report_state), key));
+    dynamic_key_emit_edge(dynamic_key_mt->key_binding[DYNAMIC_KEY_ACTION_HOLD], dynamic_key_mt->state == DYNAMIC_KEY_ACTION_HOLD && last_report_state, dynamic_key_mt->state == DYNAMIC_KEY_ACTION_HOLD && next_report_state, key);
     keyboard_key_set_report_state(key, next_report_state);
     dynamic_key_mt->key_state = key->state;
     dynamic_key_mt->key_report_state = next_report_state;
@@ -235,7 +492,7 @@ void dynamic_key_tk_process(DynamicKeyToggleKey*dynamic_key)
     {
         next_state = !dynamic_key_tk->state;
     }
-    keyboard_event_handler(MK_EVENT(dynamic_key_tk->key_binding, CALC_EVENT(dynamic_key_tk->state, next_state), key));
+    dynamic_key_emit_edge(dynamic_key_tk->key_binding, dynamic_key_tk->state, next_state, key);
     dynamic_key_tk->key_state = key->state;
     dynamic_key_tk->state = next_state;
 }
@@ -329,12 +586,169 @@ void dynamic_key_m_process(DynamicKeyMutex*dynamic_key)
             next_key1_report_state = true;
         }
     }
-    keyboard_event_handler(MK_EVENT(dynamic_key_m->key_binding[0], CALC_EVENT(dynamic_key_m->key_report_state[0], next_key0_report_state), key0));
+    dynamic_key_emit_edge(dynamic_key_m->key_binding[0], dynamic_key_m->key_report_state[0], next_key0_report_state, key0);
     keyboard_key_set_report_state(key0, next_key0_report_state);
-    keyboard_event_handler(MK_EVENT(dynamic_key_m->key_binding[1], CALC_EVENT(dynamic_key_m->key_report_state[1], next_key1_report_state), key1));
+    dynamic_key_emit_edge(dynamic_key_m->key_binding[1], dynamic_key_m->key_report_state[1], next_key1_report_state, key1);
     keyboard_key_set_report_state(key1, next_key1_report_state);
     dynamic_key_m->key_state[0] = key0->state;
     dynamic_key_m->key_state[1] = key1->state;
     dynamic_key_m->key_report_state[0] = next_key0_report_state;
     dynamic_key_m->key_report_state[1] = next_key1_report_state;
 }
+
+// Number of thresholds at or below value
+static uint8_t dynamic_key_mth_search(const DynamicKeyMultiThreshold*dynamic_key_mth, uint8_t num, AnalogValue value)
+{
+    uint8_t low = 0;
+    uint8_t high = num;
+    while (low < high)
+    {
+        uint8_t mid = (low + high) / 2;
+        if (dynamic_key_mth->threshold[mid] <= value)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void dynamic_key_mth_process(DynamicKeyMultiThreshold*dynamic_key)
+{
+    DynamicKeyMultiThreshold*dynamic_key_mth=(DynamicKeyMultiThreshold*)dynamic_key;
+    Key * key = keyboard_get_key(dynamic_key_mth->key_id);
+    if (DYNAMIC_KEY_NOT_MATCH(dynamic_key,key))
+    {
+        return;
+    }
+    const uint8_t num = dynamic_key_mth->threshold_num < DK_MULTI_THRESHOLD_NUM ? dynamic_key_mth->threshold_num : DK_MULTI_THRESHOLD_NUM;
+    AnalogValue current_value = keyboard_get_key_analog_value(key);
+    AnalogValue current_relative_value = current_value - ANALOG_VALUE_MIN;
+    uint8_t last_level = dynamic_key_mth->level;
+    uint8_t next_level = dynamic_key_mth_search(dynamic_key_mth, num, current_relative_value);
+    if (next_level < last_level)
+    {
+        // A level is only left once the value falls a hysteresis below its threshold
+        AnalogValue released_value = current_relative_value > ANALOG_VALUE_RANGE - dynamic_key_mth->hysteresis ?
+            ANALOG_VALUE_RANGE : current_relative_value + dynamic_key_mth->hysteresis;
+        uint8_t held_level = dynamic_key_mth_search(dynamic_key_mth, num, released_value);
+        next_level = held_level < last_level ? held_level : last_level;
+    }
+    for (uint8_t i = 0; i < num; i++)
+    {
+        bool last_state = dynamic_key_mth->mode == DK_MULTI_THRESHOLD_ALL ? i < last_level : i + 1 == last_level;
+        bool next_state = dynamic_key_mth->mode == DK_MULTI_THRESHOLD_ALL ? i < next_level : i + 1 == next_level;
+        dynamic_key_emit_edge(dynamic_key_mth->key_binding[i], last_state, next_state, key);
+    }
+    keyboard_key_set_report_state(key, next_level > 0);
+    dynamic_key_mth->level = next_level;
+    dynamic_key_mth->value = current_value;
+}
+
+static void dynamic_key_td_set_action(DynamicKeyTapDance*dynamic_key_td, Keycode action, Key*key)
+{
+    if (dynamic_key_td->action)
+    {
+        keyboard_event_handler(MK_EVENT(dynamic_key_td->action, KEYBOARD_EVENT_KEY_UP, key));
+    }
+    if (action)
+    {
+        keyboard_event_handler(MK_EVENT(action, KEYBOARD_EVENT_KEY_DOWN, key));
+    }
+    dynamic_key_td->action = action;
+}
+
+// Pressed, released and tap each wait on the deadline
+static inline bool dynamic_key_td_is_timing(const DynamicKeyTapDance*dynamic_key_td)
+{
+    return dynamic_key_td->state == DK_TAP_DANCE_PRESSED || dynamic_key_td->state == DK_TAP_DANCE_RELEASED ||
+        dynamic_key_td->state == DK_TAP_DANCE_TAP;
+}
+
+static void dynamic_key_td_tap(DynamicKeyTapDance*dynamic_key_td, Key*key, uint32_t now)
+{
+    dynamic_key_td_set_action(dynamic_key_td, dynamic_key_td->key_binding[dynamic_key_td->count - 1], key);
+    dynamic_key_td->state = DK_TAP_DANCE_TAP;
+    dynamic_key_td->deadline = dynamic_key_deadline(now, DK_TAP_DURATION_US);
+}
+
+void dynamic_key_td_process(DynamicKeyTapDance*dynamic_key)
+{
+    DynamicKeyTapDance*dynamic_key_td=(DynamicKeyTapDance*)dynamic_key;
+    Key * key = keyboard_get_key(dynamic_key_td->key_id);
+    if (DYNAMIC_KEY_NOT_MATCH(dynamic_key,key))
+    {
+        return;
+    }
+    const uint32_t now = scheduler_get_time_us();
+    const uint32_t window = SCHEDULER_TICK_TO_US(dynamic_key_td->window);
+    if (IS_POS_EDGE(dynamic_key_td->key_state, key->state))
+    {
+        if (dynamic_key_td->state != DK_TAP_DANCE_RELEASED)
+        {
+            // A new dance cuts the tap of the previous one short
+            dynamic_key_td_set_action(dynamic_key_td, KEY_NO_EVENT, key);
+            dynamic_key_td->count = 0;
+        }
+        if (dynamic_key_td->count < DK_TAP_DANCE_NUM)
+        {
+            dynamic_key_td->count++;
+        }
+        dynamic_key_td->state = DK_TAP_DANCE_PRESSED;
+        dynamic_key_td->deadline = dynamic_key_deadline(now, window);
+    }
+    if (IS_NEG_EDGE(dynamic_key_td->key_state, key->state))
+    {
+        if (dynamic_key_td->state == DK_TAP_DANCE_HOLD)
+        {
+            dynamic_key_td_set_action(dynamic_key_td, KEY_NO_EVENT, key);
+            dynamic_key_td->state = DK_TAP_DANCE_IDLE;
+        }
+        else if (dynamic_key_td->state == DK_TAP_DANCE_PRESSED)
+        {
+            dynamic_key_td->state = DK_TAP_DANCE_RELEASED;
+            dynamic_key_td->deadline = dynamic_key_deadline(now, window);
+            // No further tap can change the outcome
+            if (dynamic_key_td->count >= DK_TAP_DANCE_NUM)
+            {
+                dynamic_key_td_tap(dynamic_key_td, key, now);
+            }
+        }
+    }
+    if (dynamic_key_td_is_timing(dynamic_key_td) && SCHEDULER_IS_DUE(dynamic_key_td->deadline, now))
+    {
+        switch (dynamic_key_td->state)
+        {
+        case DK_TAP_DANCE_PRESSED:
+        {
+            Keycode hold = dynamic_key_td->hold_binding[dynamic_key_td->count - 1];
+            dynamic_key_td_set_action(dynamic_key_td, hold ? hold : dynamic_key_td->key_binding[dynamic_key_td->count - 1], key);
+            dynamic_key_td->state = DK_TAP_DANCE_HOLD;
+            break;
+        }
+        case DK_TAP_DANCE_RELEASED:
+            dynamic_key_td_tap(dynamic_key_td, key, now);
+            break;
+        case DK_TAP_DANCE_TAP:
+            dynamic_key_td_set_action(dynamic_key_td, KEY_NO_EVENT, key);
+            dynamic_key_td->state = DK_TAP_DANCE_IDLE;
+            break;
+        default:
+            break;
+        }
+    }
+    // The window and the tap run on the scheduler, which advances the dance when they close
+    if (dynamic_key_td_is_timing(dynamic_key_td))
+    {
+        dynamic_key_arm(dynamic_key_td, dynamic_key_td->deadline);
+    }
+    else
+    {
+        scheduler_cancel(dynamic_key_td);
+    }
+    keyboard_key_set_report_state(key, dynamic_key_td->action != KEY_NO_EVENT);
+    dynamic_key_td->key_state = key->state;
+}
@@ -16,6 +16,11 @@ extern "C" {
 #define DYNAMIC_KEY_NUM 32
 #endif
 
+#define DK_NO_DEADLINE 0xFFFFFFFF
+
+#define DK_MULTI_THRESHOLD_NUM 8
+#define DK_TAP_DANCE_NUM 4
+
 typedef enum __DynamicKeyType
 {
     DYNAMIC_KEY_NONE,
@@ -23,6 +28,8 @@ typedef enum __DynamicKeyType
     DYNAMIC_KEY_MOD_TAP,
     DYNAMIC_KEY_TOGGLE_KEY,
     DYNAMIC_KEY_MUTEX,
+    DYNAMIC_KEY_MULTI_THRESHOLD,
+    DYNAMIC_KEY_TAP_DANCE,
     DYNAMIC_KEY_TYPE_NUM
 } DynamicKeyType;
 
@@ -52,7 +59,8 @@ typedef struct __DynamicKeyStroke4x4
     AnalogValue release_fully_distance;
     uint16_t key_id;
     AnalogValue value;
-    uint32_t key_end_tick[4];
+    // Tap deadlines in scheduler_get_time_us() time, DK_NO_DEADLINE while a binding is held
+    uint32_t key_end_time[4];
     uint8_t key_state;
 } DynamicKeyStroke4x4;
 
@@ -62,8 +70,9 @@ typedef struct __DynamicKeyModTap
     Keycode key_binding[2];
     uint32_t duration;
     uint16_t key_id;
-    uint32_t begin_tick;
-    uint32_t end_tick;
+    // Scheduler times, the duration stays in ticks
+    uint32_t begin_time;
+    uint32_t end_time;
     uint8_t state;
     uint8_t key_state;
     uint8_t key_report_state;
@@ -98,6 +107,51 @@ typedef struct __DynamicKeyMutex
     uint8_t key_report_state[2];
 } DynamicKeyMutex;
 
+typedef enum __DynamicKeyMultiThresholdMode
+{
+    DK_MULTI_THRESHOLD_HIGHEST,
+    DK_MULTI_THRESHOLD_ALL,
+} DynamicKeyMultiThresholdMode;
+
+// Thresholds are ascending distances, the level is how many of them the key has reached
+typedef struct __DynamicKeyMultiThreshold
+{
+    uint32_t type;
+    Keycode key_binding[DK_MULTI_THRESHOLD_NUM];
+    AnalogValue threshold[DK_MULTI_THRESHOLD_NUM];
+    AnalogValue hysteresis;
+    uint16_t key_id;
+    AnalogValue value;
+    uint8_t threshold_num;
+    uint8_t mode;
+    uint8_t level;
+} DynamicKeyMultiThreshold;
+
+typedef enum __DynamicKeyTapDanceState
+{
+    DK_TAP_DANCE_IDLE,
+    DK_TAP_DANCE_PRESSED,
+    DK_TAP_DANCE_RELEASED,
+    DK_TAP_DANCE_HOLD,
+    DK_TAP_DANCE_TAP,
+} DynamicKeyTapDanceState;
+
+// Bindings are picked by tap count, the hold binding when the last press outlasts the window
+typedef struct __DynamicKeyTapDance
+{
+    uint32_t type;
+    Keycode key_binding[DK_TAP_DANCE_NUM];
+    Keycode hold_binding[DK_TAP_DANCE_NUM];
+    uint32_t window;
+    uint16_t key_id;
+    Keycode action;
+    // Close of the window or the tap in scheduler_get_time_us() time
+    uint32_t deadline;
+    uint8_t count;
+    uint8_t state;
+    uint8_t key_state;
+} DynamicKeyTapDance;
+
 typedef union __DynamicKey
 {
     uint32_t type;
@@ -105,17 +159,23 @@ typedef union __DynamicKey
     DynamicKeyModTap mt;
     DynamicKeyToggleKey tk;
     DynamicKeyMutex m;
+    DynamicKeyMultiThreshold mth;
+    DynamicKeyTapDance td;
     uint32_t aligned_buffer[15];
 } DynamicKey;
 
 extern DynamicKey g_dynamic_keys[DYNAMIC_KEY_NUM];
 
+void dynamic_key_update_index(void);
+void dynamic_key_update_key_index(uint16_t id);
 void dynamic_key_process(void);
 void dynamic_key_add_buffer(void);
 void dynamic_key_s_process (DynamicKeyStroke4x4*dynamic_key);
 void dynamic_key_mt_process(DynamicKeyModTap*dynamic_key);
 void dynamic_key_tk_process(DynamicKeyToggleKey*dynamic_key);
 void dynamic_key_m_process (DynamicKeyMutex*dynamic_key);
+void dynamic_key_mth_process(DynamicKeyMultiThreshold*dynamic_key);
+void dynamic_key_td_process(DynamicKeyTapDance*dynamic_key);
 
 #ifdef __cplusplus
 }
@@ -56,6 +56,7 @@
 #endif
 #include "event_cache.h"
 #include "event_buffer.h"
+#include "scheduler.h"
 
 __WEAK AdvancedKey g_keyboard_advanced_keys[ADVANCED_KEY_NUM];
 __WEAK Key g_keyboard_keys[KEY_NUM];
@@ -519,6 +520,7 @@ void keyboard_init(void)
     event_cache_init();
 #endif
     event_loop_queue_init(&event_buffer, event_buffers, EVENT_BUFFER_LENGTH);
+    scheduler_init();
 #ifdef MACRO_ENABLE
     macro_init();
 #endif
@@ -556,6 +558,10 @@ __WEAK void keyboard_reset_to_default(void)
 #endif
 #ifdef DYNAMICKEY_ENABLE
     memset(g_dynamic_keys, 0, sizeof(g_dynamic_keys));
+    dynamic_key_update_index();
+#endif
+#ifdef MACRO_ENABLE
+    macro_factory_reset();
 #endif
 #ifdef SCRIPT_ENABLE
     script_factory_reset();
@@ -569,6 +575,9 @@ void keyboard_factory_reset(void)
     for (int i = 0; i < STORAGE_PROFILE_FILE_NUM; i++)
     {
         g_current_profile_index = i;
+#ifdef MACRO_ENABLE
+        macro_factory_reset();
+#endif
         storage_save_profile();
     }
     g_current_profile_index = 0;
@@ -773,8 +782,9 @@ __WEAK void keyboard_task(void)
     script_process();
 #endif
 #ifdef MACRO_ENABLE
-    macro_process();
+    macro_task();
 #endif
+    scheduler_process();
 #ifdef DYNAMICKEY_ENABLE
     dynamic_key_process();
 #endif
@@ -820,6 +830,9 @@ void keyboard_process(void)
         keyboard_event_poller(event->event, event->tick);
         event_loop_queue_pop(&event_buffer);
     }
+#ifdef SCRIPT_ENABLE
+    script_dispatch_events();
+#endif
 #if defined(SCRIPT_ENABLE) && defined(SCRIPT_POLLING)
     script_process();
 #endif
@@ -834,7 +847,7 @@ void keyboard_process(void)
     packet_process_version_notifications();
     packet_process_debug_notifications();
 #ifdef RGB_ENABLE
-    rgb_process();
+    rgb_task();
 #endif
 #ifdef CONSOLE_ENABLE
     console_flush();
@@ -448,6 +448,7 @@ enum ScriptKeycode {
   SCRIPT_SUSPEND = 3,
   SCRIPT_RESTART = 4,
   SCRIPT_TOGGLE = 5,
+  SCRIPT_STATS = 6,
 };
 
 enum GamepadKeycode {
@@ -11,6 +11,20 @@
 
 static uint16_t current_lamp_id = 0;
 
+typedef struct __LampArrayBuffer
+{
+    ColorRGB colors[RGB_NUM];
+    volatile uint8_t dirty[RGB_NUM];
+} LampArrayBuffer;
+
+// Written from the USB callbacks, published to the committed buffer on UpdateComplete
+static LampArrayBuffer lamp_array_staging;
+// Complete updates, the callbacks fill the back buffer and lamp_array_apply() reads the front one
+static LampArrayBuffer lamp_array_committed[2];
+static volatile uint8_t lamp_array_front;
+static volatile bool lamp_array_commit_ready;
+static volatile bool lamp_array_reset_pending;
+
 uint16_t lamp_array_get_lamp_array_attributes_report(uint8_t* buffer) {
     LampArrayAttributesReport report = {
         REPORT_ID_LIGHTING_LAMP_ARRAY_ATTRIBUTES,
@@ -60,7 +74,25 @@ static inline void lamp_set_color(uint16_t lamp_id, LampColor color)
     if (lamp_id >= RGB_NUM) {
         return;
     }
-    rgb_set(lamp_id, color.red, color.green, color.blue);
+    // Repeated updates of the same lamp within a batch coalesce here
+    lamp_array_staging.colors[lamp_id] = (ColorRGB){color.red, color.green, color.blue};
+    lamp_array_staging.dirty[lamp_id] = true;
+}
+
+// Commits pile up in the back buffer until the next frame swaps it to the front
+static void lamp_array_commit(void)
+{
+    LampArrayBuffer *back = &lamp_array_committed[lamp_array_front ^ 1];
+    for (uint16_t i = 0; i < RGB_NUM; i++)
+    {
+        if (lamp_array_staging.dirty[i])
+        {
+            lamp_array_staging.dirty[i] = false;
+            back->colors[i] = lamp_array_staging.colors[i];
+            back->dirty[i] = true;
+        }
+    }
+    lamp_array_commit_ready = true;
 }
 
 void lamp_array_set_lamp_attributes_id(const uint8_t* buffer) {
@@ -81,6 +113,10 @@ void lamp_array_set_multiple_lamps(const uint8_t* buffer) {
         lamp_set_color(report->lamp_ids[i], report->colors[i]);
         last_id = report->lamp_ids[i];
     }
+    if (report->flags & LAMP_UPDATE_FLAG_UPDATE_COMPLETE)
+    {
+        lamp_array_commit();
+    }
 }
 
 void lamp_array_set_lamp_range(const uint8_t* buffer) {
@@ -93,9 +129,59 @@ void lamp_array_set_lamp_range(const uint8_t* buffer) {
     {
         lamp_set_color(i, report->color);
     }
+    if (report->flags & LAMP_UPDATE_FLAG_UPDATE_COMPLETE)
+    {
+        lamp_array_commit();
+    }
 }
 
 void lamp_array_set_autonomous_mode(const uint8_t* buffer) {
     LampArrayControlReport* report = (LampArrayControlReport*) buffer;
+    if (report->autonomous_mode)
+    {
+        lamp_array_reset_pending = true;
+    }
+#ifndef RGB_LAMP_ARRAY_OVERLAY_ENABLE
     g_rgb_hid_mode = !report->autonomous_mode;
+#endif
+}
+
+void lamp_array_apply(void)
+{
+    if (lamp_array_reset_pending)
+    {
+        lamp_array_reset_pending = false;
+        lamp_array_commit_ready = false;
+        memset((void*)lamp_array_staging.dirty, 0, sizeof(lamp_array_staging.dirty));
+        memset((void*)lamp_array_committed[0].dirty, 0, sizeof(lamp_array_committed[0].dirty));
+        memset((void*)lamp_array_committed[1].dirty, 0, sizeof(lamp_array_committed[1].dirty));
+#ifdef RGB_LAMP_ARRAY_OVERLAY_ENABLE
+        // Host colors are composited over the autonomous effects instead of replacing them
+        rgb_layer_clear(RGB_LAYER_LAMP_ARRAY);
+#endif
+        return;
+    }
+    if (!lamp_array_commit_ready)
+    {
+        return;
+    }
+    // Cleared before the swap, a commit landing in between is picked up next frame
+    lamp_array_commit_ready = false;
+    lamp_array_front ^= 1;
+    // Commits after the swap go to the other buffer, the front one stays whole while it is read
+    LampArrayBuffer *front = &lamp_array_committed[lamp_array_front];
+    for (uint16_t i = 0; i < RGB_NUM; i++)
+    {
+        if (!front->dirty[i])
+        {
+            continue;
+        }
+        front->dirty[i] = false;
+        ColorRGB color = front->colors[i];
+#ifdef RGB_LAMP_ARRAY_OVERLAY_ENABLE
+        rgb_layer_set(RGB_LAYER_LAMP_ARRAY, i, &color, 255);
+#else
+        rgb_set(i, color.r, color.g, color.b);
+#endif
+    }
 }
@@ -72,6 +72,10 @@ enum {
     LAMPARRAY_KIND_SPEAKER,
 };
 
+enum {
+    LAMP_UPDATE_FLAG_UPDATE_COMPLETE = 0x01,
+};
+
 enum {
     LAMP_PURPOSE_CONTROL      = 0x01,
     LAMP_PURPOSE_ACCENT       = 0x02,
@@ -133,6 +137,7 @@ void lamp_array_set_lamp_attributes_id(const uint8_t* buffer);
 void lamp_array_set_multiple_lamps(const uint8_t* buffer);
 void lamp_array_set_lamp_range(const uint8_t* buffer);
 void lamp_array_set_autonomous_mode(const uint8_t* buffer);
+void lamp_array_apply(void);
 
 #ifdef __cplusplus
 }
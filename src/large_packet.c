@@ -68,6 +68,9 @@ uint32_t script_source_handle_large_data(uint8_t code, uint8_t sub_cmd, uint32_t
                 fs_close(&script_file);
                 script_file_open = false;
             }
+#ifdef SCRIPT_ENABLE
+            script_invalidate_cache();
+#endif
 #if SCRIPT_RUNTIME_STRATEGY == SCRIPT_JIT
             //script_init();
 #endif
@@ -191,6 +194,9 @@ uint32_t script_bytecode_handle_large_data(uint8_t code, uint8_t sub_cmd, uint32
                 fs_close(&script_file);
                 script_file_open = false;
             }
+#ifdef SCRIPT_ENABLE
+            script_invalidate_cache();
+#endif
             //script_init();
             return 0;
         }
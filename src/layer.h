@@ -11,6 +11,12 @@
 extern "C" {
 #endif
 
+#ifdef DYNAMICKEY_ENABLE
+// Implemented in dynamic_key.c, declared here so inline layer helpers need not include dynamic_key.h
+void dynamic_key_update_index(void);
+void dynamic_key_update_key_index(uint16_t id);
+#endif
+
 extern uint8_t g_current_layer;
 extern Keycode g_keymap_cache[TOTAL_KEY_NUM];
 extern bool g_keymap_lock[TOTAL_KEY_NUM];
@@ -36,6 +42,9 @@ static inline void layer_unlock(uint16_t id)
 {
     g_keymap_lock[id] = false;
     g_keymap_cache[id] = layer_get_keycode(id, g_current_layer);
+#ifdef DYNAMICKEY_ENABLE
+    dynamic_key_update_key_index(id);
+#endif
 }
 
 static inline void layer_lock_handler(KeyboardEvent event)
@@ -67,6 +76,9 @@ static inline void layer_cache_refresh(void)
             g_keymap_cache[i] = layer_get_keycode(i, g_current_layer);
         }
     }
+#ifdef DYNAMICKEY_ENABLE
+    dynamic_key_update_index();
+#endif
 }
 
 #ifdef __cplusplus
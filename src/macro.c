@@ -5,20 +5,656 @@
  */
 #include "macro.h"
 #include "event_cache.h"
+#include "scheduler.h"
 #include "string.h"
+#ifdef STORAGE_ENABLE
+#include "storage.h"
+#include "file_system.h"
+#endif
+
+#if MACRO_POOL_SIZE > 0xFFFF
+#error "MACRO_POOL_SIZE must fit in 16 bits"
+#endif
+
+// Action encoding: a flag byte, the delay since the previous action as a varint,
+// then the key id and the keycode as varints only when they differ from the previous action
+#define MACRO_ACTION_EVENT_MASK  0x03
+#define MACRO_ACTION_VIRTUAL     0x04
+#define MACRO_ACTION_NO_KEY      0x08
+#define MACRO_ACTION_NEW_KEY     0x10
+#define MACRO_ACTION_NEW_KEYCODE 0x20
+#define MACRO_ACTION_MAX_SIZE    (1 + 5 + 3 + 3)
+
+#define MACRO_FILE_MAGIC 0x4D414331
+
+typedef struct __MacroFileHeader
+{
+    uint32_t magic;
+    uint16_t used;
+    uint16_t sizes[MACRO_NUM];
+    uint16_t lengths[MACRO_NUM];
+    uint8_t streamed[MACRO_NUM];
+    uint32_t stream_sizes[MACRO_NUM];
+    MacroCursor tails[MACRO_NUM];
+} MacroFileHeader;
+
+// Window into a stream file, doubles as the write buffer while a streamed macro is recorded
+typedef struct __MacroStream
+{
+    uint8_t buffer[MACRO_STREAM_CHUNK_SIZE];
+    uint32_t position;
+    uint16_t length;
+    bool pending;
+} MacroStream;
+
+// Position of the last macro_get_action(), so reading actions in order decodes each one once
+typedef struct __MacroReader
+{
+    uint16_t index;
+    MacroCursor cursor;
+    MacroStream stream;
+    MacroAction action;
+} MacroReader;
 
 Macro g_macros[MACRO_NUM];
-static MacroAction actions[MACRO_NUM][MACRO_MAX_ACTIONS];
+static uint8_t macro_pool[MACRO_POOL_SIZE];
+static uint16_t macro_pool_used;
+static MacroStream macro_streams[MACRO_NUM];
+static MacroReader macro_readers[MACRO_NUM];
+static bool macro_save_pending;
+
+static uint8_t macro_write_varint(uint8_t *buf, uint32_t value)
+{
+    uint8_t len = 0;
+    while (value >= 0x80)
+    {
+        buf[len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buf[len++] = value;
+    return len;
+}
+
+static uint8_t macro_read_varint(const uint8_t *buf, uint16_t size, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (uint8_t i = 0; i < 5 && i < size; i++)
+    {
+        result |= (uint32_t)(buf[i] & 0x7F) << (7 * i);
+        if (!(buf[i] & 0x80))
+        {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static uint8_t macro_encode(MacroCursor *cursor, const MacroAction *action, uint8_t *buf)
+{
+    uint8_t flags = action->event.event & MACRO_ACTION_EVENT_MASK;
+    uint8_t len = 1;
+    // Delays are absolute from the start of the macro, one going backwards is clamped
+    uint32_t delta = action->delay > cursor->delay ? action->delay - cursor->delay : 0;
+    len += macro_write_varint(buf + len, delta);
+    cursor->delay += delta;
+    if (action->event.is_virtual)
+    {
+        flags |= MACRO_ACTION_VIRTUAL;
+    }
+    if (action->event.key == NULL)
+    {
+        flags |= MACRO_ACTION_NO_KEY;
+    }
+    else if (((Key*)action->event.key)->id != cursor->key_id)
+    {
+        flags |= MACRO_ACTION_NEW_KEY;
+        cursor->key_id = ((Key*)action->event.key)->id;
+        len += macro_write_varint(buf + len, cursor->key_id);
+    }
+    if (action->event.keycode != cursor->keycode)
+    {
+        flags |= MACRO_ACTION_NEW_KEYCODE;
+        cursor->keycode = action->event.keycode;
+        len += macro_write_varint(buf + len, cursor->keycode);
+    }
+    buf[0] = flags;
+    cursor->offset += len;
+    return len;
+}
+
+static uint8_t macro_decode(const uint8_t *data, uint16_t data_size, MacroCursor *cursor, MacroAction *action)
+{
+    const uint8_t *buf = data + cursor->offset;
+    uint16_t size = data_size - cursor->offset;
+    uint32_t value;
+    uint8_t len = 1;
+    uint8_t n;
+    if (cursor->offset >= data_size)
+    {
+        return 0;
+    }
+    uint8_t flags = buf[0];
+    n = macro_read_varint(buf + len, size - len, &value);
+    if (!n)
+    {
+        return 0;
+    }
+    len += n;
+    cursor->delay += value;
+    if (flags & MACRO_ACTION_NEW_KEY)
+    {
+        n = macro_read_varint(buf + len, size - len, &value);
+        if (!n)
+        {
+            return 0;
+        }
+        len += n;
+        cursor->key_id = value;
+    }
+    if (flags & MACRO_ACTION_NEW_KEYCODE)
+    {
+        n = macro_read_varint(buf + len, size - len, &value);
+        if (!n)
+        {
+            return 0;
+        }
+        len += n;
+        cursor->keycode = value;
+    }
+    cursor->offset += len;
+    action->delay = cursor->delay;
+    action->event.keycode = cursor->keycode;
+    action->event.event = flags & MACRO_ACTION_EVENT_MASK;
+    action->event.is_virtual = (flags & MACRO_ACTION_VIRTUAL) ? true : false;
+    action->event.key = (flags & MACRO_ACTION_NO_KEY) ? NULL : keyboard_get_key(cursor->key_id);
+    return len;
+}
+
+// Macros are packed back to back in index order, resizing one shifts the ones after it
+static bool macro_resize(Macro *macro, uint16_t size)
+{
+    if (size > macro->size && size - macro->size > MACRO_POOL_SIZE - macro_pool_used)
+    {
+        return false;
+    }
+    uint16_t end = macro->offset + macro->size;
+    memmove(macro_pool + macro->offset + size, macro_pool + end, macro_pool_used - end);
+    for (Macro *next = macro + 1; next < g_macros + MACRO_NUM; next++)
+    {
+        next->offset = next->offset + size - macro->size;
+    }
+    macro_pool_used = macro_pool_used + size - macro->size;
+    macro->size = size;
+    return true;
+}
+
+// Replaces old_size bytes at offset inside a macro, the bytes after them move with the new size
+static bool macro_splice(Macro *macro, uint16_t offset, uint16_t old_size, const uint8_t *buf, uint16_t new_size)
+{
+    uint8_t *data = macro_pool + macro->offset;
+    uint16_t tail = macro->size - offset - old_size;
+    if (new_size > old_size)
+    {
+        if (!macro_resize(macro, macro->size + new_size - old_size))
+        {
+            return false;
+        }
+        data = macro_pool + macro->offset;
+        memmove(data + offset + new_size, data + offset + old_size, tail);
+    }
+    else
+    {
+        memmove(data + offset + new_size, data + offset + old_size, tail);
+        macro_resize(macro, macro->size + new_size - old_size);
+    }
+    memcpy(macro_pool + macro->offset + offset, buf, new_size);
+    return true;
+}
+
+static void macro_reader_reset(const Macro *macro)
+{
+    memset(&macro_readers[macro - g_macros], 0, sizeof(MacroReader));
+}
+
+#ifdef STORAGE_ENABLE
+static void macro_stream_name(char *name, const Macro *macro)
+{
+    // "macros/streamPM", P is the profile and M the macro index in hex
+    name[13] = '0' + g_current_profile_index;
+    name[14] = "0123456789abcdef"[(macro - g_macros) & 0x0F];
+}
+#endif
+
+// Slides the window so a whole action follows the cursor, unless the file ends first
+static void macro_stream_fill(const Macro *macro, MacroStream *stream, MacroCursor *cursor)
+{
+#ifdef STORAGE_ENABLE
+    File file;
+    char name[] = "macros/stream00";
+    if (stream->length - cursor->offset >= MACRO_ACTION_MAX_SIZE ||
+        stream->position + stream->length >= macro->stream_size)
+    {
+        return;
+    }
+    stream->position += cursor->offset;
+    stream->length = 0;
+    cursor->offset = 0;
+    macro_stream_name(name, macro);
+    if (fs_open(&file, name, FS_O_RDONLY) < 0)
+    {
+        return;
+    }
+    uint32_t len = macro->stream_size - stream->position;
+    if (len > sizeof(stream->buffer))
+    {
+        len = sizeof(stream->buffer);
+    }
+    fs_seek(&file, stream->position, FS_SEEK_SET);
+    size_t read = fs_read(&file, stream->buffer, len);
+    stream->length = read > len ? 0 : read;
+    fs_close(&file);
+#else
+    UNUSED(macro);
+    UNUSED(stream);
+    UNUSED(cursor);
+#endif
+}
+
+static bool macro_stream_flush(Macro *macro, MacroStream *stream)
+{
+#ifdef STORAGE_ENABLE
+    File file;
+    char name[] = "macros/stream00";
+    if (!stream->length)
+    {
+        return true;
+    }
+    macro_stream_name(name, macro);
+    if (fs_open(&file, name, FS_O_WRONLY | FS_O_CREAT | FS_O_APPEND) < 0)
+    {
+        return false;
+    }
+    size_t written = fs_write(&file, stream->buffer, stream->length);
+    fs_close(&file);
+    if (written != stream->length)
+    {
+        return false;
+    }
+    macro->stream_size += written;
+    stream->length = 0;
+    stream->pending = false;
+    return true;
+#else
+    UNUSED(macro);
+    UNUSED(stream);
+    return false;
+#endif
+}
+
+// Moves a macro that no longer fits in the pool to its stream file
+static bool macro_stream_begin(Macro *macro)
+{
+#ifdef STORAGE_ENABLE
+    File file;
+    char name[] = "macros/stream00";
+    macro_stream_name(name, macro);
+    if (fs_open(&file, name, FS_O_WRONLY | FS_O_CREAT | FS_O_TRUNC) < 0)
+    {
+        return false;
+    }
+    size_t written = fs_write(&file, macro_pool + macro->offset, macro->size);
+    fs_close(&file);
+    if (written != macro->size)
+    {
+        return false;
+    }
+    memset(&macro_streams[macro - g_macros], 0, sizeof(MacroStream));
+    macro_reader_reset(macro);
+    macro->stream_size = macro->size;
+    macro->streamed = true;
+    macro_resize(macro, 0);
+    return true;
+#else
+    UNUSED(macro);
+    return false;
+#endif
+}
+
+static uint8_t macro_next(const Macro *macro, MacroStream *stream, MacroCursor *cursor, MacroAction *action)
+{
+    if (!macro->streamed)
+    {
+        return macro_decode(macro_pool + macro->offset, macro->size, cursor, action);
+    }
+    macro_stream_fill(macro, stream, cursor);
+    return macro_decode(stream->buffer, stream->length, cursor, action);
+}
+
+static void macro_rewind_playback(Macro *macro)
+{
+    MacroStream *stream = &macro_streams[macro - g_macros];
+    // The window doubles as the write buffer, recorded bytes macro_task() has not written yet go first
+    if (stream->pending)
+    {
+        macro_stream_flush(macro, stream);
+    }
+    macro->index = 0;
+    memset(&macro->cursor, 0, sizeof(MacroCursor));
+    memset(stream, 0, sizeof(MacroStream));
+}
+
+#ifdef STORAGE_ENABLE
+static bool macro_validate(Macro *macro)
+{
+    MacroCursor cursor = {0};
+    MacroAction action;
+    uint16_t length = 0;
+    while (macro_decode(macro_pool + macro->offset, macro->size, &cursor, &action))
+    {
+        length++;
+    }
+    return cursor.offset == macro->size && length == macro->length &&
+           cursor.offset == macro->tail.offset && cursor.key_id == macro->tail.key_id &&
+           cursor.keycode == macro->tail.keycode && cursor.delay == macro->tail.delay;
+}
+#endif
 
 void macro_init(void)
 {
+    for (int i = 0; i < MACRO_NUM; i++)
+    {
+        scheduler_cancel(&g_macros[i]);
+    }
     memset(g_macros, 0, sizeof(g_macros));
-    memset(actions, 0, sizeof(actions));
-    
+    memset(macro_streams, 0, sizeof(macro_streams));
+    memset(macro_readers, 0, sizeof(macro_readers));
+    macro_pool_used = 0;
+    macro_save_pending = false;
+}
+
+// Drops the macros of the current profile along with their stream files
+void macro_factory_reset(void)
+{
+#ifdef STORAGE_ENABLE
+    char name[] = "macros/stream00";
+    for (int i = 0; i < MACRO_NUM; i++)
+    {
+        macro_stream_name(name, &g_macros[i]);
+        fs_unlink(name);
+    }
+#endif
+    macro_init();
+}
+
+void macro_clear(Macro*macro)
+{
+#ifdef STORAGE_ENABLE
+    if (macro->streamed)
+    {
+        char name[] = "macros/stream00";
+        macro_stream_name(name, macro);
+        fs_unlink(name);
+    }
+#endif
+    memset(&macro_streams[macro - g_macros], 0, sizeof(MacroStream));
+    macro_resize(macro, 0);
+    macro->length = 0;
+    macro->streamed = false;
+    macro->stream_size = 0;
+    memset(&macro->tail, 0, sizeof(MacroCursor));
+    macro_rewind_playback(macro);
+    macro_reader_reset(macro);
+}
+
+uint16_t macro_get_free_space(void)
+{
+    return MACRO_POOL_SIZE - macro_pool_used;
+}
+
+bool macro_append(Macro*macro, const MacroAction*action)
+{
+    uint8_t buf[MACRO_ACTION_MAX_SIZE];
+    MacroCursor tail = macro->tail;
+    uint8_t len = macro_encode(&tail, action, buf);
+    if (macro->length == UINT16_MAX)
+    {
+        return false;
+    }
+    if (macro->streamed)
+    {
+        MacroStream *stream = &macro_streams[macro - g_macros];
+        if (stream->length + len > sizeof(stream->buffer) && !macro_stream_flush(macro, stream))
+        {
+            return false;
+        }
+        memcpy(stream->buffer + stream->length, buf, len);
+        stream->length += len;
+        stream->pending = true;
+    }
+    else
+    {
+        uint16_t offset = macro->size;
+        if (!macro_resize(macro, macro->size + len))
+        {
+            return false;
+        }
+        memcpy(macro_pool + macro->offset + offset, buf, len);
+    }
+    macro->tail = tail;
+    macro->length++;
+    return true;
+}
+
+bool macro_get_action(const Macro*macro, uint16_t index, MacroAction*action)
+{
+    MacroReader *reader = &macro_readers[macro - g_macros];
+    if (index >= macro->length)
+    {
+        return false;
+    }
+    if (index + 1 < reader->index)
+    {
+        macro_reader_reset(macro);
+    }
+    while (reader->index <= index)
+    {
+        if (!macro_next(macro, &reader->stream, &reader->cursor, &reader->action))
+        {
+            macro_reader_reset(macro);
+            return false;
+        }
+        reader->index++;
+    }
+    *action = reader->action;
+    return true;
+}
+
+// Re-encodes the action at index and the ones after it until the encoder state matches the old encoding again,
+// returns how many bytes the macro grows by and only writes the pool when apply is set
+static int32_t macro_rewrite(Macro *macro, uint16_t index, const MacroAction *action, bool apply)
+{
+    uint8_t buf[MACRO_ACTION_MAX_SIZE];
+    MacroCursor previous = {0};
+    MacroAction current;
+    int32_t growth = 0;
+    bool converged = false;
+    for (uint16_t i = 0; i < index; i++)
+    {
+        macro_decode(macro_pool + macro->offset, macro->size, &previous, &current);
+    }
+    MacroCursor cursor = previous;
+    for (uint16_t i = index; i < macro->length && !converged; i++)
+    {
+        uint16_t offset = previous.offset;
+        if (!macro_decode(macro_pool + macro->offset, macro->size, &previous, &current))
+        {
+            return INT32_MAX;
+        }
+        uint16_t old_size = previous.offset - offset;
+        uint8_t new_size = macro_encode(&cursor, i == index ? action : &current, buf);
+        growth += (int32_t)new_size - old_size;
+        converged = cursor.delay == previous.delay && cursor.key_id == previous.key_id &&
+                    cursor.keycode == previous.keycode;
+        if (apply)
+        {
+            macro_splice(macro, offset, old_size, buf, new_size);
+            previous.offset = offset + new_size;
+        }
+    }
+    if (apply)
+    {
+        if (!converged)
+        {
+            macro->tail = cursor;
+        }
+        macro->tail.offset = macro->size;
+    }
+    return growth;
+}
+
+// Actions are encoded relative to each other, so the ones after the rewritten action are re-encoded as needed
+bool macro_set_action(Macro*macro, uint16_t index, const MacroAction*action)
+{
+    if (index > macro->length || macro->state != MACRO_STATE_IDLE)
+    {
+        return false;
+    }
+    macro_reader_reset(macro);
+    if (macro->streamed && index < macro->length)
+    {
+        // Stream files are append only, rewriting the first action starts the macro over
+        if (index)
+        {
+            return false;
+        }
+        macro_clear(macro);
+    }
+    if (index < macro->length)
+    {
+        if (macro_rewrite(macro, index, action, false) > (int32_t)macro_get_free_space())
+        {
+            return false;
+        }
+        macro_rewrite(macro, index, action, true);
+        return true;
+    }
+    macro_rewind_playback(macro);
+    if (!macro_append(macro, action) && !(!macro->streamed && macro_stream_begin(macro) && macro_append(macro, action)))
+    {
+        return false;
+    }
+    return !macro->streamed || macro_stream_flush(macro, &macro_streams[macro - g_macros]);
+}
+
+void macro_save(void)
+{
+#ifdef STORAGE_ENABLE
+    File file;
+    char name[] = "macros/profile0";
+    for (int i = 0; i < MACRO_NUM; i++)
+    {
+        if (macro_streams[i].pending)
+        {
+            macro_stream_flush(&g_macros[i], &macro_streams[i]);
+        }
+    }
+    macro_save_pending = false;
+    MacroFileHeader header = {
+        .magic = MACRO_FILE_MAGIC,
+        .used = macro_pool_used,
+    };
+    for (int i = 0; i < MACRO_NUM; i++)
+    {
+        header.sizes[i] = g_macros[i].size;
+        header.lengths[i] = g_macros[i].length;
+        header.streamed[i] = g_macros[i].streamed;
+        header.stream_sizes[i] = g_macros[i].stream_size;
+        header.tails[i] = g_macros[i].tail;
+    }
+    name[sizeof(name) - 2] = g_current_profile_index + '0';
+    if (fs_open(&file, name, FS_O_RDWR | FS_O_CREAT | FS_O_TRUNC) < 0)
+    {
+        return;
+    }
+    fs_write(&file, &header, sizeof(header));
+    fs_write(&file, macro_pool, macro_pool_used);
+    fs_close(&file);
+#endif
+}
+
+void macro_load(void)
+{
+    macro_init();
+#ifdef STORAGE_ENABLE
+    File file;
+    char name[] = "macros/profile0";
+    MacroFileHeader header;
+    uint32_t used = 0;
+    name[sizeof(name) - 2] = g_current_profile_index + '0';
+    if (fs_open(&file, name, FS_O_RDONLY) < 0)
+    {
+        return;
+    }
+    if (fs_read(&file, &header, sizeof(header)) != sizeof(header) ||
+        header.magic != MACRO_FILE_MAGIC || header.used > MACRO_POOL_SIZE ||
+        fs_read(&file, macro_pool, header.used) != header.used)
+    {
+        fs_close(&file);
+        return;
+    }
+    fs_close(&file);
+    for (int i = 0; i < MACRO_NUM; i++)
+    {
+        g_macros[i].offset = used;
+        g_macros[i].size = header.sizes[i];
+        g_macros[i].length = header.lengths[i];
+        g_macros[i].tail = header.tails[i];
+        used += header.sizes[i];
+    }
+    macro_pool_used = used;
+    if (used != header.used)
+    {
+        macro_init();
+        return;
+    }
     for (int i = 0; i < MACRO_NUM; i++)
     {
-        g_macros[i].actions = actions[i];
+        Macro *macro = &g_macros[i];
+        if (header.streamed[i])
+        {
+            // Playback stops early on a short file, only its length is checked here
+            char stream_name[] = "macros/stream00";
+            macro_stream_name(stream_name, macro);
+            if (macro->size || fs_open(&file, stream_name, FS_O_RDONLY) < 0)
+            {
+                macro_clear(macro);
+                continue;
+            }
+            bool complete = fs_size(&file) >= (FilePosition)header.stream_sizes[i];
+            fs_close(&file);
+            if (!complete)
+            {
+                macro_clear(macro);
+                continue;
+            }
+            macro->streamed = true;
+            macro->stream_size = header.stream_sizes[i];
+        }
+        else if (!macro_validate(macro))
+        {
+            macro_clear(macro);
+        }
     }
+#endif
+}
+
+static void macro_schedule(Macro*macro);
+
+static uint32_t macro_first_delay(const Macro*macro)
+{
+    MacroAction action;
+    return macro_get_action(macro, 0, &action) ? action.delay : 0;
 }
 
 void macro_event_handler(KeyboardEvent event)
@@ -50,11 +686,13 @@ void macro_event_handler(KeyboardEvent event)
             break;
         case MACRO_PLAYING_START_ONCE_NO_GAP:
             macro_start_play_once(&g_macros[index]);
-            g_macros[index].begin_tick = g_keyboard_tick + g_macros[index].actions[0].delay;
+            g_macros[index].begin_time = scheduler_get_time_us() + SCHEDULER_TICK_TO_US(macro_first_delay(&g_macros[index]));
+            macro_schedule(&g_macros[index]);
             break;
         case MACRO_PLAYING_START_CIRCULARLY_NO_GAP:
             macro_start_play_circularly(&g_macros[index]);
-            g_macros[index].begin_tick = g_keyboard_tick + g_macros[index].actions[0].delay;
+            g_macros[index].begin_time = scheduler_get_time_us() + SCHEDULER_TICK_TO_US(macro_first_delay(&g_macros[index]));
+            macro_schedule(&g_macros[index]);
             break;
         case MACRO_PLAYING_STOP:
             macro_stop_play(&g_macros[index]);
@@ -101,100 +739,172 @@ void macro_record_handler(KeyboardEvent event)
 
 void macro_start_record(Macro*macro)
 {
-    macro->begin_tick = g_keyboard_tick;
+    macro_clear(macro);
+    macro->begin_time = scheduler_get_time_us();
     macro->state = MACRO_STATE_RECORDING;
-    macro->index = 0;
 }
 
 void macro_stop_record(Macro*macro)
 {
-    macro->actions[macro->index].delay = g_keyboard_tick - macro->begin_tick;
-    macro->actions[macro->index].event.keycode = KEY_NO_EVENT;
+    MacroAction terminator = {
+        .delay = SCHEDULER_US_TO_TICK(scheduler_get_time_us() - macro->begin_time),
+        .event = MK_EVENT(KEY_NO_EVENT, KEYBOARD_EVENT_NO_EVENT, NULL),
+    };
+    macro_append(macro, &terminator);
     macro->state = MACRO_STATE_IDLE;
-    macro->index=0;
+    // Flash writes wait for macro_task(), the stream window keeps the unwritten tail until then
+    macro->index = 0;
+    memset(&macro->cursor, 0, sizeof(MacroCursor));
+    macro_save_pending = true;
 }
 
 void macro_record(Macro*macro,KeyboardEvent event)
 {
-    macro->actions[macro->index].event = event;
-    macro->actions[macro->index].delay = g_keyboard_tick - macro->begin_tick;
-    macro->index++;
-    if (macro->index >= MACRO_MAX_ACTIONS)
+    MacroAction action = {
+        .delay = SCHEDULER_US_TO_TICK(scheduler_get_time_us() - macro->begin_time),
+        .event = event,
+    };
+    // Keep room for the terminator written by macro_stop_record(), or continue on flash
+    if (!macro->streamed && macro_get_free_space() < MACRO_ACTION_MAX_SIZE * 2 && !macro_stream_begin(macro))
     {
-        macro->index--;
         macro_stop_record(macro);
+        return;
     }
+    if (!macro_append(macro, &action))
+    {
+        macro_stop_record(macro);
+        return;
+    }
+    macro->index++;
 }
 
 void macro_start_play_once(Macro*macro)
 {
-    macro->begin_tick = g_keyboard_tick;
+    macro->begin_time = scheduler_get_time_us();
     macro->state = MACRO_STATE_PLAYING_ONCE;
-    macro->index = 0;
+    macro_rewind_playback(macro);
+    macro_schedule(macro);
 }
 
 void macro_start_play_circularly(Macro*macro)
 {
-    macro->begin_tick = g_keyboard_tick;
+    macro->begin_time = scheduler_get_time_us();
     macro->state = MACRO_STATE_PLAYING_CIRCULARLY;
-    macro->index = 0;
+    macro_rewind_playback(macro);
+    macro_schedule(macro);
 }
 
 void macro_stop_play(Macro*macro)
 {
-    macro->begin_tick = g_keyboard_tick;
+    macro->begin_time = scheduler_get_time_us();
     macro->state = MACRO_STATE_IDLE;
-    macro->index = 0;
+    macro_rewind_playback(macro);
+    scheduler_cancel(macro);
 }
 
-void macro_process(void)
+// Fires every due action of one macro, then sleeps until the next one
+static void macro_play(void *owner)
 {
-    for (int i = 0; i < MACRO_NUM; i++)
+    Macro *macro = (Macro *)owner;
+    MacroStream *stream = &macro_streams[macro - g_macros];
+    if (macro->state != MACRO_STATE_PLAYING_ONCE && macro->state != MACRO_STATE_PLAYING_CIRCULARLY)
     {
-        Macro *macro = &g_macros[i];
-        switch (macro->state)
+        return;
+    }
+    const uint32_t now = scheduler_get_time_us();
+    while (true)
+    {
+        MacroAction action;
+        // Refill on the committed cursor so peeking the next action keeps a valid window
+        if (macro->streamed)
         {
-        case MACRO_STATE_RECORDING:
+            macro_stream_fill(macro, stream, &macro->cursor);
+        }
+        MacroCursor next = macro->cursor;
+        bool decoded = macro_next(macro, stream, &next, &action);
+        if (decoded && !SCHEDULER_IS_DUE(macro->begin_time + SCHEDULER_TICK_TO_US(action.delay), now))
+        {
+            if (!scheduler_set(macro, macro_play, macro->begin_time + SCHEDULER_TICK_TO_US(action.delay)))
+            {
+                macro_stop_play(macro);
+                event_forward_list_remove_specific_owner(&g_event_buffer_list, macro);
+            }
             break;
-        case MACRO_STATE_PLAYING_ONCE:
-        case MACRO_STATE_PLAYING_CIRCULARLY:
-            while (macro->actions[macro->index].delay + macro->begin_tick <= g_keyboard_tick)
+        }
+        KeyboardEvent event = action.event;
+        if (!decoded || !event.keycode)
+        {
+            if (macro->state == MACRO_STATE_PLAYING_ONCE)
             {
-                KeyboardEvent event = macro->actions[macro->index].event;
-                uint8_t report_state = ((Key*)event.key)->report_state;
-                if (!event.keycode)
-                {
-                    if (macro->state == MACRO_STATE_PLAYING_ONCE)
-                    {
-                        macro_stop_play(macro);
-                    }
-                    else
-                    {
-                        macro_start_play_circularly(macro);
-                        macro->begin_tick = g_keyboard_tick + macro->actions[0].delay;
-                    }
-                    event_forward_list_remove_specific_owner(&g_event_buffer_list, macro);
-                    break;
-                }
-                keyboard_event_handler(macro->actions[macro->index].event);
-                if (!event.is_virtual)
-                {
-                    keyboard_key_set_report_state((Key*)event.key, report_state);//protect key state
-                }
-                if (macro->actions[macro->index].event.event == KEYBOARD_EVENT_KEY_DOWN)
-                {
-                    event_cache_push(event, macro);
-                }
-                else
-                {
-                    event_forward_list_remove_first(&g_event_buffer_list, (EventCache){event,macro});
-                }
-                macro->index++;
+                macro_stop_play(macro);
             }
+            else
+            {
+                macro_start_play_circularly(macro);
+                macro->begin_time = now + SCHEDULER_TICK_TO_US(macro_first_delay(macro));
+                macro_schedule(macro);
+            }
+            event_forward_list_remove_specific_owner(&g_event_buffer_list, macro);
             break;
-        
-        default:
+        }
+        macro->cursor = next;
+        macro->index++;
+        const uint32_t begin_time = macro->begin_time;
+        uint8_t report_state = event.key ? ((Key*)event.key)->report_state : false;
+        keyboard_event_handler(event);
+        if (!event.is_virtual && event.key)
+        {
+            keyboard_key_set_report_state((Key*)event.key, report_state);//protect key state
+        }
+        if (event.event == KEYBOARD_EVENT_KEY_DOWN)
+        {
+            event_cache_push(event, macro);
+        }
+        else
+        {
+            event_forward_list_remove_first(&g_event_buffer_list, (EventCache){event,macro});
+        }
+        // The action itself stopped or restarted this macro
+        if (macro->state == MACRO_STATE_IDLE || macro->begin_time != begin_time)
+        {
             break;
-        } 
+        }
+    }
+}
+
+static void macro_schedule(Macro*macro)
+{
+    // Sleep until the exact deadline of the first action, a full scheduler stops the macro instead of stalling it
+    if (!scheduler_set(macro, macro_play, macro->begin_time + SCHEDULER_TICK_TO_US(macro_first_delay(macro))))
+    {
+        macro_stop_play(macro);
+        event_forward_list_remove_specific_owner(&g_event_buffer_list, macro);
     }
 }
+
+// Writes recorded stream chunks and saves finished recordings outside the event path
+void macro_task(void)
+{
+    for (int i = 0; i < MACRO_NUM; i++)
+    {
+        Macro *macro = &g_macros[i];
+        MacroStream *stream = &macro_streams[i];
+        // Half a chunk leaves room for the events of a busy scan before the next call
+        if (macro->state == MACRO_STATE_RECORDING && stream->pending &&
+            stream->length >= sizeof(stream->buffer) / 2 && !macro_stream_flush(macro, stream))
+        {
+            macro_stop_record(macro);
+        }
+    }
+    if (macro_save_pending)
+    {
+        macro_save();
+    }
+}
+
+// Playback runs from the scheduler, this stays for keyboard_task() overrides calling it
+void macro_process(void)
+{
+    macro_task();
+    scheduler_process();
+}
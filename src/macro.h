@@ -16,8 +16,14 @@ extern "C" {
 #define MACRO_NUM 4
 #endif
 
-#ifndef MACRO_MAX_ACTIONS
-#define MACRO_MAX_ACTIONS 128
+// Bytes shared by all macros, an action takes 2 to 5 bytes once encoded
+#ifndef MACRO_POOL_SIZE
+#define MACRO_POOL_SIZE 4096
+#endif
+
+// Bytes read from flash at a time when a macro outgrows the pool and plays from its stream file
+#ifndef MACRO_STREAM_CHUNK_SIZE
+#define MACRO_STREAM_CHUNK_SIZE 64
 #endif
 
 #define MACRO_KEYCODE_GET_INDEX(keycode) (KEYCODE_GET_SUB((keycode)) & 0x0F)
@@ -52,18 +58,40 @@ typedef struct __MacroAction
     KeyboardEvent event;
 } MacroAction;
 
+// Decoder state, actions are stored relative to the one before them, delays are in ticks
+typedef struct __MacroCursor
+{
+    uint16_t offset;
+    uint16_t key_id;
+    Keycode keycode;
+    uint32_t delay;
+} MacroCursor;
+
 typedef struct __Macro
 {
     uint8_t state;
-    uint32_t begin_tick;
+    uint32_t begin_time;
     uint16_t length;
     uint16_t index;
-    MacroAction* actions;
+    uint16_t offset;
+    uint16_t size;
+    MacroCursor cursor;
+    MacroCursor tail;
+    bool streamed;
+    uint32_t stream_size;
 } Macro;
 
 extern Macro g_macros[MACRO_NUM];
 
 void macro_init(void);
+void macro_factory_reset(void);
+void macro_clear(Macro*macro);
+bool macro_append(Macro*macro, const MacroAction*action);
+bool macro_get_action(const Macro*macro, uint16_t index, MacroAction*action);
+bool macro_set_action(Macro*macro, uint16_t index, const MacroAction*action);
+uint16_t macro_get_free_space(void);
+void macro_save(void);
+void macro_load(void);
 
 void macro_event_handler(KeyboardEvent event);
 void macro_record_handler(KeyboardEvent event);
@@ -73,6 +101,7 @@ void macro_record(Macro*macro,KeyboardEvent event);
 void macro_start_play_once(Macro*macro);
 void macro_start_play_circularly(Macro*macro);
 void macro_stop_play(Macro*macro);
+void macro_task(void);
 void macro_process(void);
 
 #ifdef __cplusplus
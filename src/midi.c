@@ -9,6 +9,7 @@
 
 #include <math.h>
 #include <stddef.h>
+#include <string.h>
 
 #define USB_MIDI_CABLE                 0x00
 #define USB_MIDI_CIN_2BYTE_SYSTEM      0x02
@@ -25,6 +26,11 @@
 
 #define MIDI_RX_CAPACITY               192
 
+#define MIDI_CC_DATA_ENTRY_MSB         0x06
+#define MIDI_CC_DATA_ENTRY_LSB         0x26
+#define MIDI_CC_DATA_INCREMENT         0x60
+#define MIDI_CC_RPN_MSB                0x65
+
 #define MIDI_DATA_LIMIT                0x7F
 #define MIDI_STATUS_BIT                0x80
 #define MIDI_STATUS_GROUP_MASK         0xF0
@@ -54,6 +60,12 @@ typedef struct {
     uint8_t count;
 } MidiInputQueue;
 
+typedef struct {
+    MIDIEventPacket packets[MIDI_TX_QUEUE_SIZE];
+    uint16_t head;
+    uint16_t count;
+} MidiOutputQueue;
+
 typedef struct {
     MidiInputQueue input;
     uint8_t active_status;
@@ -65,12 +77,24 @@ typedef struct {
 } MidiRuntime;
 
 static MidiRuntime midi_runtime;
+static MidiOutputQueue midi_tx_queue;
 static uint8_t tone_status[MIDI_TONE_COUNT];
 
+typedef struct {
+    AdvancedKey* key;
+    uint8_t channel;
+    uint8_t note;
+    uint8_t pressure;
+    uint32_t tick;
+} MidiAftertouchNote;
+
+static MidiAftertouchNote midi_aftertouch_notes[MIDI_AFTERTOUCH_NOTE_NUM];
+
 static uint8_t midi_modulation;
 static int8_t midi_modulation_step;
 static uint16_t midi_modulation_timer;
 MIDIConfig midi_config;
+MIDITxStats midi_tx_stats;
 
 static uint8_t usb_midi_event(uint8_t cable, uint8_t cin)
 {
@@ -461,6 +485,71 @@ static void midi_runtime_input_packet(MidiRuntime* runtime, MIDIEventPacket* eve
     }
 }
 
+// Only continuous values may be replaced, (N)RPN data entry depends on the parameter selected before it
+static bool midi_tx_is_continuous(const MIDIEventPacket* event)
+{
+    switch (event->Data1 & MIDI_STATUS_GROUP_MASK)
+    {
+    case MIDI_STATUS_AFTERTOUCH:
+    case MIDI_STATUS_CHANNEL_PRESSURE:
+    case MIDI_STATUS_PITCH_BEND:
+        return true;
+    case MIDI_STATUS_CONTROL_CHANGE:
+        return event->Data2 != MIDI_CC_DATA_ENTRY_MSB && event->Data2 != MIDI_CC_DATA_ENTRY_LSB &&
+               (event->Data2 < MIDI_CC_DATA_INCREMENT || event->Data2 > MIDI_CC_RPN_MSB);
+    default:
+        return false;
+    }
+}
+
+static bool midi_tx_same_target(const MIDIEventPacket* a, const MIDIEventPacket* b)
+{
+    if (a->Event != b->Event || a->Data1 != b->Data1)
+    {
+        return false;
+    }
+    switch (a->Data1 & MIDI_STATUS_GROUP_MASK)
+    {
+    case MIDI_STATUS_AFTERTOUCH:
+    case MIDI_STATUS_CONTROL_CHANGE:
+        return a->Data2 == b->Data2;
+    default:
+        return true;
+    }
+}
+
+// A queued value of the same controller is overwritten in place, as long as no
+// note or other ordered message sits between the two
+static int midi_tx_push(const MIDIEventPacket* event)
+{
+    MidiOutputQueue* queue = &midi_tx_queue;
+    if (midi_tx_is_continuous(event))
+    {
+        for (uint16_t i = queue->count; i > 0; i--)
+        {
+            MIDIEventPacket* queued = &queue->packets[(queue->head + i - 1) % MIDI_TX_QUEUE_SIZE];
+            if (!midi_tx_is_continuous(queued))
+            {
+                break;
+            }
+            if (midi_tx_same_target(queued, event))
+            {
+                *queued = *event;
+                midi_tx_stats.coalesced++;
+                return 0;
+            }
+        }
+    }
+    if (queue->count == MIDI_TX_QUEUE_SIZE)
+    {
+        midi_tx_stats.dropped++;
+        return 1;
+    }
+    queue->packets[(queue->head + queue->count) % MIDI_TX_QUEUE_SIZE] = *event;
+    queue->count++;
+    return 0;
+}
+
 static int midi_send_packet(uint8_t cin, uint8_t data1, uint8_t data2, uint8_t data3)
 {
     MIDIEventPacket event;
@@ -509,6 +598,79 @@ static int midi_send_pitch_bend(uint8_t channel, int16_t amount)
     return midi_send_message3(MIDI_STATUS_PITCH_BEND | (channel & MIDI_CHANNEL_MASK), value & MIDI_DATA_LIMIT, (value >> 7) & MIDI_DATA_LIMIT);
 }
 
+static uint8_t midi_key_pressure(AdvancedKey* key)
+{
+    return (uint32_t)(key->value - ANALOG_VALUE_MIN) * MIDI_DATA_LIMIT / ANALOG_VALUE_RANGE;
+}
+
+static void midi_aftertouch_begin(Key* key, uint8_t channel, uint8_t note)
+{
+    if (!IS_ADVANCED_KEY(key))
+    {
+        return;
+    }
+    for (uint8_t i = 0; i < MIDI_AFTERTOUCH_NOTE_NUM; i++)
+    {
+        MidiAftertouchNote* slot = &midi_aftertouch_notes[i];
+        if (!slot->key)
+        {
+            slot->key = (AdvancedKey*)key;
+            slot->channel = channel;
+            slot->note = note;
+            // The note on already carries the initial pressure
+            slot->pressure = midi_key_pressure(slot->key);
+            slot->tick = g_keyboard_tick;
+            return;
+        }
+    }
+}
+
+static void midi_aftertouch_end(uint8_t channel, uint8_t note)
+{
+    for (uint8_t i = 0; i < MIDI_AFTERTOUCH_NOTE_NUM; i++)
+    {
+        MidiAftertouchNote* slot = &midi_aftertouch_notes[i];
+        if (slot->key && slot->channel == channel && slot->note == note)
+        {
+            slot->key = NULL;
+        }
+    }
+}
+
+// Held notes whose pressure changed are queued together and leave in the next transfer
+static void midi_aftertouch_process(void)
+{
+    if (!midi_config.aftertouch)
+    {
+        return;
+    }
+    for (uint8_t i = 0; i < MIDI_AFTERTOUCH_NOTE_NUM; i++)
+    {
+        MidiAftertouchNote* slot = &midi_aftertouch_notes[i];
+        if (!slot->key || g_keyboard_tick - slot->tick < MIDI_AFTERTOUCH_INTERVAL)
+        {
+            continue;
+        }
+        uint8_t pressure = midi_key_pressure(slot->key);
+        if (pressure == slot->pressure)
+        {
+            continue;
+        }
+        MIDIEventPacket event;
+        event.Event = usb_midi_event(USB_MIDI_CABLE, midi_usb_cin_for_status(MIDI_STATUS_AFTERTOUCH));
+        event.Data1 = MIDI_STATUS_AFTERTOUCH | (slot->channel & MIDI_CHANNEL_MASK);
+        event.Data2 = slot->note & MIDI_DATA_LIMIT;
+        event.Data3 = pressure;
+        // A full queue keeps the old pressure so the note retries on the next task
+        if (midi_tx_push(&event))
+        {
+            return;
+        }
+        slot->pressure = pressure;
+        slot->tick = g_keyboard_tick;
+    }
+}
+
 void midi_init(void)
 {
     midi_config.octave = MIDI_OCTAVE_2 - MIDI_OCTAVE_MIN;
@@ -516,12 +678,18 @@ void midi_init(void)
     midi_config.velocity = 127;
     midi_config.channel = 0;
     midi_config.modulation_interval = 8;
+    midi_config.aftertouch = true;
 
     for (uint8_t i = 0; i < MIDI_TONE_COUNT; i++)
     {
         tone_status[i] = MIDI_INVALID_NOTE;
     }
 
+    memset(midi_aftertouch_notes, 0, sizeof(midi_aftertouch_notes));
+    midi_tx_queue.head = 0;
+    midi_tx_queue.count = 0;
+    memset(&midi_tx_stats, 0, sizeof(midi_tx_stats));
+
     midi_modulation = 0;
     midi_modulation_step = 0;
     midi_modulation_timer = 0;
@@ -539,12 +707,9 @@ void midi_event_handler(KeyboardEvent event)
     uint8_t velocity = 0;
     if (IS_ADVANCED_KEY(event.key))
     {
-        float intensity = fabs(((AdvancedKey*)event.key)->difference * (POLLING_RATE / 1000) / (float)MIDI_REF_VELOCITY);
-        if (intensity > 1.0f)
-        {
-            intensity = 1.0f;
-        }
-        velocity = intensity * 127;
+        int32_t key_velocity = ((AdvancedKey*)event.key)->velocity;
+        uint32_t speed = key_velocity < 0 ? -key_velocity : key_velocity;
+        velocity = speed >= MIDI_REF_VELOCITY_Q8 ? 127 : speed * 127 / MIDI_REF_VELOCITY_Q8;
     }
     else
     {
@@ -558,9 +723,11 @@ void midi_event_handler(KeyboardEvent event)
         {
         case KEYBOARD_EVENT_KEY_DOWN:
             (void)midi_send_note_on(channel, keycode, velocity);
+            midi_aftertouch_begin(event.key, channel, keycode);
             break;
         case KEYBOARD_EVENT_KEY_UP:
             (void)midi_send_note_off(channel, keycode, velocity);
+            midi_aftertouch_end(channel, keycode);
             break;
         default:
             break;
@@ -580,6 +747,7 @@ void midi_event_handler(KeyboardEvent event)
             {
                 uint8_t note = midi_compute_note(keycode);
                 (void)midi_send_note_on(channel, note, velocity);
+                midi_aftertouch_begin(event.key, channel, note);
                 tone_status[tone] = note;
             }
         }
@@ -589,6 +757,7 @@ void midi_event_handler(KeyboardEvent event)
             if (note != MIDI_INVALID_NOTE)
             {
                 (void)midi_send_note_off(channel, note, velocity);
+                midi_aftertouch_end(channel, note);
             }
             tone_status[tone] = MIDI_INVALID_NOTE;
         }
@@ -760,7 +929,31 @@ int midi_send(MIDIEventPacket* event)
     {
         return 1;
     }
-    return send_midi((uint8_t*)event, sizeof(MIDIEventPacket));
+    int ret = midi_tx_push(event);
+    midi_flush();
+    return ret;
+}
+
+void midi_flush(void)
+{
+    MIDIEventPacket packets[MIDI_PACKETS_PER_TRANSFER];
+    while (midi_tx_queue.count)
+    {
+        uint16_t count = midi_tx_queue.count < MIDI_PACKETS_PER_TRANSFER ? midi_tx_queue.count : MIDI_PACKETS_PER_TRANSFER;
+        for (uint16_t i = 0; i < count; i++)
+        {
+            packets[i] = midi_tx_queue.packets[(midi_tx_queue.head + i) % MIDI_TX_QUEUE_SIZE];
+        }
+        // A busy endpoint keeps the packets queued for the next attempt
+        if (send_midi((uint8_t*)packets, count * sizeof(MIDIEventPacket)))
+        {
+            return;
+        }
+        midi_tx_queue.head = (midi_tx_queue.head + count) % MIDI_TX_QUEUE_SIZE;
+        midi_tx_queue.count -= count;
+        midi_tx_stats.transfers++;
+        midi_tx_stats.packets += count;
+    }
 }
 
 void midi_input_callback(MIDIEventPacket* event)
@@ -775,6 +968,8 @@ void midi_input_callback(MIDIEventPacket* event)
 void midi_task(void)
 {
     midi_runtime_process(&midi_runtime);
+    midi_aftertouch_process();
+    midi_flush();
 #ifdef MIDI_ADVANCED
     if ((int32_t)(KEYBOARD_TICK_TO_TIME(g_keyboard_tick) - midi_modulation_timer) < midi_config.modulation_interval)
     {
@@ -31,6 +31,31 @@ extern "C" {
 #define MIDI_TONE_COUNT                     (MIDI_TONE_MAX - MIDI_TONE_MIN + 1)
 #define MIDI_MESSAGE_NO_CHANNEL             0xFF
 
+// Travel per millisecond, normalized to the analog range, that maps to full note velocity
+#ifndef MIDI_REF_VELOCITY
+#define MIDI_REF_VELOCITY 0.01
+#endif
+// Folded at compile time into the Q8 per tick unit of AdvancedKey::velocity
+#define MIDI_REF_VELOCITY_Q8 ((uint32_t)(MIDI_REF_VELOCITY * ANALOG_VALUE_RANGE * (1 << ADVANCED_KEY_VELOCITY_Q) * 1000.0 / POLLING_RATE))
+
+// Held analog notes that stream polyphonic aftertouch
+#ifndef MIDI_AFTERTOUCH_NOTE_NUM
+#define MIDI_AFTERTOUCH_NOTE_NUM 16
+#endif
+// Minimum ticks between two aftertouch messages of the same note
+#ifndef MIDI_AFTERTOUCH_INTERVAL
+#define MIDI_AFTERTOUCH_INTERVAL KEYBOARD_TIME_TO_TICK(10)
+#endif
+// 4-byte event packets that fit in one bulk transfer
+#ifndef MIDI_PACKETS_PER_TRANSFER
+#define MIDI_PACKETS_PER_TRANSFER 16
+#endif
+
+// Outgoing event packets buffered while the endpoint is busy
+#ifndef MIDI_TX_QUEUE_SIZE
+#define MIDI_TX_QUEUE_SIZE 64
+#endif
+
 #ifndef MIDI_DEFAULT_AUDIO_HANDLER_ENABLE
 #    define MIDI_DEFAULT_AUDIO_HANDLER_ENABLE 1
 #endif
@@ -76,15 +101,25 @@ typedef union {
         uint8_t velocity : 7;
         uint8_t channel : 4;
         uint8_t modulation_interval : 4;
+        uint8_t aftertouch : 1;
     };
 } MIDIConfig;
 
+typedef struct {
+    uint32_t transfers;
+    uint32_t packets;
+    uint32_t coalesced;
+    uint32_t dropped;
+} MIDITxStats;
+
 extern MIDIConfig midi_config;
+extern MIDITxStats midi_tx_stats;
 
 void midi_init(void);
 void midi_task(void);
 void midi_event_handler(KeyboardEvent event);
 int midi_send(MIDIEventPacket *event);
+void midi_flush(void);
 void midi_input_callback(MIDIEventPacket *event);
 uint8_t midi_compute_note(uint16_t keycode);
 void midi_message_callback(const MIDIMessage *message);
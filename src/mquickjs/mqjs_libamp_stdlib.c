@@ -38,6 +38,8 @@ static const JSPropDef js_advanced_key_proto[] = {
     JS_CGETSET_MAGIC_DEF("lowerDeadzone", js_advanced_key_get, js_advanced_key_set, 13),
     JS_CGETSET_MAGIC_DEF("upperBound", js_advanced_key_get, js_advanced_key_set, 14),
     JS_CGETSET_MAGIC_DEF("lowerBound", js_advanced_key_get, js_advanced_key_set, 15),
+    JS_CGETSET_MAGIC_DEF("velocity", js_advanced_key_get, js_advanced_key_set, 16),
+    JS_CGETSET_MAGIC_DEF("acceleration", js_advanced_key_get, js_advanced_key_set, 17),
     JS_PROP_END,
 };
 
@@ -55,6 +57,9 @@ static const JSPropDef js_keyboard[] = {
     JS_CFUNC_MAGIC_DEF("getTick", 0, js_keyboard_get_tick,0),
     JS_CFUNC_MAGIC_DEF("getTime", 0, js_keyboard_get_tick,1),
     JS_CFUNC_DEF("watch", 1, js_keyboard_watch),
+    JS_CFUNC_DEF("getAnalogValues", 0, js_keyboard_get_analog_values),
+    JS_CFUNC_DEF("onThreshold", 4, js_keyboard_on_threshold),
+    JS_CFUNC_DEF("clearThreshold", 1, js_keyboard_clear_threshold),
     JS_CFUNC_MAGIC_DEF("press", 1, js_keyboard_press_release,0),
     JS_CFUNC_MAGIC_DEF("release", 1, js_keyboard_press_release,1),
     JS_CFUNC_DEF("tap", 1, js_keyboard_tap),
@@ -78,6 +83,9 @@ static const JSPropDef js_rgb[] = {
     JS_CFUNC_MAGIC_DEF("setRGB", 4, js_rgb_set_led, 0),
     JS_CFUNC_MAGIC_DEF("setHSV", 4, js_rgb_set_led, 1),
     JS_CFUNC_DEF("setMode", 2, js_rgb_set_led_mode),
+    JS_CFUNC_DEF("setOverlay", 5, js_rgb_set_overlay),
+    JS_CFUNC_DEF("setOverlayBlend", 2, js_rgb_set_overlay_blend),
+    JS_CFUNC_DEF("clearOverlay", 0, js_rgb_clear_overlay),
     JS_PROP_END,
 };
 static const JSClassDef js_rgb_obj =
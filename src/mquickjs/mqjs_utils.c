@@ -24,6 +24,7 @@
  */
 
 #include "script.h"
+#include "scheduler.h"
 #include "layer.h"
 #include "event_cache.h"
 #include "stdio.h"
@@ -47,10 +48,137 @@ typedef struct {
     JSGCRef func;
     uint16_t type;
     Keycode keycode;
-    int32_t timeout; /* in ms */
+    uint32_t deadline; /* in us, see scheduler_get_time_us() */
+    uint8_t heap_index;
 } JSTimer;
 
 static JSTimer js_timer_list[SCRIPT_MAX_TIMERS];
+// Min-heap of timer slots ordered by deadline
+static uint8_t js_timer_heap[SCRIPT_MAX_TIMERS];
+static uint8_t js_timer_heap_size;
+
+static inline bool js_timer_before(uint8_t a, uint8_t b)
+{
+    return (int32_t)(js_timer_list[a].deadline - js_timer_list[b].deadline) < 0;
+}
+
+static void js_timer_heap_swap(uint8_t i, uint8_t j)
+{
+    uint8_t temp = js_timer_heap[i];
+    js_timer_heap[i] = js_timer_heap[j];
+    js_timer_heap[j] = temp;
+    js_timer_list[js_timer_heap[i]].heap_index = i;
+    js_timer_list[js_timer_heap[j]].heap_index = j;
+}
+
+static void js_timer_heap_sift_up(uint8_t i)
+{
+    while (i > 0)
+    {
+        uint8_t parent = (i - 1) / 2;
+        if (!js_timer_before(js_timer_heap[i], js_timer_heap[parent]))
+        {
+            break;
+        }
+        js_timer_heap_swap(i, parent);
+        i = parent;
+    }
+}
+
+static void js_timer_heap_sift_down(uint8_t i)
+{
+    while (true)
+    {
+        uint8_t smallest = i;
+        uint8_t left = 2 * i + 1;
+        uint8_t right = 2 * i + 2;
+        if (left < js_timer_heap_size && js_timer_before(js_timer_heap[left], js_timer_heap[smallest]))
+        {
+            smallest = left;
+        }
+        if (right < js_timer_heap_size && js_timer_before(js_timer_heap[right], js_timer_heap[smallest]))
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            break;
+        }
+        js_timer_heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+static void script_timer_wake(void *owner);
+
+// Only the earliest script timer is kept in the shared scheduler
+static void js_timer_arm(void)
+{
+    if (js_timer_heap_size)
+    {
+        scheduler_set(js_timer_list, script_timer_wake, js_timer_list[js_timer_heap[0]].deadline);
+    }
+    else
+    {
+        scheduler_cancel(js_timer_list);
+    }
+}
+
+// Returns the slot of the new timer, or -1 when all slots are taken
+static int js_timer_alloc(uint16_t type, int delay_ms)
+{
+    for (int i = 0; i < SCRIPT_MAX_TIMERS; i++)
+    {
+        JSTimer *th = &js_timer_list[i];
+        if (!th->allocated)
+        {
+            uint32_t delay = (uint32_t)(delay_ms > 0 ? delay_ms : 0) * 1000;
+            // Timers never fire in the tick that created them, so zero delays cannot spin
+            if (delay < SCHEDULER_TICK_TO_US(1))
+            {
+                delay = SCHEDULER_TICK_TO_US(1);
+            }
+            th->deadline = scheduler_get_time_us() + delay;
+            th->type = type;
+            th->allocated = TRUE;
+            th->heap_index = js_timer_heap_size;
+            js_timer_heap[js_timer_heap_size++] = i;
+            js_timer_heap_sift_up(th->heap_index);
+            js_timer_arm();
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void js_timer_free(int index)
+{
+    JSTimer *th = &js_timer_list[index];
+    if (!th->allocated)
+    {
+        return;
+    }
+    uint8_t i = th->heap_index;
+    th->allocated = FALSE;
+    js_timer_heap_size--;
+    if (i != js_timer_heap_size)
+    {
+        js_timer_heap_swap(i, js_timer_heap_size);
+        js_timer_heap_sift_down(i);
+        js_timer_heap_sift_up(i);
+    }
+    js_timer_arm();
+}
+
+// Slot of the earliest timer that is due at time_us, or -1
+static int js_timer_peek_due(uint32_t time_us)
+{
+    if (!js_timer_heap_size || (int32_t)(js_timer_list[js_timer_heap[0]].deadline - time_us) > 0)
+    {
+        return -1;
+    }
+    return js_timer_heap[0];
+}
 
 static int64_t get_time_ms(void)
 {
@@ -219,6 +347,12 @@ static JSValue js_advanced_key_get(JSContext *ctx, JSValue *this_val, int argc,
     case 15:
         return JS_NewInt32(ctx, key->config.lower_bound);
         break;
+    case 16:
+        return JS_NewInt32(ctx, ADVANCED_KEY_VELOCITY(key));
+        break;
+    case 17:
+        return JS_NewInt32(ctx, key->acceleration);
+        break;
     default:
         break;
     }
@@ -301,6 +435,109 @@ static void watch_recursive(JSContext *ctx, JSValue val)
     }
 }
 
+/* analog */
+typedef struct {
+    BOOL allocated;
+    JSGCRef func;
+    uint16_t id;
+    AnalogValue threshold;
+    AnalogValue hysteresis;
+    bool above;
+} JSAnalogThreshold;
+
+static JSAnalogThreshold js_analog_threshold_list[SCRIPT_MAX_ANALOG_THRESHOLDS];
+
+// Array of effective values indexed by advanced key id, created on first use and refreshed in place
+static JSGCRef js_analog_array_ref;
+static JSValue *js_analog_array_ptr = NULL;
+static AnalogValue js_analog_values[ADVANCED_KEY_NUM];
+
+static JSValue js_keyboard_get_analog_values(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
+{
+    if (!js_analog_array_ptr)
+    {
+        JSValue *array = JS_AddGCRef(ctx, &js_analog_array_ref);
+        *array = JS_NewArray(ctx, ADVANCED_KEY_NUM);
+        if (JS_IsException(*array))
+        {
+            JS_DeleteGCRef(ctx, &js_analog_array_ref);
+            return JS_EXCEPTION;
+        }
+        for (uint16_t i = 0; i < ADVANCED_KEY_NUM; i++)
+        {
+            js_analog_values[i] = keyboard_get_key_effective_analog_value(&g_keyboard_advanced_keys[i].key);
+            JS_SetPropertyUint32(ctx, *array, i, JS_NewInt32(ctx, js_analog_values[i]));
+        }
+        js_analog_array_ptr = array;
+    }
+    return *js_analog_array_ptr;
+}
+
+// Small integers are stored unboxed, so refreshing the array never allocates
+static void js_analog_refresh(JSContext *ctx)
+{
+    if (!js_analog_array_ptr)
+    {
+        return;
+    }
+    for (uint16_t i = 0; i < ADVANCED_KEY_NUM; i++)
+    {
+        if (!BIT_GET(g_script_watcher_mask[i / 32], i % 32))
+        {
+            continue;
+        }
+        AnalogValue value = keyboard_get_key_effective_analog_value(&g_keyboard_advanced_keys[i].key);
+        if (value != js_analog_values[i])
+        {
+            js_analog_values[i] = value;
+            JS_SetPropertyUint32(ctx, *js_analog_array_ptr, i, JS_NewInt32(ctx, value));
+        }
+    }
+}
+
+static JSValue js_keyboard_on_threshold(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
+{
+    int id, threshold, hysteresis = 0;
+    JSValue *pfunc;
+    if (JS_ToInt32(ctx, &id, argv[0]) || JS_ToInt32(ctx, &threshold, argv[1]))
+        return JS_EXCEPTION;
+    if (!JS_IsFunction(ctx, argv[2]))
+        return JS_ThrowTypeError(ctx, "not a function");
+    if (argc > 3)
+        JS_ToInt32(ctx, &hysteresis, argv[3]);
+    if (id < 0 || id >= ADVANCED_KEY_NUM)
+        return JS_ThrowRangeError(ctx, "Key index out of range");
+    for (int i = 0; i < SCRIPT_MAX_ANALOG_THRESHOLDS; i++) {
+        JSAnalogThreshold *th = &js_analog_threshold_list[i];
+        if (!th->allocated) {
+            pfunc = JS_AddGCRef(ctx, &th->func);
+            *pfunc = argv[2];
+            th->id = id;
+            th->threshold = threshold < ANALOG_VALUE_MIN ? ANALOG_VALUE_MIN : (threshold > ANALOG_VALUE_MAX ? ANALOG_VALUE_MAX : threshold);
+            th->hysteresis = hysteresis < 0 ? 0 : (hysteresis > ANALOG_VALUE_MAX ? ANALOG_VALUE_MAX : hysteresis);
+            th->above = keyboard_get_key_effective_analog_value(&g_keyboard_advanced_keys[id].key) >= th->threshold;
+            th->allocated = TRUE;
+            return JS_NewInt32(ctx, i);
+        }
+    }
+    return JS_ThrowInternalError(ctx, "too many thresholds");
+}
+
+static JSValue js_keyboard_clear_threshold(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
+{
+    int index;
+    if (JS_ToInt32(ctx, &index, argv[0]))
+        return JS_EXCEPTION;
+    if (index >= 0 && index < SCRIPT_MAX_ANALOG_THRESHOLDS) {
+        JSAnalogThreshold *th = &js_analog_threshold_list[index];
+        if (th->allocated) {
+            JS_DeleteGCRef(ctx, &th->func);
+            th->allocated = FALSE;
+        }
+    }
+    return JS_UNDEFINED;
+}
+
 static JSValue js_keyboard_watch(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
 {
     for (int i = 0; i < argc; i++)
@@ -350,7 +587,6 @@ static JSValue js_keyboard_press_release(JSContext *ctx, JSValue *this_val, int
 
 static JSValue js_keyboard_tap(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
 {
-    JSTimer *th;
     int keycode;
     int duration_ms = 100;
     if (JS_ToInt32(ctx, &keycode, argv[0]))
@@ -359,15 +595,10 @@ static JSValue js_keyboard_tap(JSContext *ctx, JSValue *this_val, int argc, JSVa
     }
     JS_ToInt32(ctx, &duration_ms, argv[1]);
     js_keyboard_press(ctx, keycode, true);
-    for(int i = 0; i < SCRIPT_MAX_TIMERS; i++) {
-        th = &js_timer_list[i];
-        if (!th->allocated) {
-            th->timeout = get_time_ms() + duration_ms;
-            th->type = TIMER_TYPE_JS_RELEASE_KEYCODE;
-            th->keycode = keycode;
-            th->allocated = TRUE;
-            return JS_NewInt32(ctx, i);
-        }
+    int i = js_timer_alloc(TIMER_TYPE_JS_RELEASE_KEYCODE, duration_ms);
+    if (i >= 0) {
+        js_timer_list[i].keycode = keycode;
+        return JS_NewInt32(ctx, i);
     }
 
     return JS_UNDEFINED;
@@ -471,6 +702,49 @@ static JSValue js_rgb_set_led_mode(JSContext *ctx, JSValue *this_val, int argc,
     g_rgb_configs[g_rgb_inverse_mapping[index]].mode = mode;
     return JS_UNDEFINED;
 }
+
+static JSValue js_rgb_set_overlay(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
+{
+    int args[5] = {0, 0, 0, 0, 255};
+    for (int i = 0; i < argc && i < 5; i++)
+    {
+        JS_ToInt32(ctx, &args[i], argv[i]);
+    }
+    if (args[0] < 0 || args[0] >= TOTAL_KEY_NUM)
+    {
+        return JS_UNDEFINED;
+    }
+    ColorRGB rgb = {args[1], args[2], args[3]};
+    rgb_layer_set(RGB_LAYER_SCRIPT, g_rgb_inverse_mapping[args[0]], &rgb, args[4]);
+    return JS_UNDEFINED;
+}
+
+static JSValue js_rgb_set_overlay_blend(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
+{
+    int blend_mode = RGB_BLEND_MODE_ALPHA, opacity = 255;
+    for (int i = 0; i < argc; i++)
+    {
+        switch (i)
+        {
+        case 0:
+            JS_ToInt32(ctx, &blend_mode, argv[0]);
+            break;
+        case 1:
+            JS_ToInt32(ctx, &opacity, argv[1]);
+            break;
+        default:
+            break;
+        }
+    }
+    rgb_layer_set_blend(RGB_LAYER_SCRIPT, blend_mode, opacity);
+    return JS_UNDEFINED;
+}
+
+static JSValue js_rgb_clear_overlay(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
+{
+    rgb_layer_clear(RGB_LAYER_SCRIPT);
+    return JS_UNDEFINED;
+}
 #endif
 
 //static JSValue js_keyboard_suspend(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
@@ -503,7 +777,6 @@ static JSValue js_print(JSContext *ctx, JSValue *this_val, int argc, JSValue *ar
 
 static JSValue js_setTimeout(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
 {
-    JSTimer *th;
     int delay, i;
     JSValue *pfunc;
     
@@ -511,18 +784,12 @@ static JSValue js_setTimeout(JSContext *ctx, JSValue *this_val, int argc, JSValu
         return JS_ThrowTypeError(ctx, "not a function");
     if (JS_ToInt32(ctx, &delay, argv[1]))
         return JS_EXCEPTION;
-    for(i = 0; i < SCRIPT_MAX_TIMERS; i++) {
-        th = &js_timer_list[i];
-        if (!th->allocated) {
-            pfunc = JS_AddGCRef(ctx, &th->func);
-            *pfunc = argv[0];
-            th->timeout = get_time_ms() + delay;
-            th->type = 0;
-            th->allocated = TRUE;
-            return JS_NewInt32(ctx, i);
-        }
-    }
-    return JS_ThrowInternalError(ctx, "too many timers");
+    i = js_timer_alloc(TIMER_TYPE_JS_TIMEOUT, delay);
+    if (i < 0)
+        return JS_ThrowInternalError(ctx, "too many timers");
+    pfunc = JS_AddGCRef(ctx, &js_timer_list[i].func);
+    *pfunc = argv[0];
+    return JS_NewInt32(ctx, i);
 }
 
 static JSValue js_clearTimeout(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
@@ -534,9 +801,9 @@ static JSValue js_clearTimeout(JSContext *ctx, JSValue *this_val, int argc, JSVa
         return JS_EXCEPTION;
     if (timer_id >= 0 && timer_id < SCRIPT_MAX_TIMERS) {
         th = &js_timer_list[timer_id];
-        if (th->allocated) {
+        if (th->allocated && th->type == TIMER_TYPE_JS_TIMEOUT) {
             JS_DeleteGCRef(ctx, &th->func);
-            th->allocated = FALSE;
+            js_timer_free(timer_id);
         }
     }
     return JS_UNDEFINED;
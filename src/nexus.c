@@ -11,19 +11,44 @@
 #include "string.h"
 #include "storage.h"
 #include "analog.h"
+#include "scheduler.h"
 
-#define NEXUS_TIMEOUT  POLLING_RATE
 #define NEXUS_MIN(a, b) ((a) < (b) ? (a) : (b))
 #define NEXUS_LOCAL_KEY_COUNT NEXUS_MIN(TOTAL_KEY_NUM, NEXUS_SLICE_LENGTH_MAX)
 #define NEXUS_LOCAL_ADVANCED_KEY_COUNT NEXUS_MIN(ADVANCED_KEY_NUM, NEXUS_SLICE_LENGTH_MAX)
 #define NEXUS_LOCAL_BITMAP_SIZE ((NEXUS_LOCAL_KEY_COUNT + 7) / 8)
+#define NEXUS_SEQUENCE_MARK 0x80
+#define NEXUS_SEQUENCE_MASK 0x7F
+#define NEXUS_DELTA_MAX (NEXUS_VALUE_SIZE ? (1L << (NEXUS_VALUE_SIZE * 8 - 1)) - 1 : 0)
 
-static bool slave_flags[NEXUS_SLAVE_NUM];
 static uint32_t slave_bitmap[NEXUS_SLAVE_NUM][(NEXUS_SLICE_LENGTH_MAX+31)/32];
+static uint8_t slave_sequence[NEXUS_SLAVE_NUM];
+// Keys whose value matches the slave, deltas are only applied on top of these
+static uint8_t slave_synced[NEXUS_SLAVE_NUM][NEXUS_BITMAP_SIZE];
+static uint16_t slave_values[NEXUS_SLAVE_NUM][NEXUS_SLICE_LENGTH_MAX];
+// Local keys whose configuration still has to reach the slave
+static uint8_t slave_config_dirty[NEXUS_SLAVE_NUM][NEXUS_BITMAP_SIZE];
+// Slaves that let a request run out of retries, nothing is sent to them until they are heard from again
+static bool slave_offline[NEXUS_SLAVE_NUM];
+
+typedef struct __NexusRequest
+{
+    uint16_t local_index;
+    uint8_t slave_id;
+    uint8_t seq;
+    uint8_t retry_count;
+    bool active;
+} NexusRequest;
+
+static NexusRequest nexus_requests[NEXUS_SLAVE_NUM][NEXUS_PIPELINE_DEPTH];
 #if NEXUS_USE_RAW
-AnalogRawValue nexus_slave_raw_values[85];
+#if NEXUS_SLICE_LENGTH_MAX > 255
+#error "Raw reports count at most 255 keys per slave"
+#endif
+static AnalogRawValue slave_raw_values[NEXUS_SLAVE_NUM][NEXUS_SLICE_LENGTH_MAX];
 #endif
 uint8_t g_nexus_slave_buffer[NEXUS_SLAVE_NUM][NEXUS_BUFFER_SIZE];
+NexusSlaveStats g_nexus_slave_stats[NEXUS_SLAVE_NUM];
 
 __WEAK NexusSlaveConfig g_nexus_slave_configs[NEXUS_SLAVE_NUM];
 
@@ -37,52 +62,180 @@ static uint16_t nexus_slave_config_length(uint8_t slave_id)
     return length;
 }
 
-static int nexus_send_advanced_key_config(uint8_t slave_id, uint16_t local_index, uint16_t key_index)
+static uint16_t nexus_read_value(const uint8_t *buf)
+{
+#if NEXUS_VALUE_SIZE == 2
+    return buf[0] | (buf[1] << 8);
+#elif NEXUS_VALUE_SIZE == 1
+    return buf[0];
+#else
+    UNUSED(buf);
+    return 0;
+#endif
+}
+
+static int32_t nexus_read_delta(const uint8_t *buf)
+{
+#if NEXUS_VALUE_SIZE == 2
+    return (int16_t)(buf[0] | (buf[1] << 8));
+#elif NEXUS_VALUE_SIZE == 1
+    return (int8_t)buf[0];
+#else
+    UNUSED(buf);
+    return 0;
+#endif
+}
+
+static uint8_t *nexus_write_value(uint8_t *buf, uint16_t value)
+{
+#if NEXUS_VALUE_SIZE >= 1
+    *buf++ = value & 0xFF;
+#endif
+#if NEXUS_VALUE_SIZE == 2
+    *buf++ = value >> 8;
+#endif
+    UNUSED(value);
+    return buf;
+}
+
+static uint8_t nexus_next_sequence(void)
+{
+    static uint8_t sequence;
+    uint8_t seq = ++sequence;
+    if (seq == 0)
+    {
+        seq = ++sequence;
+    }
+    return seq;
+}
+
+static int nexus_encode_request(uint8_t *frame_report, uint8_t seq, const uint8_t *report, uint16_t len)
+{
+    if (report == NULL || len < 2 || len - 2 > AMP_FRAME_MAX_PAYLOAD)
+    {
+        return 1;
+    }
+    return amp_frame_encode(frame_report, AMP_CHANNEL_NEXUS_CTRL, AMP_FRAME_FLAG_REQ_ACK, seq,
+                            report[0], report[1], report + 2, (uint8_t)(len - 2));
+}
+
+static void nexus_request_timer(void *owner);
+
+// The configuration is read again on every attempt, so a retry carries the latest values
+static void nexus_request_send(NexusRequest *request)
 {
     PacketAdvancedKey packet;
+    uint8_t frame_report[AMP_FRAME_REPORT_SIZE];
+    const uint16_t key_index = g_nexus_slave_configs[request->slave_id].map[request->local_index];
     memset(&packet, 0, sizeof(packet));
     packet.code = PACKET_CODE_SET;
     packet.type = PACKET_DATA_ADVANCED_KEY;
-    packet.index = local_index;
+    packet.index = request->local_index;
     memcpy(&packet.data, &g_keyboard_advanced_keys[key_index].config, sizeof(AdvancedKeyConfiguration));
-    return nexus_send_timeout(slave_id, (const uint8_t *)&packet, sizeof(packet), NEXUS_TIMEOUT);
+    if (nexus_encode_request(frame_report, request->seq, (const uint8_t *)&packet, sizeof(packet)))
+    {
+        request->active = false;
+        return;
+    }
+    if (!scheduler_set(request, nexus_request_timer, scheduler_get_time_us() + SCHEDULER_TICK_TO_US(NEXUS_REQUEST_TIMEOUT)))
+    {
+        // Without a timer the frame would never be retried, the next pump sends it again
+        request->active = false;
+        BIT_SET(slave_config_dirty[request->slave_id][request->local_index / 8], request->local_index % 8);
+        return;
+    }
+    // A failed send is left to the timer like a lost response
+    (void)nexus_send(request->slave_id, frame_report, AMP_FRAME_REPORT_SIZE);
 }
 
-static inline int nexus_config_slave(uint8_t slave_id)
+static void nexus_request_timer(void *owner)
 {
-    const uint16_t length = nexus_slave_config_length(slave_id);
-    const uint16_t *map = g_nexus_slave_configs[slave_id].map;
-    int ret = 0;
+    NexusRequest *request = (NexusRequest *)owner;
+    if (!request->active)
+    {
+        return;
+    }
+    if (++request->retry_count > NEXUS_RETRY_COUNT || slave_offline[request->slave_id])
+    {
+        // Give the slot back, the key is queued again behind the others once the slave answers
+        request->active = false;
+        BIT_SET(slave_config_dirty[request->slave_id][request->local_index / 8], request->local_index % 8);
+        slave_offline[request->slave_id] = true;
+        return;
+    }
+    nexus_request_send(request);
+}
 
-    if (map == NULL)
+static void nexus_request_complete(uint8_t slave_id, uint8_t seq)
+{
+    for (uint8_t i = 0; i < NEXUS_PIPELINE_DEPTH; i++)
     {
-        return 0;
+        NexusRequest *request = &nexus_requests[slave_id][i];
+        if (request->active && request->seq == seq)
+        {
+            // The pending timer finds the slot idle or already reused
+            request->active = false;
+            return;
+        }
+    }
+}
+
+static bool nexus_request_is_pending(uint8_t slave_id, uint16_t local_index)
+{
+    for (uint8_t i = 0; i < NEXUS_PIPELINE_DEPTH; i++)
+    {
+        if (nexus_requests[slave_id][i].active && nexus_requests[slave_id][i].local_index == local_index)
+        {
+            return true;
+        }
     }
+    return false;
+}
 
+static NexusRequest *nexus_request_alloc(uint8_t slave_id)
+{
+    for (uint8_t i = 0; i < NEXUS_PIPELINE_DEPTH; i++)
+    {
+        if (!nexus_requests[slave_id][i].active)
+        {
+            return &nexus_requests[slave_id][i];
+        }
+    }
+    return NULL;
+}
+
+// Keeps up to NEXUS_PIPELINE_DEPTH configuration frames in flight per slave
+static void nexus_config_pump(uint8_t slave_id)
+{
+    const uint16_t length = nexus_slave_config_length(slave_id);
+    const uint16_t *map = g_nexus_slave_configs[slave_id].map;
+    if (map == NULL || slave_offline[slave_id])
+    {
+        return;
+    }
     for (uint16_t i = 0; i < length; i++)
     {
-        const uint16_t key_index = map[i];
-        if (key_index >= ADVANCED_KEY_NUM ||
-            nexus_send_advanced_key_config(slave_id, i, key_index) != 0)
+        if (!BIT_GET(slave_config_dirty[slave_id][i / 8], i % 8) || nexus_request_is_pending(slave_id, i))
+        {
+            continue;
+        }
+        NexusRequest *request = nexus_request_alloc(slave_id);
+        if (request == NULL)
         {
-            ret = 1;
+            return;
         }
-        /*
-        PacketKeymap *packet_keymap = (PacketKeymap *)buffer;
-        memset(buffer, 0, sizeof(packet));
-        packet_keymap->code = PACKET_CODE_SET;
-        packet_keymap->type = PACKET_DATA_KEYMAP;
-        packet_keymap->start = i;
-        packet_keymap->length = 1;
-        for (int j = 0; j < LAYER_NUM; j++)
+        BIT_RESET(slave_config_dirty[slave_id][i / 8], i % 8);
+        if (map[i] >= ADVANCED_KEY_NUM)
         {
-            packet_keymap->keymap[0] = g_keymap[j][i];
-            packet_keymap->layer = j;
-            nexus_send_timeout(slave_id,buffer,64,NEXUS_TIMEOUT);
+            continue;
         }
-        */
+        request->slave_id = slave_id;
+        request->local_index = i;
+        request->seq = nexus_next_sequence();
+        request->retry_count = 0;
+        request->active = true;
+        nexus_request_send(request);
     }
-    return ret;
 }
 
 int nexus_sync_advanced_key_config(uint16_t key_index)
@@ -92,7 +245,6 @@ int nexus_sync_advanced_key_config(uint16_t key_index)
         return 1;
     }
 
-    int ret = 0;
     for (uint8_t slave_id = 0; slave_id < NEXUS_SLAVE_NUM; slave_id++)
     {
         const uint16_t length = nexus_slave_config_length(slave_id);
@@ -104,31 +256,102 @@ int nexus_sync_advanced_key_config(uint16_t key_index)
 
         for (uint16_t local_index = 0; local_index < length; local_index++)
         {
-            if (map[local_index] == key_index &&
-                nexus_send_advanced_key_config(slave_id, local_index, key_index) != 0)
+            if (map[local_index] == key_index)
             {
-                ret = 1;
+                BIT_SET(slave_config_dirty[slave_id][local_index / 8], local_index % 8);
             }
         }
+        nexus_config_pump(slave_id);
+    }
+    return 0;
+}
+
+// Returns false after a gap, counting the reports that went missing
+static bool nexus_check_sequence(uint8_t slave_id, uint8_t sequence)
+{
+    const uint8_t expected = (slave_sequence[slave_id] + 1) & NEXUS_SEQUENCE_MASK;
+    sequence &= NEXUS_SEQUENCE_MASK;
+    slave_sequence[slave_id] = sequence;
+    if (sequence == expected)
+    {
+        return true;
+    }
+    if (g_nexus_slave_stats[slave_id].frames > 1)
+    {
+        g_nexus_slave_stats[slave_id].lost_frames += (sequence - expected) & NEXUS_SEQUENCE_MASK;
+    }
+    return false;
+}
+
+static void nexus_count_report(uint8_t slave_id)
+{
+    NexusSlaveStats *stats = &g_nexus_slave_stats[slave_id];
+    if (stats->frames)
+    {
+        const uint32_t gap = g_keyboard_tick - stats->last_seen_tick;
+        if (gap > stats->max_gap)
+        {
+            stats->max_gap = gap;
+        }
+    }
+    stats->frames++;
+    stats->last_seen_tick = g_keyboard_tick;
+}
+
+void nexus_reset_stats(uint8_t slave_id)
+{
+    if (slave_id < NEXUS_SLAVE_NUM)
+    {
+        memset(&g_nexus_slave_stats[slave_id], 0, sizeof(NexusSlaveStats));
     }
-    return ret;
 }
 
 void nexus_init(void)
 {
-    for (int i = 0; i < NEXUS_SLAVE_NUM; i++)
+    memset(g_nexus_slave_stats, 0, sizeof(g_nexus_slave_stats));
+    memset(slave_sequence, 0, sizeof(slave_sequence));
+    memset(slave_synced, 0, sizeof(slave_synced));
+    memset(slave_offline, 0, sizeof(slave_offline));
+    for (uint8_t slave_id = 0; slave_id < NEXUS_SLAVE_NUM; slave_id++)
     {
-        (void)nexus_config_slave(i);
+        for (uint8_t i = 0; i < NEXUS_PIPELINE_DEPTH; i++)
+        {
+            scheduler_cancel(&nexus_requests[slave_id][i]);
+            nexus_requests[slave_id][i].active = false;
+        }
+        const uint16_t length = nexus_slave_config_length(slave_id);
+        memset(slave_config_dirty[slave_id], 0, sizeof(slave_config_dirty[slave_id]));
+        for (uint16_t i = 0; i < length; i++)
+        {
+            BIT_SET(slave_config_dirty[slave_id][i / 8], i % 8);
+        }
+        nexus_config_pump(slave_id);
     }
 }
 
 void nexus_process(void)
 {
+    for (uint8_t slave_id = 0; slave_id < NEXUS_SLAVE_NUM; slave_id++)
+    {
+        nexus_config_pump(slave_id);
+    }
 #if NEXUS_USE_RAW
-    for (uint16_t i = 0; i < ADVANCED_KEY_NUM; i++)
+    for (uint8_t slave_id = 0; slave_id < NEXUS_SLAVE_NUM; slave_id++)
     {
-        AdvancedKey*advanced_key = &g_keyboard_advanced_keys[i];
-        keyboard_advanced_key_update_raw(advanced_key, nexus_slave_raw_values[g_analog_map[i]]);
+        const uint16_t length = nexus_slave_config_length(slave_id);
+        const uint16_t *map = g_nexus_slave_configs[slave_id].map;
+        if (map == NULL)
+        {
+            continue;
+        }
+
+        for (uint16_t j = 0; j < length; j++)
+        {
+            if (map[j] < ADVANCED_KEY_NUM)
+            {
+                keyboard_advanced_key_update_raw(&g_keyboard_advanced_keys[map[j]], slave_raw_values[slave_id][j]);
+            }
+        }
     }
 #else
     for (uint8_t slave_id = 0; slave_id < NEXUS_SLAVE_NUM; slave_id++)
@@ -150,6 +373,70 @@ void nexus_process(void)
 #endif
 }
 
+void nexus_pack_raw(uint8_t *buf, const AnalogRawValue *samples, uint16_t count)
+{
+    const uint16_t mask = (uint16_t)((1UL << NEXUS_RAW_BITS) - 1);
+    for (uint16_t i = 0; i < count; i += NEXUS_RAW_GROUP_SAMPLES)
+    {
+        uint64_t group = 0;
+        for (uint8_t lane = 0; lane < NEXUS_RAW_GROUP_SAMPLES && i + lane < count; lane++)
+        {
+            const uint32_t sample = samples[i + lane] >> NEXUS_RAW_SHIFT;
+            group |= (uint64_t)(sample > mask ? mask : sample) << (lane * NEXUS_RAW_BITS);
+        }
+        for (uint8_t j = 0; j < NEXUS_RAW_GROUP_SIZE; j++)
+        {
+            *buf++ = (uint8_t)(group >> (j * 8));
+        }
+    }
+}
+
+static uint64_t nexus_raw_load_group(const uint8_t *buf)
+{
+    uint64_t group = 0;
+    for (uint8_t j = 0; j < NEXUS_RAW_GROUP_SIZE; j++)
+    {
+        group |= (uint64_t)buf[j] << (j * 8);
+    }
+    return group;
+}
+
+// Each group is loaded into one word and split into all of its lanes at once
+void nexus_unpack_raw(AnalogRawValue *samples, const uint8_t *buf, uint16_t count)
+{
+    const uint16_t mask = (uint16_t)((1UL << NEXUS_RAW_BITS) - 1);
+    for (uint16_t i = 0; i < count; i += NEXUS_RAW_GROUP_SAMPLES)
+    {
+        const uint64_t group = nexus_raw_load_group(buf);
+        const uint16_t lanes = NEXUS_MIN(count - i, NEXUS_RAW_GROUP_SAMPLES);
+        buf += NEXUS_RAW_GROUP_SIZE;
+        for (uint8_t lane = 0; lane < lanes; lane++)
+        {
+            samples[i + lane] = ((group >> (lane * NEXUS_RAW_BITS)) & mask) << NEXUS_RAW_SHIFT;
+        }
+    }
+}
+
+// Checks a raw report from one slave and unpacks its samples, samples past length keep their last value
+bool nexus_decode_raw(uint8_t slave_id, const uint8_t *buf, uint16_t len, AnalogRawValue *samples, uint16_t length)
+{
+    const PacketNexusRaw *packet = (const PacketNexusRaw *)buf;
+    if (slave_id >= NEXUS_SLAVE_NUM || buf == NULL)
+    {
+        return false;
+    }
+    if (len < sizeof(PacketNexusRaw) || !(packet->sequence & NEXUS_SEQUENCE_MARK) || packet->slave_id != slave_id ||
+        len < sizeof(PacketNexusRaw) + NEXUS_RAW_PAYLOAD_SIZE(packet->count))
+    {
+        g_nexus_slave_stats[slave_id].decode_failures++;
+        return false;
+    }
+    nexus_count_report(slave_id);
+    (void)nexus_check_sequence(slave_id, packet->sequence);
+    nexus_unpack_raw(samples, buf + sizeof(PacketNexusRaw), NEXUS_MIN(packet->count, length));
+    return true;
+}
+
 void nexus_process_buffer(uint8_t slave_id, uint8_t *buf, uint16_t len)
 {
 #if NEXUS_IS_SLAVE
@@ -169,7 +456,7 @@ void nexus_process_buffer(uint8_t slave_id, uint8_t *buf, uint16_t len)
     {
         return;
     }
-    slave_flags[slave_id] = true;
+    slave_offline[slave_id] = false;
 
     if (amp_is_frame(buf, len))
     {
@@ -183,56 +470,90 @@ void nexus_process_buffer(uint8_t slave_id, uint8_t *buf, uint16_t len)
         {
             memset(g_nexus_slave_buffer[slave_id] + copy_len, 0, NEXUS_BUFFER_SIZE - copy_len);
         }
+        const AmpFrameHeader *header = (const AmpFrameHeader *)g_nexus_slave_buffer[slave_id];
+        if (amp_frame_flags(header) & AMP_FRAME_FLAG_RESP)
+        {
+            nexus_request_complete(slave_id, header->seq);
+        }
         return;
     }
 
     if (!(buf[0] & 0x80))
     {
+        g_nexus_slave_stats[slave_id].decode_failures++;
         return;
     }
 #if NEXUS_USE_RAW
-    uint16_t* raw_values = (uint16_t*)buf;
-    const uint16_t length = nexus_slave_config_length(slave_id);
-    const uint16_t *map = g_nexus_slave_configs[slave_id].map;
-    if (map == NULL || length == 0 || len < sizeof(uint16_t))
-    {
-        return;
-    }
-    nexus_slave_raw_values[map[0]] = (buf[0] & 0x7F) + ((buf[1])<<7);
-    const uint16_t raw_count = len / sizeof(uint16_t);
-    for (uint16_t i = 1; i < length && i < raw_count; i++)
-    {
-        nexus_slave_raw_values[map[i]] = raw_values[i];
-    }
+    // Samples past the configured slice are dropped
+    (void)nexus_decode_raw(slave_id, buf, len, slave_raw_values[slave_id], nexus_slave_config_length(slave_id));
 #else
     PacketNexus* packet = (PacketNexus*)buf;
-    uint16_t index = packet->index & 0x7f;
     const uint16_t length = nexus_slave_config_length(slave_id);
     const uint16_t *map = g_nexus_slave_configs[slave_id].map;
-#if NEXUS_SLICE_LENGTH_MAX >= 128
-    index |= ((uint16_t)(uint8_t)packet->index_high) << 7;
-#endif
-    if (map == NULL || index >= length)
+    if (map == NULL || len < sizeof(PacketNexus))
     {
+        g_nexus_slave_stats[slave_id].decode_failures++;
         return;
     }
+    nexus_count_report(slave_id);
 
-    const size_t copy_len = (length + 7) / 8;
-    const size_t packet_bits_offset = offsetof(PacketNexus, bits);
-    if (len < packet_bits_offset + copy_len)
+    // A lost report leaves the following deltas without their base until the key is refreshed
+    if (!nexus_check_sequence(slave_id, packet->sequence))
     {
-        return;
+        memset(slave_synced[slave_id], 0, sizeof(slave_synced[slave_id]));
     }
+
     memset(slave_bitmap[slave_id], 0, sizeof(slave_bitmap[slave_id]));
-    memcpy(slave_bitmap[slave_id], packet->bits, copy_len);
+    memcpy(slave_bitmap[slave_id], packet->bits, (length + 7) / 8);
 
-    const uint16_t key_index = map[index];
-    if (key_index < ADVANCED_KEY_NUM)
+    const uint8_t *entry = buf + sizeof(PacketNexus);
+    const uint8_t *end = buf + len;
+    for (uint16_t i = 0; i < NEXUS_SLICE_LENGTH_MAX; i++)
     {
-        AdvancedKey *advanced_key = &g_keyboard_advanced_keys[key_index];
-        advanced_key->filtered_raw = packet->raw;
+        if (!BIT_GET(packet->changed[i / 8], i % 8))
+        {
+            continue;
+        }
+        const bool absolute = BIT_GET(packet->absolute[i / 8], i % 8);
+        const uint8_t *next = entry + (absolute ? NEXUS_ABSOLUTE_ENTRY_SIZE : NEXUS_DELTA_ENTRY_SIZE);
+        if (next > end)
+        {
+            // The cut entries were deltas or refreshes this key will never see, so drop their base
+            for (uint16_t j = i; j < NEXUS_SLICE_LENGTH_MAX; j++)
+            {
+                if (BIT_GET(packet->changed[j / 8], j % 8))
+                {
+                    BIT_RESET(slave_synced[slave_id][j / 8], j % 8);
+                }
+            }
+            g_nexus_slave_stats[slave_id].decode_failures++;
+            return;
+        }
+        AdvancedKey *advanced_key = (i < length && map[i] < ADVANCED_KEY_NUM) ? &g_keyboard_advanced_keys[map[i]] : NULL;
+        if (absolute)
+        {
+            slave_values[slave_id][i] = nexus_read_value(entry);
+            BIT_SET(slave_synced[slave_id][i / 8], i % 8);
+            if (advanced_key)
+            {
+                advanced_key->filtered_raw = entry[NEXUS_VALUE_SIZE] | (entry[NEXUS_VALUE_SIZE + 1] << 8);
+            }
+        }
+        else if (BIT_GET(slave_synced[slave_id][i / 8], i % 8))
+        {
+            slave_values[slave_id][i] += nexus_read_delta(entry);
+        }
+        else
+        {
+            entry = next;
+            continue;
+        }
+        entry = next;
 #if NEXUS_VALUE_MAX != 0
-        advanced_key->value = packet->value * (1/65536.f) * ANALOG_VALUE_RANGE;
+        if (advanced_key)
+        {
+            advanced_key->value = (uint32_t)slave_values[slave_id][i] * ANALOG_VALUE_RANGE / NEXUS_VALUE_MAX + ANALOG_VALUE_MIN;
+        }
 #endif
     }
 #endif
@@ -242,119 +563,140 @@ void nexus_process_buffer(uint8_t slave_id, uint8_t *buf, uint16_t len)
 int nexus_send_report(void)
 {
 #if NEXUS_USE_RAW
-    static uint8_t buffer[NEXUS_SLICE_LENGTH_MAX*sizeof(uint16_t)];
-    uint16_t* raw_buffer = (uint16_t*)buffer;
+    static uint8_t sequence;
+    static uint8_t buffer[sizeof(PacketNexusRaw) + NEXUS_RAW_PAYLOAD_SIZE(NEXUS_LOCAL_ADVANCED_KEY_COUNT)];
+    AnalogRawValue samples[NEXUS_LOCAL_ADVANCED_KEY_COUNT > 0 ? NEXUS_LOCAL_ADVANCED_KEY_COUNT : 1];
     if (NEXUS_LOCAL_ADVANCED_KEY_COUNT == 0)
     {
         return 0;
     }
-    uint16_t raw1 = advanced_key_read_raw(&g_keyboard_advanced_keys[0]);
-    buffer[0] = raw1 & 0x7F;
-    buffer[0] |= 0x80;
-    buffer[1] = raw1 >> 7;
-    for (uint16_t i = 1; i < NEXUS_LOCAL_ADVANCED_KEY_COUNT; i++)
+    PacketNexusRaw *packet = (PacketNexusRaw *)buffer;
+    packet->sequence = NEXUS_SEQUENCE_MARK | (sequence & NEXUS_SEQUENCE_MASK);
+    packet->slave_id = NEXUS_SLAVE_ID;
+    packet->count = NEXUS_LOCAL_ADVANCED_KEY_COUNT;
+    for (uint16_t i = 0; i < NEXUS_LOCAL_ADVANCED_KEY_COUNT; i++)
+    {
+        // The scan of this tick already stored the reading
+        samples[i] = g_keyboard_advanced_keys[i].raw;
+    }
+    nexus_pack_raw(buffer + sizeof(PacketNexusRaw), samples, NEXUS_LOCAL_ADVANCED_KEY_COUNT);
+    int ret = nexus_report(buffer, sizeof(buffer));
+    if (ret == 0)
     {
-        AdvancedKey* advanced_key = &g_keyboard_advanced_keys[i];
-        raw_buffer[i] = advanced_key_read_raw(advanced_key);
+        sequence++;
     }
-    return nexus_report(buffer, sizeof(buffer));
+    return ret;
 #else
-    static uint16_t counter;
-    static uint8_t buffer[sizeof(PacketNexus)];
+    static uint16_t cursor;
+    static uint8_t sequence;
+    static uint32_t last_report_tick;
+    static uint32_t last_motion_tick;
+    static uint8_t last_bits[NEXUS_BITMAP_SIZE];
+    static uint16_t sent_values[NEXUS_LOCAL_KEY_COUNT > 0 ? NEXUS_LOCAL_KEY_COUNT : 1];
+    static uint8_t buffer[NEXUS_REPORT_SIZE];
+    uint16_t values[NEXUS_LOCAL_KEY_COUNT > 0 ? NEXUS_LOCAL_KEY_COUNT : 1];
 
     if (NEXUS_LOCAL_KEY_COUNT == 0)
     {
         return 0;
     }
-    if (counter >= NEXUS_LOCAL_KEY_COUNT)
-    {
-        counter = 0;
-    }
 
-    // No value field
+    memset(buffer, 0, sizeof(buffer));
     PacketNexus* packet = (PacketNexus*)buffer;
-    packet->index = counter & 0x7F;
-    packet->index |= 0x80;
-#if NEXUS_SLICE_LENGTH_MAX >= 128
-    packet->index_high = (counter >> 7) & 0xFF;
-#endif
-    Key* key = keyboard_get_key(counter);
-    packet->raw = keyboard_get_key_raw_value(key);
-#if NEXUS_VALUE_MAX != 0
-    packet->value = (keyboard_get_key_analog_value(key)*NEXUS_VALUE_MAX/ANALOG_VALUE_RANGE);
-#endif
-    memset(packet->bits, 0, sizeof(packet->bits));
+    packet->sequence = NEXUS_SEQUENCE_MARK | (sequence & NEXUS_SEQUENCE_MASK);
     memcpy(packet->bits, (const void*)g_keyboard_bitmap, NEXUS_LOCAL_BITMAP_SIZE);
-    nexus_report(buffer, sizeof(PacketNexus));
-    counter++;
-    if (counter >= NEXUS_LOCAL_KEY_COUNT)
+
+    // The key under the cursor is always refreshed in full, changed keys follow in round robin
+    // order as long as they fit, and the first one left out is refreshed by the next report
+    uint16_t size = sizeof(PacketNexus);
+    uint16_t next_cursor = (cursor + 1) % NEXUS_LOCAL_KEY_COUNT;
+    bool starved = false;
+    bool moving = false;
+    for (uint16_t n = 0; n < NEXUS_LOCAL_KEY_COUNT; n++)
     {
-        counter = 0;
-    }
-    return 0;
+        const uint16_t i = (cursor + n) % NEXUS_LOCAL_KEY_COUNT;
+#if NEXUS_VALUE_MAX != 0
+        values[i] = (uint32_t)(keyboard_get_key_analog_value(keyboard_get_key(i)) - ANALOG_VALUE_MIN) * NEXUS_VALUE_MAX / ANALOG_VALUE_RANGE;
+#else
+        values[i] = 0;
 #endif
-}
+        const int32_t delta = (int32_t)values[i] - sent_values[i];
+        if (delta)
+        {
+            moving = true;
+        }
+        if (n && !delta)
+        {
+            continue;
+        }
+        const bool absolute = !n || delta > NEXUS_DELTA_MAX || delta < -NEXUS_DELTA_MAX - 1;
+        const uint16_t entry_size = absolute ? NEXUS_ABSOLUTE_ENTRY_SIZE : NEXUS_DELTA_ENTRY_SIZE;
+        if (size + entry_size > NEXUS_REPORT_SIZE)
+        {
+            if (!starved)
+            {
+                next_cursor = i;
+                starved = true;
+            }
+            continue;
+        }
+        size += entry_size;
+        BIT_SET(packet->changed[i / 8], i % 8);
+        if (absolute)
+        {
+            BIT_SET(packet->absolute[i / 8], i % 8);
+        }
+    }
 
-int nexus_request_timeout(uint8_t slave_id, const uint8_t *report, uint16_t len, uint32_t timeout, AmpFrame *out_response)
-{
-    static uint8_t sequence;
-    uint8_t frame_report[AMP_FRAME_REPORT_SIZE];
-    uint8_t seq = ++sequence;
-    if (seq == 0)
+    // Reports slow down to NEXUS_IDLE_INTERVAL once nothing has moved for NEXUS_IDLE_TIMEOUT,
+    // the first change goes out right away
+    if (moving || starved || memcmp(last_bits, packet->bits, sizeof(last_bits)))
     {
-        seq = ++sequence;
+        last_motion_tick = g_keyboard_tick;
     }
-    if (slave_id >= NEXUS_SLAVE_NUM || report == NULL || len < 2 || len - 2 > AMP_FRAME_MAX_PAYLOAD ||
-        amp_frame_encode(frame_report, AMP_CHANNEL_NEXUS_CTRL, AMP_FRAME_FLAG_REQ_ACK, seq,
-                         report[0], report[1], report + 2, (uint8_t)(len - 2)) != 0)
+    else if (g_keyboard_tick - last_motion_tick >= NEXUS_IDLE_TIMEOUT &&
+             g_keyboard_tick - last_report_tick < NEXUS_IDLE_INTERVAL)
     {
-        return 1;
+        return 0;
     }
 
-    const uint32_t start = g_keyboard_tick;
-    uint32_t retry_count = 0;
-    uint16_t count = 0;
-    retry:
-    while (start + timeout > g_keyboard_tick)
+    uint8_t *entry = buffer + sizeof(PacketNexus);
+    for (uint16_t i = 0; i < NEXUS_LOCAL_KEY_COUNT; i++)
     {
-        if (nexus_send(slave_id, frame_report, AMP_FRAME_REPORT_SIZE) == 0)
+        if (!BIT_GET(packet->changed[i / 8], i % 8))
         {
-            break;
+            continue;
         }
-    }
-    while (start + timeout > g_keyboard_tick)
-    {
-        AmpFrameHeader *header = (AmpFrameHeader *)g_nexus_slave_buffer[slave_id];
-        if (header->proto == AMP_FRAME_PROTO &&
-            header->seq == seq &&
-            (amp_frame_flags(header) & AMP_FRAME_FLAG_RESP))
+        if (BIT_GET(packet->absolute[i / 8], i % 8))
         {
-            int rc = 0;
-            if (out_response != NULL && !amp_frame_decode(g_nexus_slave_buffer[slave_id], NEXUS_BUFFER_SIZE, out_response))
-            {
-                rc = 1;
-            }
-            memset(g_nexus_slave_buffer[slave_id], 0, NEXUS_BUFFER_SIZE);
-            slave_flags[slave_id] = false;
-            return rc;
+            const uint16_t raw = keyboard_get_key_raw_value(keyboard_get_key(i));
+            entry = nexus_write_value(entry, values[i]);
+            *entry++ = raw & 0xFF;
+            *entry++ = raw >> 8;
         }
-        count++;
-        if (count > 10000)
+        else
         {
-            //printf("retry_count%d\n",retry_count);
-            count = 0;
-            retry_count++;
-            if (retry_count > NEXUS_RETRY_COUNT)
-            {
-                break;
-            }
-            goto retry;
+            entry = nexus_write_value(entry, values[i] - sent_values[i]);
         }
     }
-    return 1;
-}
 
-int nexus_send_timeout(uint8_t slave_id, const uint8_t *report, uint16_t len, uint32_t timeout)
-{
-    return nexus_request_timeout(slave_id, report, len, timeout, NULL);
+    // Nothing is committed until the report is out, so the master never misses a delta base
+    int ret = nexus_report(buffer, size);
+    if (ret)
+    {
+        return ret;
+    }
+    for (uint16_t i = 0; i < NEXUS_LOCAL_KEY_COUNT; i++)
+    {
+        if (BIT_GET(packet->changed[i / 8], i % 8))
+        {
+            sent_values[i] = values[i];
+        }
+    }
+    sequence++;
+    cursor = next_cursor;
+    last_report_tick = g_keyboard_tick;
+    memcpy(last_bits, packet->bits, sizeof(last_bits));
+    return 0;
+#endif
 }
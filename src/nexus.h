@@ -33,38 +33,126 @@ extern "C" {
 #define NEXUS_RETRY_COUNT 100
 #endif
 
-typedef struct __PacketNexus
-{
-  int8_t index;
-#if NEXUS_SLICE_LENGTH_MAX >= 128
-  int8_t index_high;
+// Configuration frames awaiting a response from one slave
+#ifndef NEXUS_PIPELINE_DEPTH
+#define NEXUS_PIPELINE_DEPTH 4
+#endif
+
+// Ticks before an unanswered configuration frame is sent again
+#ifndef NEXUS_REQUEST_TIMEOUT
+#define NEXUS_REQUEST_TIMEOUT KEYBOARD_TIME_TO_TICK(20)
+#endif
+
+// Id a slave puts in its raw reports
+#ifndef NEXUS_SLAVE_ID
+#define NEXUS_SLAVE_ID 0
+#endif
+
+// Width of one packed raw sample, samples are shifted right by NEXUS_RAW_SHIFT to fit.
+// 16 keeps every reading, 12 or 10 are opt-in for boards whose ADC is that narrow
+#ifndef NEXUS_RAW_BITS
+#define NEXUS_RAW_BITS 16
+#endif
+
+#ifndef NEXUS_RAW_SHIFT
+#define NEXUS_RAW_SHIFT 0
+#endif
+
+#if NEXUS_RAW_BITS == 16
+#define NEXUS_RAW_GROUP_SAMPLES 1
+#elif NEXUS_RAW_BITS == 12
+#define NEXUS_RAW_GROUP_SAMPLES 2
+#elif NEXUS_RAW_BITS == 10
+#define NEXUS_RAW_GROUP_SAMPLES 4
+#else
+#error "NEXUS_RAW_BITS must be 10, 12 or 16"
+#endif
+// Samples are packed little endian in groups that end on a byte boundary
+#define NEXUS_RAW_GROUP_SIZE (NEXUS_RAW_GROUP_SAMPLES * NEXUS_RAW_BITS / 8)
+#define NEXUS_RAW_PAYLOAD_SIZE(count) (((count) + NEXUS_RAW_GROUP_SAMPLES - 1) / NEXUS_RAW_GROUP_SAMPLES * NEXUS_RAW_GROUP_SIZE)
+
+// Ticks between slave reports while no key moves, 1 keeps the full polling rate
+#ifndef NEXUS_IDLE_INTERVAL
+#define NEXUS_IDLE_INTERVAL KEYBOARD_TIME_TO_TICK(10)
+#endif
+
+// Ticks without movement before a slave drops to NEXUS_IDLE_INTERVAL
+#ifndef NEXUS_IDLE_TIMEOUT
+#define NEXUS_IDLE_TIMEOUT KEYBOARD_TIME_TO_TICK(100)
 #endif
+
 #if NEXUS_VALUE_MAX == 0
-  // No value field
+#define NEXUS_VALUE_SIZE 0
 #elif NEXUS_VALUE_MAX < 256
-  uint8_t value;
+#define NEXUS_VALUE_SIZE 1
+#else
+#define NEXUS_VALUE_SIZE 2
+#endif
+
+#define NEXUS_BITMAP_SIZE ((NEXUS_SLICE_LENGTH_MAX + 7) / 8)
+// A full entry carries the value and the raw reading, a delta entry a signed value difference
+#define NEXUS_ABSOLUTE_ENTRY_SIZE (NEXUS_VALUE_SIZE + sizeof(uint16_t))
+#define NEXUS_DELTA_ENTRY_SIZE NEXUS_VALUE_SIZE
+// The sequence and the three bitmaps of PacketNexus, then room for at least one full entry
+#define NEXUS_REPORT_MIN_SIZE (1 + 3 * NEXUS_BITMAP_SIZE + NEXUS_VALUE_SIZE + 2)
+
+// Bytes available to one key report on the link, grows with NEXUS_SLICE_LENGTH_MAX when 32 cannot hold a full entry
+#ifndef NEXUS_REPORT_SIZE
+#if NEXUS_REPORT_MIN_SIZE > 32
+#define NEXUS_REPORT_SIZE NEXUS_REPORT_MIN_SIZE
 #else
-  uint16_t value;
+#define NEXUS_REPORT_SIZE 32
+#endif
+#endif
+
+#if NEXUS_REPORT_SIZE < NEXUS_REPORT_MIN_SIZE
+#error "NEXUS_REPORT_SIZE must hold the PacketNexus header and one full entry"
 #endif
-  uint16_t raw;
-  uint8_t bits[(NEXUS_SLICE_LENGTH_MAX + 7) / 8];
+
+// Followed by one entry per changed key in ascending key order
+typedef struct __PacketNexus
+{
+  uint8_t sequence;
+  uint8_t bits[NEXUS_BITMAP_SIZE];
+  uint8_t changed[NEXUS_BITMAP_SIZE];
+  uint8_t absolute[NEXUS_BITMAP_SIZE];
 } __PACKED PacketNexus;
 
+// Followed by NEXUS_RAW_PAYLOAD_SIZE(count) bytes of packed samples in local key order
+typedef struct __PacketNexusRaw
+{
+  uint8_t sequence;
+  uint8_t slave_id;
+  uint8_t count;
+} __PACKED PacketNexusRaw;
+
 typedef struct __NexusSlaveConfig
 {
     uint16_t length;
     const uint16_t *map;
 } NexusSlaveConfig;
 
+typedef struct __NexusSlaveStats
+{
+    uint32_t frames;
+    uint32_t decode_failures;
+    uint32_t lost_frames;
+    uint32_t max_gap;
+    uint32_t last_seen_tick;
+} NexusSlaveStats;
+
 extern uint8_t g_nexus_slave_buffer[NEXUS_SLAVE_NUM][NEXUS_BUFFER_SIZE];
+extern NexusSlaveStats g_nexus_slave_stats[NEXUS_SLAVE_NUM];
 
 void nexus_init(void);
 void nexus_process(void);
 void nexus_process_buffer(uint8_t slave_id, uint8_t *buf, uint16_t len);
+void nexus_reset_stats(uint8_t slave_id);
+void nexus_pack_raw(uint8_t *buf, const AnalogRawValue *samples, uint16_t count);
+void nexus_unpack_raw(AnalogRawValue *samples, const uint8_t *buf, uint16_t count);
+bool nexus_decode_raw(uint8_t slave_id, const uint8_t *buf, uint16_t len, AnalogRawValue *samples, uint16_t length);
 int nexus_sync_advanced_key_config(uint16_t key_index);
 int  nexus_send_report(void);
-int nexus_send_timeout(uint8_t slave_id, const uint8_t *report, uint16_t len, uint32_t timeout);
-int nexus_request_timeout(uint8_t slave_id, const uint8_t *report, uint16_t len, uint32_t timeout, AmpFrame *out_response);
 
 #ifdef __cplusplus
 }
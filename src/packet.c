@@ -16,6 +16,9 @@
 #ifdef MACRO_ENABLE
 #include "macro.h"
 #endif
+#ifdef SCRIPT_ENABLE
+#include "script.h"
+#endif
 
 #define PACKET_DEBUG_MAX_KEYS 5
 
@@ -266,6 +269,16 @@ void packet_process_buffer(uint8_t *buf, uint16_t len)
         case PACKET_DATA_FEATURE:
             packet_process_feature(packet);
             break;
+#ifdef SCRIPT_ENABLE
+        case PACKET_DATA_SCRIPT_HEAP:
+            packet_process_script_heap(packet);
+            break;
+#endif
+#if defined(NEXUS_ENABLE) && !NEXUS_IS_SLAVE
+        case PACKET_DATA_NEXUS_STATS:
+            packet_process_nexus_stats(packet);
+            break;
+#endif
         case PACKET_DATA_VERSION:
             if (packet->code == PACKET_CODE_GET)
             {
@@ -488,6 +501,9 @@ void packet_process_keymap(PacketData*data)
                 g_keymap_cache[packet->start + i] = layer_get_keycode(packet->start + i, g_current_layer); 
             }
         }
+#ifdef DYNAMICKEY_ENABLE
+        dynamic_key_update_index();
+#endif
     }
     else if (data->code == PACKET_CODE_GET)
     {
@@ -506,6 +522,7 @@ void packet_process_dynamic_key(PacketData*data)
         if (packet->index<DYNAMIC_KEY_NUM)
         {
             memcpy(&g_dynamic_keys[packet->index], &packet->dynamic_key, sizeof(DynamicKey));
+            dynamic_key_update_index();
         }
     }
     else if (data->code == PACKET_CODE_GET)
@@ -609,23 +626,21 @@ void packet_process_macro(PacketData*data)
     {
         return;
     }
+    Macro *macro = &g_macros[packet->macro_index];
+    MacroAction action;
     if (data->code == PACKET_CODE_SET)
     {
+        // Actions past the end of a macro are appended, so hosts upload new macros in order
         for (uint8_t i = 0; i < packet->length; i++)
         {
-            uint16_t index = packet->data[i].index;
-            if (index < MACRO_MAX_ACTIONS)
+            action.delay = packet->data[i].delay;
+            action.event.event = packet->data[i].event;
+            action.event.is_virtual = packet->data[i].is_virtual;
+            action.event.keycode = packet->data[i].keycode;
+            action.event.key = keyboard_get_key(packet->data[i].key_id);
+            if (!macro_set_action(macro, packet->data[i].index, &action))
             {
-                MacroAction *action = &g_macros[packet->macro_index].actions[index];
-                action->delay = packet->data[i].delay;
-                action->event.event = packet->data[i].event;
-                action->event.is_virtual = packet->data[i].is_virtual;
-                action->event.keycode = packet->data[i].keycode;
-                void * key = keyboard_get_key(packet->data[i].key_id);
-                if (key != NULL)
-                {
-                    action->event.key = key;
-                }
+                break;
             }
         }
     }
@@ -633,17 +648,15 @@ void packet_process_macro(PacketData*data)
     {
         for (uint8_t i = 0; i < packet->length; i++)
         {
-            uint8_t index = packet->data[i].index;
-            if (index < MACRO_MAX_ACTIONS)
+            if (macro_get_action(macro, packet->data[i].index, &action))
             {
-                MacroAction *action = &g_macros[packet->macro_index].actions[index];
-                packet->data[i].delay = action->delay;
-                packet->data[i].event = action->event.event;
-                packet->data[i].is_virtual = action->event.is_virtual;
-                packet->data[i].keycode = action->event.keycode;
-                if (action->event.key != NULL)
+                packet->data[i].delay = action.delay;
+                packet->data[i].event = action.event.event;
+                packet->data[i].is_virtual = action.event.is_virtual;
+                packet->data[i].keycode = action.event.keycode;
+                if (action.event.key != NULL)
                 {
-                    packet->data[i].key_id = ((Key*)action->event.key)->id;
+                    packet->data[i].key_id = ((Key*)action.event.key)->id;
                 }
             }
         }
@@ -661,6 +674,63 @@ void packet_process_feature(PacketData *data)
     }
 }
 
+void packet_process_script_heap(PacketData *data)
+{
+#ifdef SCRIPT_ENABLE
+    PacketScriptHeap *packet = (PacketScriptHeap *)data;
+    ScriptHeapStats *stats = &g_script_heap_stats;
+    if (data->code == PACKET_CODE_SET)
+    {
+        stats->gc_interval = packet->gc_interval;
+        stats->gc_threshold = packet->gc_threshold > 100 ? 100 : packet->gc_threshold;
+    }
+    else if (data->code == PACKET_CODE_GET)
+    {
+        script_update_heap_stats();
+        packet->pool_size = stats->pool_size;
+        packet->live_bytes = stats->live_bytes;
+        packet->high_water = stats->high_water;
+        packet->gc_count = stats->gc_count;
+        packet->gc_last_pause_us = stats->gc_last_pause_us;
+        packet->gc_max_pause_us = stats->gc_max_pause_us;
+        packet->invocation_count = g_script_runtime_stats.invocation_count;
+        packet->overrun_count = g_script_runtime_stats.overrun_count;
+        packet->gc_interval = stats->gc_interval;
+        packet->gc_threshold = stats->gc_threshold;
+    }
+#else
+    UNUSED(data);
+#endif
+}
+
+void packet_process_nexus_stats(PacketData *data)
+{
+#if defined(NEXUS_ENABLE) && !NEXUS_IS_SLAVE
+    PacketNexusStats *packet = (PacketNexusStats *)data;
+    if (packet->slave_id >= NEXUS_SLAVE_NUM)
+    {
+        return;
+    }
+    // Writing clears the counters of the slave
+    if (data->code == PACKET_CODE_SET)
+    {
+        nexus_reset_stats(packet->slave_id);
+    }
+    else if (data->code == PACKET_CODE_GET)
+    {
+        const NexusSlaveStats *stats = &g_nexus_slave_stats[packet->slave_id];
+        packet->tick = g_keyboard_tick;
+        packet->frames = stats->frames;
+        packet->decode_failures = stats->decode_failures;
+        packet->lost_frames = stats->lost_frames;
+        packet->max_gap = stats->max_gap;
+        packet->last_seen_tick = stats->last_seen_tick;
+    }
+#else
+    UNUSED(data);
+#endif
+}
+
 static int packet_send_version_packet_now(void)
 {
     uint8_t buf[64] = {0};
@@ -39,6 +39,8 @@ enum {
   PACKET_DATA_FEATURE = 0x0B,
   PACKET_DATA_SCRIPT_SCOURCE = 0x0C,
   PACKET_DATA_SCRIPT_BYTECODE = 0x0D,
+  PACKET_DATA_SCRIPT_HEAP = 0x0E,
+  PACKET_DATA_NEXUS_STATS = 0x0F,
 };
 
 typedef struct __PacketBase
@@ -219,6 +221,35 @@ typedef struct __PacketFeature
   uint8_t script_support;
 } __PACKED PacketFeature;
 
+typedef struct __PacketScriptHeap
+{
+  uint8_t code;
+  uint8_t type;
+  uint32_t pool_size;
+  uint32_t live_bytes;
+  uint32_t high_water;
+  uint32_t gc_count;
+  uint32_t gc_last_pause_us;
+  uint32_t gc_max_pause_us;
+  uint32_t invocation_count;
+  uint32_t overrun_count;
+  uint16_t gc_interval;
+  uint8_t gc_threshold;
+} __PACKED PacketScriptHeap;
+
+typedef struct __PacketNexusStats
+{
+  uint8_t code;
+  uint8_t type;
+  uint8_t slave_id;
+  uint32_t tick;
+  uint32_t frames;
+  uint32_t decode_failures;
+  uint32_t lost_frames;
+  uint32_t max_gap;
+  uint32_t last_seen_tick;
+} __PACKED PacketNexusStats;
+
 typedef struct __PacketLargeData
 {
     uint8_t code;
@@ -263,6 +294,8 @@ void packet_process_config(PacketData*data);
 void packet_process_debug(PacketData*data);
 void packet_process_macro(PacketData*data);
 void packet_process_feature(PacketData*data);
+void packet_process_script_heap(PacketData*data);
+void packet_process_nexus_stats(PacketData*data);
 
 void packet_send_version_packet(void);
 void packet_process_version_notifications(void);
@@ -8,6 +8,9 @@
 #include "math.h"
 #include "stdlib.h"
 #include "driver.h"
+#ifdef LIGHTING_ENABLE
+#include "lamp_array.h"
+#endif
 
 #define rgb_loop_queue_foreach(q, type, item) for (uint16_t __index = (q)->front; __index != (q)->rear; __index = (__index + 1) % (q)->len)\
                                               for (type *item = &((q)->data[__index]); item; item = NULL)
@@ -29,12 +32,98 @@ RGBBaseConfig g_rgb_base_config;
 RGBConfig g_rgb_configs[RGB_NUM];
 ColorRGB g_rgb_colors[RGB_NUM];
 
+typedef enum __RGBRenderStage
+{
+    RGB_RENDER_STAGE_IDLE,
+    RGB_RENDER_STAGE_BASE,
+    RGB_RENDER_STAGE_ARGUMENT,
+    RGB_RENDER_STAGE_KEY,
+    RGB_RENDER_STAGE_FLUSH,
+} RGBRenderStage;
+
+RGBLayer g_rgb_layers[RGB_LAYER_NUM];
+
+RGBScheduler g_rgb_scheduler = {
+    .frame_interval = RGB_FRAME_INTERVAL_TICK,
+    .frame_budget = RGB_FRAME_BUDGET,
+};
+
+static RGBRenderStage rgb_render_stage;
+static uint16_t rgb_render_cursor;
+static int16_t* rgb_render_iterator_ptr;
+static uint32_t rgb_frame_tick;
+static uint16_t rgb_frame_slices;
+
+#if RGB_MODE_USE_BUBBLE
+static RGBNeighbor rgb_bubble_neighbors[RGB_BUBBLE_NEIGHBOR_POOL_SIZE];
+static uint16_t rgb_bubble_neighbor_offsets[RGB_NUM + 1];
+// Keys below this index have their neighbors in the pool
+uint16_t rgb_bubble_indexed_count;
+static void rgb_bubble_index_build(void);
+#endif
+
 static RGBArgumentList rgb_argument_list;
 static RGBArgumentListNode RGB_Argument_List_Buffer[RGB_ARGUMENT_LIST_BUFFER_LENGTH];
 
+#if defined(RGB_LED_16BIT_ENABLE) || defined(RGB_TEMPORAL_DITHER_ENABLE)
+typedef uint16_t RGBGammaValue;
+#define RGB_GAMMA_LUT_MAX 65535
+#else
+typedef uint8_t RGBGammaValue;
+#define RGB_GAMMA_LUT_MAX 255
+#endif
+
+// Brightness and gamma are folded into one table, rebuilt lazily when brightness changes
+static RGBGammaValue rgb_gamma_lut[256];
+static int16_t rgb_gamma_lut_brightness = -1;
+#ifdef RGB_TEMPORAL_DITHER_ENABLE
+static ColorRGB rgb_dither_residues[RGB_NUM];
+#endif
+
+static void rgb_gamma_lut_build(uint8_t brightness)
+{
+    for (uint16_t i = 0; i < 256; i++)
+    {
+#ifdef RGB_GAMMA_ENABLE
+        rgb_gamma_lut[i] = GAMMA_CORRECT(i, 255) * (brightness / 255.0f) * (RGB_GAMMA_LUT_MAX / 255.0f) + 0.5f;
+#elif RGB_GAMMA_LUT_MAX == 255
+        rgb_gamma_lut[i] = (i * brightness) >> 8;
+#else
+        rgb_gamma_lut[i] = (uint32_t)i * brightness * 257 / 255;
+#endif
+    }
+    rgb_gamma_lut_brightness = brightness;
+}
+
+#ifdef RGB_TEMPORAL_DITHER_ENABLE
+static inline uint8_t rgb_dither(uint8_t *residue, uint16_t value)
+{
+    uint32_t sum = (uint32_t)value + *residue;
+    if (sum > 0xFFFF)
+    {
+        sum = 0xFFFF;
+    }
+    *residue = sum & 0xFF;
+    return sum >> 8;
+}
+#endif
+
 void rgb_init(void)
 {
     rgb_forward_list_init(&rgb_argument_list, RGB_Argument_List_Buffer, RGB_ARGUMENT_LIST_BUFFER_LENGTH);
+    rgb_gamma_lut_brightness = -1;
+    rgb_render_stage = RGB_RENDER_STAGE_IDLE;
+    memset(&g_rgb_scheduler, 0, sizeof(g_rgb_scheduler));
+    g_rgb_scheduler.frame_interval = RGB_FRAME_INTERVAL_TICK;
+    g_rgb_scheduler.frame_budget = RGB_FRAME_BUDGET;
+#if RGB_MODE_USE_BUBBLE
+    rgb_bubble_index_build();
+#endif
+    for (uint8_t i = 0; i < RGB_LAYER_NUM; i++)
+    {
+        rgb_layer_clear(i);
+        rgb_layer_set_blend(i, RGB_BLEND_MODE_ALPHA, 255);
+    }
 #ifndef RGB_CUSTOM_INVERSE_MAPPING
     for (int i = 0; i < RGB_NUM; i++)
     {
@@ -48,218 +137,312 @@ void rgb_init(void)
 
 #define COLOR_INTERVAL(key, low, up) (uint8_t)((key) < 0 ? (low) : ((key) > ANALOG_VALUE_MAX ? (up) : (key) * (up)))
 #define CALC_SPAN(tick, speed) ((KEYBOARD_TICK_TO_TIME(tick)) * (speed))
-void rgb_process(void)
+
+#if RGB_BASE_MODE_USE_RAINBOW || RGB_BASE_MODE_USE_WAVE
+static float rgb_base_direction_sin;
+static float rgb_base_direction_cos;
+static float rgb_base_time_offset;
+#endif
+#if RGB_BASE_MODE_USE_RAINBOW
+#define RGB_RAINBOW_BATCH_SIZE 16
+static ColorHSV16 rgb_base_hsv;
+static int32_t rgb_base_direction_sin_q15;
+static int32_t rgb_base_direction_cos_q15;
+#endif
+
+static void rgb_render_base_begin(void)
 {
-    if (!g_rgb_base_config.mode 
-#ifdef SUSPEND_ENABLE
-        || g_keyboard_is_suspend
+#if RGB_BASE_MODE_USE_RAINBOW || RGB_BASE_MODE_USE_WAVE
+    float direction_c = g_rgb_base_config.direction * M_PI / 180;
+    rgb_base_direction_sin = sinf(direction_c);
+    rgb_base_direction_cos = cosf(direction_c);
+
+    int64_t total_offset = (int64_t)KEYBOARD_TICK_TO_TIME(rgb_frame_tick) * g_rgb_base_config.speed;
+    int32_t wrapped_offset = total_offset % 360000;
+    if (wrapped_offset < 0) wrapped_offset += 360000;
+    rgb_base_time_offset = wrapped_offset / 1000.0f;
 #endif
-    )
+#if RGB_BASE_MODE_USE_RAINBOW
+    if (g_rgb_base_config.mode == RGB_BASE_MODE_RAINBOW)
     {
-        rgb_turn_off();
-        return;
+        ColorHSV temp_hsv;
+        rgb_to_hsv(&temp_hsv, &g_rgb_base_config.rgb);
+        hsv_to_hsv16(&rgb_base_hsv, &temp_hsv);
+        rgb_base_hsv.h = COLOR_HUE16_FROM_DEGREE(g_rgb_base_config.hsv.h % 360) +
+            (uint16_t)(((uint64_t)wrapped_offset << 16) / 360000);
+        rgb_base_direction_sin_q15 = (int32_t)lroundf(rgb_base_direction_sin * 32768.0f);
+        rgb_base_direction_cos_q15 = (int32_t)lroundf(rgb_base_direction_cos * 32768.0f);
     }
-    if (g_rgb_hid_mode)
-    {
-        led_flush();
-        return;
-    }
-    ColorHSV temp_hsv;
+#endif
+}
+
+static void rgb_render_base(uint16_t begin, uint16_t end)
+{
     ColorRGB temp_rgb;
-    float intensity;
-    UNUSED(temp_hsv);
-    memset(g_rgb_colors, 0, sizeof(g_rgb_colors));
-    
+    UNUSED(temp_rgb);
     switch (g_rgb_base_config.mode)
     {
 #if RGB_BASE_MODE_USE_RAINBOW
     case RGB_BASE_MODE_RAINBOW:
+    {
+        ColorHSV16 hsv_batch[RGB_RAINBOW_BATCH_SIZE];
+        ColorRGB rgb_batch[RGB_RAINBOW_BATCH_SIZE];
+        for (uint16_t i = begin; i < end; i += RGB_RAINBOW_BATCH_SIZE)
         {
-            rgb_to_hsv(&temp_hsv, &g_rgb_base_config.rgb);
-            float direction_c = g_rgb_base_config.direction * M_PI / 180;
-            float direction_sin = sinf(direction_c);
-            float direction_cos = cosf(direction_c);
-
-            int64_t total_offset = (int64_t)KEYBOARD_TICK_TO_TIME(g_keyboard_tick) * g_rgb_base_config.speed;
-            int32_t wrapped_offset = total_offset % 360000;
-            if (wrapped_offset < 0) wrapped_offset += 360000;
-            float safe_time_offset = wrapped_offset / 1000.0f;
-            for (uint8_t i = 0; i < RGB_NUM; i++)
+            uint16_t count = end - i < RGB_RAINBOW_BATCH_SIZE ? end - i : RGB_RAINBOW_BATCH_SIZE;
+            for (uint16_t j = 0; j < count; j++)
+            {
+                const RGBLocation* location = &g_rgb_locations[i + j];
+                // Projected distance in um scaled by 2^15, converted straight to a 16-bit hue offset
+                int64_t vertical_distance = (int64_t)location->x * rgb_base_direction_cos_q15 +
+                    (int64_t)location->y * rgb_base_direction_sin_q15;
+                hsv_batch[j] = rgb_base_hsv;
+                hsv_batch[j].h += (uint16_t)(vertical_distance * g_rgb_base_config.density * 2 / (360LL * KEY_SWITCH_DISTANCE));
+            }
+            hsv16_to_rgb_array(rgb_batch, hsv_batch, count);
+            for (uint16_t j = 0; j < count; j++)
             {
-                const RGBLocation* location = &g_rgb_locations[i];
-                float vertical_distance = (location->x * direction_cos + location->y * direction_sin)/(float)KEY_SWITCH_DISTANCE;
-                temp_hsv.h = ((uint32_t)(g_rgb_base_config.hsv.h + vertical_distance * g_rgb_base_config.density + safe_time_offset)) % 360;
-                color_set_hsv(&temp_rgb, &temp_hsv);
-                color_mix(&g_rgb_colors[i], &temp_rgb);
+                color_mix(&g_rgb_colors[i + j], &rgb_batch[j]);
             }
         }
         break;
+    }
 #endif
 #if RGB_BASE_MODE_USE_WAVE
     case RGB_BASE_MODE_WAVE:
+        for (uint16_t i = begin; i < end; i++)
         {
-            float direction_c = g_rgb_base_config.direction * M_PI / 180;
-            float direction_sin = sinf(direction_c);
-            float direction_cos = cosf(direction_c);
-
-            int64_t total_offset = (int64_t)KEYBOARD_TICK_TO_TIME(g_keyboard_tick) * g_rgb_base_config.speed;
-            int32_t wrapped_offset = total_offset % 360000;
-            if (wrapped_offset < 0) wrapped_offset += 360000;
-            float safe_time_offset = wrapped_offset / 1000.0f;
-
-            for (uint8_t i = 0; i < RGB_NUM; i++)
+            const RGBLocation* location = &g_rgb_locations[i];
+            float vertical_distance = (location->x * rgb_base_direction_cos + location->y * rgb_base_direction_sin)/(float)KEY_SWITCH_DISTANCE;
+            float intensity = fmodf(((vertical_distance * g_rgb_base_config.density + rgb_base_time_offset) / 180.0f), 2.0f);
+            intensity -= 1.0f;
+            float secondary_intensity;
+            if (intensity<0)
             {
-                const RGBLocation* location = &g_rgb_locations[i];
-                float vertical_distance = (location->x * direction_cos + location->y * direction_sin)/(float)KEY_SWITCH_DISTANCE;
-                float intensity = fmodf(((vertical_distance * g_rgb_base_config.density + safe_time_offset) / 180.0f), 2.0f);
-                intensity -= 1.0f;
-                float secondary_intensity;
-                if (intensity<0)
-                {
-                    intensity = -intensity;
-                }
-                secondary_intensity = 1 - intensity;
-                temp_rgb.r = (uint8_t)(intensity * ((float)(g_rgb_base_config.rgb.r)) + secondary_intensity * ((float)(g_rgb_base_config.secondary_rgb.r)));
-                temp_rgb.g = (uint8_t)(intensity * ((float)(g_rgb_base_config.rgb.g)) + secondary_intensity * ((float)(g_rgb_base_config.secondary_rgb.g)));
-                temp_rgb.b = (uint8_t)(intensity * ((float)(g_rgb_base_config.rgb.b)) + secondary_intensity * ((float)(g_rgb_base_config.secondary_rgb.b)));
-                color_mix(&g_rgb_colors[i], &temp_rgb);
+                intensity = -intensity;
             }
+            secondary_intensity = 1 - intensity;
+            temp_rgb.r = (uint8_t)(intensity * ((float)(g_rgb_base_config.rgb.r)) + secondary_intensity * ((float)(g_rgb_base_config.secondary_rgb.r)));
+            temp_rgb.g = (uint8_t)(intensity * ((float)(g_rgb_base_config.rgb.g)) + secondary_intensity * ((float)(g_rgb_base_config.secondary_rgb.g)));
+            temp_rgb.b = (uint8_t)(intensity * ((float)(g_rgb_base_config.rgb.b)) + secondary_intensity * ((float)(g_rgb_base_config.secondary_rgb.b)));
+            color_mix(&g_rgb_colors[i], &temp_rgb);
         }
         break;
 #endif
     default:
+        UNUSED(begin);
+        UNUSED(end);
         break;
     }
+}
 
-    for (int16_t* iterator_ptr = &rgb_argument_list.data[rgb_argument_list.head].next; *iterator_ptr >= 0;)
+static float rgb_ripple_intensity(RGBMode mode, float distance, float span)
+{
+    float intensity;
+    switch (mode)
     {
-        RGBArgumentListNode* node = &(rgb_argument_list.data[*iterator_ptr]);
-        RGBArgument * item = &(node->data);
-        RGBConfig *config = &g_rgb_configs[item->rgb_ptr];
-        RGBLocation *location = (RGBLocation *)&g_rgb_locations[item->rgb_ptr];
-        float distance = CALC_SPAN(g_keyboard_tick - item->begin_tick, config->speed);
-        if (MANHATTAN_DISTANCE_DIRECT(location->x, RGB_LEFT_UM, location->y, RGB_TOP_UM) < distance - FADING_DISTANCE_UM &&
-            MANHATTAN_DISTANCE_DIRECT(location->x, RGB_LEFT_UM, location->y, RGB_BOTTOM_UM) < distance - FADING_DISTANCE_UM &&
-            MANHATTAN_DISTANCE_DIRECT(location->x, RGB_RIGHT_UM, location->y, RGB_TOP_UM) < distance - FADING_DISTANCE_UM &&
-            MANHATTAN_DISTANCE_DIRECT(location->x, RGB_RIGHT_UM, location->y, RGB_BOTTOM_UM) < distance - FADING_DISTANCE_UM)
-        // if (distance > 25)
+#if RGB_MODE_USE_STRING || RGB_MODE_USE_DIAMOND_RIPPLE
+    case RGB_MODE_STRING:
+    case RGB_MODE_DIAMOND_RIPPLE:
+        intensity = (UNIT_TO_UM(1.0) - fabsf(distance - span));
+        intensity = intensity > 0 ? intensity : 0;
+        intensity /= UNIT_TO_UM(1.0);
+        break;
+#endif
+#if RGB_MODE_USE_FADING_STRING || RGB_MODE_USE_FADING_DIAMOND_RIPPLE || RGB_MODE_USE_BUBBLE
+    case RGB_MODE_FADING_STRING:
+    case RGB_MODE_FADING_DIAMOND_RIPPLE:
+    case RGB_MODE_BUBBLE:
+        intensity = (distance - span);
+        if (intensity > 0)
         {
-            int16_t free_node = *iterator_ptr;
-            *iterator_ptr = node->next;
-            node->next = (&rgb_argument_list)->free_node;
-            (&rgb_argument_list)->free_node = free_node;
-            continue;
+            intensity = FADING_DISTANCE_UM - intensity > 0 ? FADING_DISTANCE_UM - intensity : 0;
+            intensity /= FADING_DISTANCE_UM;
         }
-        switch (config->mode)
+        else
         {
-        case RGB_MODE_FIXED:
-            break;
-        case RGB_MODE_STATIC:
-            break;
-        case RGB_MODE_CYCLE:
-            break;
-        case RGB_MODE_LINEAR:
-            break;
-        case RGB_MODE_TRIGGER:
-            break;
-        case RGB_MODE_STRING:
-        case RGB_MODE_FADING_STRING:
-        case RGB_MODE_DIAMOND_RIPPLE:
-        case RGB_MODE_FADING_DIAMOND_RIPPLE:
-        case RGB_MODE_BUBBLE:
-            for (int8_t j = 0; j < RGB_NUM; j++)
+            intensity = UNIT_TO_UM(1.0) + intensity > 0 ? UNIT_TO_UM(1.0) + intensity : 0;
+            intensity /= UNIT_TO_UM(1.0);
+        }
+        break;
+#endif
+    default:
+        intensity = 0;
+        break;
+    }
+    return intensity;
+}
+
+static inline void rgb_mix_ripple(uint16_t index, const RGBConfig* config, float intensity)
+{
+    ColorRGB temp_rgb;
+    temp_rgb.r = ((uint8_t)(intensity * ((float)(config->rgb.r)))) >> 1;
+    temp_rgb.g = ((uint8_t)(intensity * ((float)(config->rgb.g)))) >> 1;
+    temp_rgb.b = ((uint8_t)(intensity * ((float)(config->rgb.b)))) >> 1;
+    color_mix(&g_rgb_colors[index], &temp_rgb);
+}
+
+#if RGB_MODE_USE_BUBBLE
+static void rgb_bubble_index_build(void)
+{
+    uint16_t count = 0;
+    rgb_bubble_indexed_count = 0;
+    rgb_bubble_neighbor_offsets[0] = 0;
+    for (uint16_t i = 0; i < RGB_NUM; i++)
+    {
+        for (uint16_t j = 0; j < RGB_NUM; j++)
+        {
+            float e_distance = EUCLIDEAN_DISTANCE(&g_rgb_locations[i], &g_rgb_locations[j]);
+            if (e_distance > BUBBLE_DISTANCE_UM)
+            {
+                continue;
+            }
+            if (count >= RGB_BUBBLE_NEIGHBOR_POOL_SIZE)
+            {
+                // Only complete buckets are kept
+                return;
+            }
+            RGBNeighbor neighbor = {(uint16_t)j, (RGBDistance)(((int32_t)e_distance) >> RGB_DISTANCE_SHIFT)};
+            // Keep each bucket sorted by distance from its key
+            uint16_t k = count;
+            while (k > rgb_bubble_neighbor_offsets[i] && rgb_bubble_neighbors[k - 1].distance > neighbor.distance)
+            {
+                rgb_bubble_neighbors[k] = rgb_bubble_neighbors[k - 1];
+                k--;
+            }
+            rgb_bubble_neighbors[k] = neighbor;
+            count++;
+        }
+        rgb_bubble_neighbor_offsets[i + 1] = count;
+        rgb_bubble_indexed_count = i + 1;
+    }
+}
+
+static void rgb_render_bubble(uint16_t index, const RGBConfig* config, float distance, int32_t ring_inner, int32_t ring_outer)
+{
+    const RGBNeighbor* neighbor = &rgb_bubble_neighbors[rgb_bubble_neighbor_offsets[index]];
+    const RGBNeighbor* end = &rgb_bubble_neighbors[rgb_bubble_neighbor_offsets[index + 1]];
+    const RGBDistance inner = ring_inner > 0 ? (RGBDistance)(ring_inner >> RGB_DISTANCE_SHIFT) : 0;
+    const RGBNeighbor* upper = end;
+    while (neighbor < upper)
+    {
+        const RGBNeighbor* middle = neighbor + (upper - neighbor) / 2;
+        if (middle->distance < inner)
+        {
+            neighbor = middle + 1;
+        }
+        else
+        {
+            upper = middle;
+        }
+    }
+    for (; neighbor < end && ((int32_t)neighbor->distance << RGB_DISTANCE_SHIFT) <= ring_outer; neighbor++)
+    {
+        rgb_mix_ripple(neighbor->index, config, 
+            rgb_ripple_intensity(RGB_MODE_BUBBLE, distance, (float)((int32_t)neighbor->distance << RGB_DISTANCE_SHIFT)));
+    }
+}
+#endif
+
+// Returns false once the node has travelled out of the board and was released
+static bool rgb_render_argument(int16_t* iterator_ptr)
+{
+    RGBArgumentListNode* node = &(rgb_argument_list.data[*iterator_ptr]);
+    RGBArgument * item = &(node->data);
+    RGBConfig *config = &g_rgb_configs[item->rgb_ptr];
+    RGBLocation *location = (RGBLocation *)&g_rgb_locations[item->rgb_ptr];
+    float distance = CALC_SPAN(rgb_frame_tick - item->begin_tick, config->speed);
+    if (MANHATTAN_DISTANCE_DIRECT(location->x, RGB_LEFT_UM, location->y, RGB_TOP_UM) < distance - FADING_DISTANCE_UM &&
+        MANHATTAN_DISTANCE_DIRECT(location->x, RGB_LEFT_UM, location->y, RGB_BOTTOM_UM) < distance - FADING_DISTANCE_UM &&
+        MANHATTAN_DISTANCE_DIRECT(location->x, RGB_RIGHT_UM, location->y, RGB_TOP_UM) < distance - FADING_DISTANCE_UM &&
+        MANHATTAN_DISTANCE_DIRECT(location->x, RGB_RIGHT_UM, location->y, RGB_BOTTOM_UM) < distance - FADING_DISTANCE_UM)
+    // if (distance > 25)
+    {
+        int16_t free_node = *iterator_ptr;
+        *iterator_ptr = node->next;
+        node->next = (&rgb_argument_list)->free_node;
+        (&rgb_argument_list)->free_node = free_node;
+        return false;
+    }
+    switch (config->mode)
+    {
+    case RGB_MODE_FIXED:
+        break;
+    case RGB_MODE_STATIC:
+        break;
+    case RGB_MODE_CYCLE:
+        break;
+    case RGB_MODE_LINEAR:
+        break;
+    case RGB_MODE_TRIGGER:
+        break;
+    case RGB_MODE_STRING:
+    case RGB_MODE_FADING_STRING:
+    case RGB_MODE_DIAMOND_RIPPLE:
+    case RGB_MODE_FADING_DIAMOND_RIPPLE:
+    case RGB_MODE_BUBBLE:
+        {
+            // LEDs outside the lit ring [distance - fading, distance + 1U] contribute nothing
+            const int32_t ring_inner = (int32_t)distance - 1 -
+                ((config->mode == RGB_MODE_STRING || config->mode == RGB_MODE_DIAMOND_RIPPLE) ? UNIT_TO_UM(1.0) : FADING_DISTANCE_UM);
+            const int32_t ring_outer = (int32_t)distance + 1 + UNIT_TO_UM(1.0);
+#if RGB_MODE_USE_BUBBLE
+            if (config->mode == RGB_MODE_BUBBLE && item->rgb_ptr < rgb_bubble_indexed_count)
             {
+                rgb_render_bubble(item->rgb_ptr, config, distance, ring_inner, ring_outer);
+                break;
+            }
+#endif
+            for (uint16_t j = 0; j < RGB_NUM; j++)
+            {
+                int32_t span;
                 switch (config->mode)
                 {
-#if RGB_MODE_USE_STRING
                 case RGB_MODE_STRING:
-                    intensity = (UNIT_TO_UM(1.0) - fabsf(distance - abs(location->x - g_rgb_locations[j].x)));
-                    intensity = intensity > 0 ? intensity : 0;
-                    intensity = abs(location->y - g_rgb_locations[j].y) < UNIT_TO_UM(0.5) ? intensity : 0;
-                    intensity /= UNIT_TO_UM(1.0);
-                    break;
-#endif
-#if RGB_MODE_USE_FADING_STRING
                 case RGB_MODE_FADING_STRING:
-                    intensity = (distance - abs(location->x - g_rgb_locations[j].x));
-                    if (intensity > 0)
-                    {
-                        intensity = FADING_DISTANCE_UM - intensity > 0 ? FADING_DISTANCE_UM - intensity : 0;
-                        intensity /= FADING_DISTANCE_UM;
-                    }
-                    else
-                    {
-                        intensity = UNIT_TO_UM(1.0) + intensity > 0 ? UNIT_TO_UM(1.0) + intensity : 0;
-                        intensity /= UNIT_TO_UM(1.0);
-                    }
-                    intensity = abs(location->y - g_rgb_locations[j].y) < UNIT_TO_UM(0.5) ? intensity : 0;
-                    break;
-#endif
-#if RGB_MODE_USE_DIAMOND_RIPPLE
-                case RGB_MODE_DIAMOND_RIPPLE:
-                    intensity = (UNIT_TO_UM(1.0) - fabsf(distance - MANHATTAN_DISTANCE(location, &g_rgb_locations[j])));
-                    intensity = intensity > 0 ? intensity : 0;
-                    intensity /= UNIT_TO_UM(1.0);
-                    break;
-#endif
-#if RGB_MODE_USE_FADING_DIAMOND_RIPPLE
-                case RGB_MODE_FADING_DIAMOND_RIPPLE:
-                    intensity = (distance - MANHATTAN_DISTANCE(location, &g_rgb_locations[j]));
-                    if (intensity > 0)
+                    if (abs(location->y - g_rgb_locations[j].y) >= UNIT_TO_UM(0.5))
                     {
-                        intensity = FADING_DISTANCE_UM - intensity > 0 ? FADING_DISTANCE_UM - intensity : 0;
-                        intensity /= FADING_DISTANCE_UM;
-                        break;
-                    }
-                    else
-                    {
-                        intensity = UNIT_TO_UM(1.0) + intensity > 0 ? UNIT_TO_UM(1.0) + intensity : 0;
-                        intensity /= UNIT_TO_UM(1.0);
+                        continue;
                     }
+                    span = abs(location->x - g_rgb_locations[j].x);
                     break;
-#endif
-#if RGB_MODE_USE_BUBBLE
                 case RGB_MODE_BUBBLE:
                     {
                         float e_distance = EUCLIDEAN_DISTANCE(location, &g_rgb_locations[j]);
                         if (e_distance > BUBBLE_DISTANCE_UM)
                         {
-                            intensity = 0;
                             continue;
                         }
-                        intensity = (distance - e_distance);
-                        if (intensity > 0)
-                        {
-                            intensity = FADING_DISTANCE_UM - intensity > 0 ? FADING_DISTANCE_UM - intensity : 0;
-                            intensity /= FADING_DISTANCE_UM;
-                            break;
-                        }
-                        else
-                        {
-                            intensity = UNIT_TO_UM(1.0) + intensity > 0 ? UNIT_TO_UM(1.0) + intensity : 0;
-                            intensity /= UNIT_TO_UM(1.0);
-                        }
+                        span = (int32_t)e_distance;
                     }
                     break;
-#endif
                 default:
-                    intensity = 0;
+                    span = MANHATTAN_DISTANCE(location, &g_rgb_locations[j]);
                     break;
                 }
-                temp_rgb.r = ((uint8_t)(intensity * ((float)(config->rgb.r)))) >> 1;
-                temp_rgb.g = ((uint8_t)(intensity * ((float)(config->rgb.g)))) >> 1;
-                temp_rgb.b = ((uint8_t)(intensity * ((float)(config->rgb.b)))) >> 1;
-                color_mix(&g_rgb_colors[j], &temp_rgb);
+                if (span < ring_inner || span > ring_outer)
+                {
+                    continue;
+                }
+                rgb_mix_ripple(j, config, rgb_ripple_intensity(config->mode, distance, span));
             }
-            break;
-        case RGB_MODE_JELLY:
-            break;
-        default:
-            break;
         }
-        iterator_ptr = &(&rgb_argument_list)->data[*iterator_ptr].next;
+        break;
+    case RGB_MODE_JELLY:
+        break;
+    default:
+        break;
     }
-    for (uint16_t i = 0; i < RGB_NUM; i++)
+    return true;
+}
+
+static void rgb_render_keys(uint16_t begin, uint16_t end)
+{
+    ColorHSV16 temp_hsv;
+    ColorRGB temp_rgb;
+    float intensity;
+    UNUSED(temp_hsv);
+    for (uint16_t i = begin; i < end; i++)
     {
         bool report_state = false;
         Color* target_color = &g_rgb_colors[i];
@@ -290,9 +473,9 @@ void rgb_process(void)
         case RGB_MODE_TRIGGER:
             if (report_state)
             {
-                rgb_config->begin_tick = g_keyboard_tick;
+                rgb_config->begin_tick = rgb_frame_tick;
             }
-            intensity = powf(0.9999, CALC_SPAN(g_keyboard_tick - rgb_config->begin_tick, rgb_config->speed));
+            intensity = powf(0.9999, CALC_SPAN(rgb_frame_tick - rgb_config->begin_tick, rgb_config->speed));
             temp_rgb.r = (uint8_t)((float)(rgb_config->rgb.r) * intensity);
             temp_rgb.g = (uint8_t)((float)(rgb_config->rgb.g) * intensity);
             temp_rgb.b = (uint8_t)((float)(rgb_config->rgb.b) * intensity);
@@ -309,16 +492,15 @@ void rgb_process(void)
 #endif
 #if RGB_MODE_USE_CYCLE
         case RGB_MODE_CYCLE:
-            temp_hsv.s = rgb_config->hsv.s;
-            temp_hsv.v = rgb_config->hsv.v;
-            temp_hsv.h = (uint16_t)(rgb_config->hsv.h + (uint32_t)(CALC_SPAN(g_keyboard_tick, rgb_config->speed)) % 360);
-            color_set_hsv(&temp_rgb, &temp_hsv);
+            hsv_to_hsv16(&temp_hsv, &rgb_config->hsv);
+            temp_hsv.h += COLOR_HUE16_FROM_DEGREE((uint32_t)(CALC_SPAN(rgb_frame_tick, rgb_config->speed)) % 360);
+            hsv16_to_rgb(&temp_rgb, &temp_hsv);
             color_mix(target_color, &temp_rgb);
             break;
 #endif
 #if RGB_MODE_USE_JELLY
         case RGB_MODE_JELLY:
-            for (int8_t j = 0; j < RGB_NUM; j++)
+            for (uint16_t j = 0; j < RGB_NUM; j++)
             {
                 float intensity_jelly = (JELLY_DISTANCE_UM * intensity) - MANHATTAN_DISTANCE(&g_rgb_locations[j], &g_rgb_locations[i]);
                 intensity_jelly = intensity_jelly > 0 ? intensity_jelly > UNIT_TO_UM(1) ? UNIT_TO_UM(1) : intensity_jelly : 0;
@@ -334,7 +516,251 @@ void rgb_process(void)
             break;
         }
     }
-    rgb_flush();
+}
+
+// Returns the cost of the work done, counted in LED evaluations
+static uint32_t rgb_render_step(uint32_t budget)
+{
+    uint32_t cost = 0;
+    while (rgb_render_stage != RGB_RENDER_STAGE_IDLE && (!budget || cost < budget))
+    {
+        uint16_t end = RGB_NUM;
+        if (budget && budget - cost < (uint32_t)(RGB_NUM - rgb_render_cursor))
+        {
+            end = rgb_render_cursor + (budget - cost);
+        }
+        switch (rgb_render_stage)
+        {
+        case RGB_RENDER_STAGE_BASE:
+            rgb_render_base(rgb_render_cursor, end);
+            cost += end - rgb_render_cursor;
+            rgb_render_cursor = end;
+            if (rgb_render_cursor >= RGB_NUM)
+            {
+                rgb_render_cursor = 0;
+                rgb_render_iterator_ptr = &rgb_argument_list.data[rgb_argument_list.head].next;
+                rgb_render_stage = RGB_RENDER_STAGE_ARGUMENT;
+            }
+            break;
+        case RGB_RENDER_STAGE_ARGUMENT:
+            if (*rgb_render_iterator_ptr < 0)
+            {
+                rgb_render_stage = RGB_RENDER_STAGE_KEY;
+                break;
+            }
+            if (rgb_render_argument(rgb_render_iterator_ptr))
+            {
+                rgb_render_iterator_ptr = &rgb_argument_list.data[*rgb_render_iterator_ptr].next;
+            }
+            cost += RGB_NUM;
+            break;
+        case RGB_RENDER_STAGE_KEY:
+            rgb_render_keys(rgb_render_cursor, end);
+            cost += end - rgb_render_cursor;
+            rgb_render_cursor = end;
+            if (rgb_render_cursor >= RGB_NUM)
+            {
+                rgb_render_cursor = 0;
+                rgb_render_stage = RGB_RENDER_STAGE_FLUSH;
+            }
+            break;
+        case RGB_RENDER_STAGE_FLUSH:
+            rgb_composite();
+            rgb_flush();
+            cost += RGB_NUM;
+            rgb_render_stage = RGB_RENDER_STAGE_IDLE;
+            break;
+        default:
+            rgb_render_stage = RGB_RENDER_STAGE_IDLE;
+            break;
+        }
+    }
+    return cost;
+}
+
+// Returns false when no frame has to be rendered
+static bool rgb_frame_begin(void)
+{
+    rgb_render_stage = RGB_RENDER_STAGE_IDLE;
+#ifdef LIGHTING_ENABLE
+    // Host updates land only on frame boundaries
+    lamp_array_apply();
+#endif
+    if (!g_rgb_base_config.mode 
+#ifdef SUSPEND_ENABLE
+        || g_keyboard_is_suspend
+#endif
+    )
+    {
+        rgb_turn_off();
+        return false;
+    }
+    if (g_rgb_hid_mode)
+    {
+        led_flush();
+        return false;
+    }
+    rgb_frame_tick = g_keyboard_tick;
+    rgb_frame_slices = 0;
+    rgb_render_cursor = 0;
+    memset(g_rgb_colors, 0, sizeof(g_rgb_colors));
+    rgb_render_base_begin();
+    rgb_render_stage = RGB_RENDER_STAGE_BASE;
+    return true;
+}
+
+void rgb_process(void)
+{
+    if (rgb_frame_begin())
+    {
+        rgb_render_step(0);
+    }
+}
+
+void rgb_task(void)
+{
+    RGBScheduler* scheduler = &g_rgb_scheduler;
+    const uint32_t tick = g_keyboard_tick;
+    const bool frame_due = !scheduler->frame_interval || (int32_t)(tick - scheduler->next_frame_tick) >= 0;
+    if (rgb_render_stage != RGB_RENDER_STAGE_IDLE && (g_rgb_hid_mode || !g_rgb_base_config.mode))
+    {
+        rgb_frame_begin();
+        return;
+    }
+    if (rgb_render_stage == RGB_RENDER_STAGE_IDLE)
+    {
+        if (!frame_due)
+        {
+            return;
+        }
+        if (scheduler->frame_interval)
+        {
+            uint32_t lag = tick - scheduler->next_frame_tick;
+            if (lag >= scheduler->frame_interval)
+            {
+                scheduler->dropped_frame_count += lag / scheduler->frame_interval;
+                scheduler->next_frame_tick = tick;
+            }
+            scheduler->next_frame_tick += scheduler->frame_interval;
+        }
+        if (!rgb_frame_begin())
+        {
+            return;
+        }
+    }
+    rgb_render_step(scheduler->frame_budget);
+    rgb_frame_slices++;
+    if (rgb_render_stage == RGB_RENDER_STAGE_IDLE)
+    {
+        const uint32_t frame_ticks = tick - rgb_frame_tick;
+        scheduler->frame_count++;
+        if (frame_ticks > scheduler->max_frame_ticks)
+        {
+            scheduler->max_frame_ticks = frame_ticks;
+        }
+        if (rgb_frame_slices > scheduler->max_frame_slices)
+        {
+            scheduler->max_frame_slices = rgb_frame_slices;
+        }
+    }
+}
+
+void rgb_scheduler_set_frame_rate(uint16_t frame_rate)
+{
+    g_rgb_scheduler.frame_interval = frame_rate ? KEYBOARD_TIME_TO_TICK(1000 / frame_rate) : 0;
+    g_rgb_scheduler.next_frame_tick = g_keyboard_tick;
+}
+
+void rgb_scheduler_reset_stats(void)
+{
+    g_rgb_scheduler.frame_count = 0;
+    g_rgb_scheduler.dropped_frame_count = 0;
+    g_rgb_scheduler.max_frame_ticks = 0;
+    g_rgb_scheduler.max_frame_slices = 0;
+}
+
+void rgb_layer_set(uint8_t layer, uint16_t index, const ColorRGB* rgb, uint8_t alpha)
+{
+    if (layer >= RGB_LAYER_NUM || index >= RGB_NUM)
+    {
+        return;
+    }
+    RGBLayer* target = &g_rgb_layers[layer];
+    if (!target->alpha[index] && alpha)
+    {
+        target->coverage++;
+    }
+    else if (target->alpha[index] && !alpha)
+    {
+        target->coverage--;
+    }
+    target->alpha[index] = alpha;
+    target->colors[index] = *rgb;
+}
+
+void rgb_layer_set_blend(uint8_t layer, RGBBlendMode blend_mode, uint8_t opacity)
+{
+    if (layer >= RGB_LAYER_NUM)
+    {
+        return;
+    }
+    g_rgb_layers[layer].blend_mode = blend_mode;
+    g_rgb_layers[layer].opacity = opacity;
+}
+
+void rgb_layer_clear(uint8_t layer)
+{
+    if (layer >= RGB_LAYER_NUM)
+    {
+        return;
+    }
+    memset(g_rgb_layers[layer].colors, 0, sizeof(g_rgb_layers[layer].colors));
+    memset(g_rgb_layers[layer].alpha, 0, sizeof(g_rgb_layers[layer].alpha));
+    g_rgb_layers[layer].coverage = 0;
+}
+
+static inline uint8_t rgb_blend_channel(RGBBlendMode blend_mode, uint8_t dest, uint8_t source, uint8_t alpha)
+{
+    uint16_t value;
+    switch (blend_mode)
+    {
+    case RGB_BLEND_MODE_ADD:
+        value = dest + ((source * alpha + 127) / 255);
+        return value > 255 ? 255 : value;
+    case RGB_BLEND_MODE_MAX:
+        value = (source * alpha + 127) / 255;
+        return value > dest ? value : dest;
+    case RGB_BLEND_MODE_MULTIPLY:
+        source = (dest * source + 127) / 255;
+        return dest - ((dest - source) * alpha + 127) / 255;
+    case RGB_BLEND_MODE_ALPHA:
+    default:
+        return (dest * (255 - alpha) + source * alpha + 127) / 255;
+    }
+}
+
+void rgb_composite(void)
+{
+    for (uint8_t i = 0; i < RGB_LAYER_NUM; i++)
+    {
+        const RGBLayer* layer = &g_rgb_layers[i];
+        // Fully transparent layers cost nothing
+        if (!layer->coverage || !layer->opacity)
+        {
+            continue;
+        }
+        for (uint16_t j = 0; j < RGB_NUM; j++)
+        {
+            if (!layer->alpha[j])
+            {
+                continue;
+            }
+            uint8_t alpha = (layer->alpha[j] * layer->opacity + 127) / 255;
+            g_rgb_colors[j].r = rgb_blend_channel(layer->blend_mode, g_rgb_colors[j].r, layer->colors[j].r, alpha);
+            g_rgb_colors[j].g = rgb_blend_channel(layer->blend_mode, g_rgb_colors[j].g, layer->colors[j].g, alpha);
+            g_rgb_colors[j].b = rgb_blend_channel(layer->blend_mode, g_rgb_colors[j].b, layer->colors[j].b, alpha);
+        }
+    }
 }
 
 __WEAK void rgb_update_callback(void)
@@ -344,16 +770,25 @@ __WEAK void rgb_update_callback(void)
 
 void rgb_set(uint16_t index, uint8_t r, uint8_t g, uint8_t b)
 {
-#ifdef RGB_GAMMA_ENABLE
-    r = GAMMA_CORRECT(r, 255)*(g_rgb_base_config.brightness / 255.0f) + 0.5;
-    g = GAMMA_CORRECT(g, 255)*(g_rgb_base_config.brightness / 255.0f) + 0.5;
-    b = GAMMA_CORRECT(b, 255)*(g_rgb_base_config.brightness / 255.0f) + 0.5;
+    if (rgb_gamma_lut_brightness != g_rgb_base_config.brightness)
+    {
+        rgb_gamma_lut_build(g_rgb_base_config.brightness);
+    }
+#if defined(RGB_LED_16BIT_ENABLE)
+    led_set_16bit(index, rgb_gamma_lut[r], rgb_gamma_lut[g], rgb_gamma_lut[b]);
+#elif defined(RGB_TEMPORAL_DITHER_ENABLE)
+    if (index >= RGB_NUM)
+    {
+        return;
+    }
+    ColorRGB* residue = &rgb_dither_residues[index];
+    led_set(index,
+            rgb_dither(&residue->r, rgb_gamma_lut[r]),
+            rgb_dither(&residue->g, rgb_gamma_lut[g]),
+            rgb_dither(&residue->b, rgb_gamma_lut[b]));
 #else
-    r = (r * g_rgb_base_config.brightness) >> 8;
-    g = (g * g_rgb_base_config.brightness) >> 8;
-    b = (b * g_rgb_base_config.brightness) >> 8;
+    led_set(index, rgb_gamma_lut[r], rgb_gamma_lut[g], rgb_gamma_lut[b]);
 #endif
-    led_set(index, r, g, b);
 }
 
 void rgb_init_flash(void)
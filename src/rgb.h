@@ -98,6 +98,43 @@ extern "C" {
 #define RGB_ARGUMENT_LIST_BUFFER_LENGTH 64
 #endif
 
+// Neighbor slots shared by all keys for the bubble spatial index, only allocated with
+// RGB_MODE_USE_BUBBLE. With the default 2.5U radius a key has at most 21 neighbors on a
+// 1U grid and about 14 on average on a 60% layout (902 for the 64 keys of the test board).
+// Keys whose neighbors no longer fit fall back to the full scan.
+#ifndef RGB_BUBBLE_NEIGHBOR_POOL_SIZE
+#define RGB_BUBBLE_NEIGHBOR_POOL_SIZE ((RGB_NUM) * 16)
+#endif
+
+// 0 renders a frame on every rgb_task() call
+#ifndef RGB_FRAME_RATE
+#define RGB_FRAME_RATE 0
+#endif
+
+// LED evaluations per rgb_task() call, 0 renders a whole frame at once
+#ifndef RGB_FRAME_BUDGET
+#define RGB_FRAME_BUDGET 0
+#endif
+
+// Overlay layers composited over the autonomous effects, higher index on top
+#ifndef RGB_LAYER_NUM
+#define RGB_LAYER_NUM 2
+#endif
+
+#ifndef RGB_LAYER_SCRIPT
+#define RGB_LAYER_SCRIPT 0
+#endif
+
+#ifndef RGB_LAYER_LAMP_ARRAY
+#define RGB_LAYER_LAMP_ARRAY 1
+#endif
+
+#if RGB_FRAME_RATE > 0
+#define RGB_FRAME_INTERVAL_TICK KEYBOARD_TIME_TO_TICK(1000 / (RGB_FRAME_RATE))
+#else
+#define RGB_FRAME_INTERVAL_TICK 0
+#endif
+
 //um
 #define KEY_SWITCH_DISTANCE 19050
 
@@ -152,18 +189,56 @@ typedef struct __RGBConfig
     uint32_t begin_tick;
 } RGBConfig;
 
+typedef enum __RGBBlendMode
+{
+    RGB_BLEND_MODE_ADD,
+    RGB_BLEND_MODE_ALPHA,
+    RGB_BLEND_MODE_MAX,
+    RGB_BLEND_MODE_MULTIPLY,
+} RGBBlendMode;
+
+typedef struct __RGBLayer
+{
+    ColorRGB colors[RGB_NUM];
+    uint8_t alpha[RGB_NUM];
+    uint16_t coverage;
+    RGBBlendMode blend_mode;
+    uint8_t opacity;
+} RGBLayer;
+
 typedef struct __RGBLocation
 {
     int32_t x;
     int32_t y;
 }RGBLocation;
 
+// Distances in the spatial index are stored in units of 8um
+#define RGB_DISTANCE_SHIFT 3
+typedef uint16_t RGBDistance;
+
+typedef struct __RGBNeighbor
+{
+    uint16_t index;
+    RGBDistance distance;
+} RGBNeighbor;
+
 typedef struct __RGBArgument
 {
     uint32_t begin_tick;
     uint8_t rgb_ptr;
 }RGBArgument;
 
+typedef struct __RGBScheduler
+{
+    uint32_t frame_interval;
+    uint32_t frame_budget;
+    uint32_t next_frame_tick;
+    uint32_t frame_count;
+    uint32_t dropped_frame_count;
+    uint32_t max_frame_ticks;
+    uint16_t max_frame_slices;
+} RGBScheduler;
+
 typedef struct __RGBArgumentListNode
 {
     RGBArgument data;
@@ -187,6 +262,8 @@ void rgb_forward_list_push_front(RGBArgumentList* list, RGBArgument t);
 extern ColorRGB g_rgb_colors[RGB_NUM];
 extern volatile bool g_rgb_hid_mode;
 extern RGBBaseConfig g_rgb_base_config;
+extern RGBScheduler g_rgb_scheduler;
+extern RGBLayer g_rgb_layers[RGB_LAYER_NUM];
 
 #ifndef RGB_CUSTOM_INVERSE_MAPPING
 extern uint16_t g_rgb_inverse_mapping[TOTAL_KEY_NUM];
@@ -199,7 +276,14 @@ extern const RGBLocation g_rgb_locations[RGB_NUM];
 
 void rgb_init(void);
 void rgb_process(void);
+void rgb_task(void);
+void rgb_scheduler_set_frame_rate(uint16_t frame_rate);
+void rgb_scheduler_reset_stats(void);
 void rgb_update_callback(void);
+void rgb_layer_set(uint8_t layer, uint16_t index, const ColorRGB* rgb, uint8_t alpha);
+void rgb_layer_set_blend(uint8_t layer, RGBBlendMode blend_mode, uint8_t opacity);
+void rgb_layer_clear(uint8_t layer);
+void rgb_composite(void);
 void rgb_set(uint16_t index, uint8_t r, uint8_t g, uint8_t b);
 void rgb_init_flash(void);
 void rgb_flash(void);
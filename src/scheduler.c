@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2026 Zhangqi Li (@zhangqili)
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#include "scheduler.h"
+#ifdef MACRO_ENABLE
+#include "macro.h"
+#endif
+#ifdef DYNAMICKEY_ENABLE
+#include "dynamic_key.h"
+#endif
+#ifdef NEXUS_ENABLE
+#include "nexus.h"
+#endif
+
+// Every owner that can hold a deadline at the same time needs its own slot
+#ifdef MACRO_ENABLE
+#define SCHEDULER_MACRO_TASKS MACRO_NUM
+#else
+#define SCHEDULER_MACRO_TASKS 0
+#endif
+#ifdef DYNAMICKEY_ENABLE
+#define SCHEDULER_DYNAMIC_KEY_TASKS DYNAMIC_KEY_NUM
+#else
+#define SCHEDULER_DYNAMIC_KEY_TASKS 0
+#endif
+#ifdef SCRIPT_ENABLE
+#define SCHEDULER_SCRIPT_TASKS 1
+#else
+#define SCHEDULER_SCRIPT_TASKS 0
+#endif
+#ifdef NEXUS_ENABLE
+#define SCHEDULER_NEXUS_TASKS (NEXUS_SLAVE_NUM * NEXUS_PIPELINE_DEPTH)
+#else
+#define SCHEDULER_NEXUS_TASKS 0
+#endif
+
+#define SCHEDULER_OWNER_NUM (SCHEDULER_MACRO_TASKS + SCHEDULER_DYNAMIC_KEY_TASKS + SCHEDULER_SCRIPT_TASKS + SCHEDULER_NEXUS_TASKS)
+
+#if SCHEDULER_MAX_TASKS
+#define SCHEDULER_TASK_NUM SCHEDULER_MAX_TASKS
+#elif SCHEDULER_OWNER_NUM
+#define SCHEDULER_TASK_NUM SCHEDULER_OWNER_NUM
+#else
+#define SCHEDULER_TASK_NUM 1
+#endif
+
+#if SCHEDULER_OWNER_NUM > SCHEDULER_TASK_NUM
+#error "SCHEDULER_MAX_TASKS is smaller than the number of owners that can be pending at once"
+#endif
+
+#if SCHEDULER_TASK_NUM > 255
+#error "SCHEDULER_MAX_TASKS must fit in 8 bits"
+#endif
+
+// Min-heap of deadlines in microseconds, compared with wraparound
+static SchedulerTask scheduler_heap[SCHEDULER_TASK_NUM];
+static uint8_t scheduler_heap_size;
+
+static inline bool scheduler_before(const SchedulerTask *a, const SchedulerTask *b)
+{
+    return (int32_t)(a->deadline - b->deadline) < 0;
+}
+
+static void scheduler_swap(uint8_t a, uint8_t b)
+{
+    SchedulerTask task = scheduler_heap[a];
+    scheduler_heap[a] = scheduler_heap[b];
+    scheduler_heap[b] = task;
+}
+
+static void scheduler_sift_up(uint8_t pos)
+{
+    while (pos > 0)
+    {
+        uint8_t parent = (pos - 1) / 2;
+        if (!scheduler_before(&scheduler_heap[pos], &scheduler_heap[parent]))
+        {
+            break;
+        }
+        scheduler_swap(pos, parent);
+        pos = parent;
+    }
+}
+
+static void scheduler_sift_down(uint8_t pos)
+{
+    while (true)
+    {
+        uint8_t left = pos * 2 + 1;
+        uint8_t right = left + 1;
+        uint8_t smallest = pos;
+        if (left < scheduler_heap_size && scheduler_before(&scheduler_heap[left], &scheduler_heap[smallest]))
+        {
+            smallest = left;
+        }
+        if (right < scheduler_heap_size && scheduler_before(&scheduler_heap[right], &scheduler_heap[smallest]))
+        {
+            smallest = right;
+        }
+        if (smallest == pos)
+        {
+            break;
+        }
+        scheduler_swap(pos, smallest);
+        pos = smallest;
+    }
+}
+
+static int scheduler_find(void *owner)
+{
+    for (uint8_t i = 0; i < scheduler_heap_size; i++)
+    {
+        if (scheduler_heap[i].owner == owner)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void scheduler_remove(uint8_t pos)
+{
+    scheduler_heap_size--;
+    if (pos == scheduler_heap_size)
+    {
+        return;
+    }
+    scheduler_heap[pos] = scheduler_heap[scheduler_heap_size];
+    scheduler_sift_up(pos);
+    scheduler_sift_down(pos);
+}
+
+// Free-running microsecond clock, wrapping at 32 bits. The default only advances with g_keyboard_tick, so
+// deadlines land on the next tick. Boards that need sub-tick timing, such as macro playback or tap timers at
+// low polling rates, must override it with a hardware timer or the cycle counter.
+__WEAK uint32_t scheduler_get_time_us(void)
+{
+    return SCHEDULER_TICK_TO_US(g_keyboard_tick);
+}
+
+void scheduler_init(void)
+{
+    scheduler_heap_size = 0;
+}
+
+// Replaces the pending deadline of the owner if it has one
+bool scheduler_set(void *owner, SchedulerCallback callback, uint32_t deadline)
+{
+    int pos = scheduler_find(owner);
+    if (pos < 0)
+    {
+        if (scheduler_heap_size >= SCHEDULER_TASK_NUM)
+        {
+            return false;
+        }
+        pos = scheduler_heap_size++;
+    }
+    scheduler_heap[pos].deadline = deadline;
+    scheduler_heap[pos].callback = callback;
+    scheduler_heap[pos].owner = owner;
+    scheduler_sift_up(pos);
+    scheduler_sift_down(pos);
+    return true;
+}
+
+void scheduler_cancel(void *owner)
+{
+    int pos = scheduler_find(owner);
+    if (pos >= 0)
+    {
+        scheduler_remove(pos);
+    }
+}
+
+bool scheduler_is_pending(void *owner)
+{
+    return scheduler_find(owner) >= 0;
+}
+
+bool scheduler_get_next_deadline(uint32_t *deadline)
+{
+    if (!scheduler_heap_size)
+    {
+        return false;
+    }
+    *deadline = scheduler_heap[0].deadline;
+    return true;
+}
+
+void scheduler_process(void)
+{
+    SchedulerTask due[SCHEDULER_TASK_NUM];
+    uint8_t due_num = 0;
+    const uint32_t now = scheduler_get_time_us();
+    // Collect first, deadlines set again from a callback run on the next call
+    while (scheduler_heap_size && SCHEDULER_IS_DUE(scheduler_heap[0].deadline, now))
+    {
+        due[due_num++] = scheduler_heap[0];
+        scheduler_remove(0);
+    }
+    for (uint8_t i = 0; i < due_num; i++)
+    {
+        due[i].callback(due[i].owner);
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2026 Zhangqi Li (@zhangqili)
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include "keyboard.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Owners with a pending deadline, one slot each, 0 sizes the heap for every owner in the build
+#ifndef SCHEDULER_MAX_TASKS
+#define SCHEDULER_MAX_TASKS 0
+#endif
+
+#define SCHEDULER_TICK_TO_US(x) ((uint32_t)(((uint64_t)(x) * 1000000) / POLLING_RATE))
+#define SCHEDULER_US_TO_TICK(x) ((uint32_t)(((uint64_t)(x) * POLLING_RATE) / 1000000))
+#define SCHEDULER_IS_DUE(deadline, now) ((int32_t)((deadline) - (now)) <= 0)
+
+typedef void (*SchedulerCallback)(void *owner);
+
+typedef struct __SchedulerTask
+{
+    uint32_t deadline;
+    SchedulerCallback callback;
+    void *owner;
+} SchedulerTask;
+
+void scheduler_init(void);
+bool scheduler_set(void *owner, SchedulerCallback callback, uint32_t deadline);
+void scheduler_cancel(void *owner);
+bool scheduler_is_pending(void *owner);
+bool scheduler_get_next_deadline(uint32_t *deadline);
+void scheduler_process(void);
+uint32_t scheduler_get_time_us(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SCHEDULER_H_ */
@@ -17,6 +17,7 @@ static void script_write_log(const void *buf, size_t buf_len);
 
 #include "file_system.h"
 #include "storage.h"
+#include "event_buffer.h"
 
 #include "mqjs_stdlib.h"
 static void script_write_log(const void *buf, size_t buf_len)
@@ -36,8 +37,43 @@ static void script_write_log(const void *buf, size_t buf_len)
 #endif
 }
 
+// Set while script_heap_measure() reads the heap size from JS_DumpMemory()
+static bool script_heap_dump_capture;
+static uint8_t script_heap_dump_match;
+static bool script_heap_dump_digits;
+static bool script_heap_dump_done;
+static uint32_t script_heap_dump_value;
+
+// Picks the first number after "heap", the output may arrive in several chunks
+static void script_heap_dump_feed(const char *data, size_t len)
+{
+    static const char key[] = "heap";
+    for (size_t i = 0; i < len && !script_heap_dump_done; i++)
+    {
+        char c = data[i];
+        if (script_heap_dump_match < sizeof(key) - 1)
+        {
+            script_heap_dump_match = c == key[script_heap_dump_match] ? script_heap_dump_match + 1 : c == key[0];
+        }
+        else if (c >= '0' && c <= '9')
+        {
+            script_heap_dump_value = script_heap_dump_value * 10 + (c - '0');
+            script_heap_dump_digits = true;
+        }
+        else if (script_heap_dump_digits)
+        {
+            script_heap_dump_done = true;
+        }
+    }
+}
+
 void script_log_func(void *opaque, const void *buf, size_t buf_len) {
     UNUSED(opaque);
+    if (script_heap_dump_capture)
+    {
+        script_heap_dump_feed((const char *)buf, buf_len);
+        return;
+    }
     script_write_log(buf, buf_len);
 }
 extern const JSSTDLibraryDef js_stdlib;
@@ -46,7 +82,7 @@ extern const JSSTDLibraryDef js_stdlib;
 #error "SCRIPT_ENABLE requires storage support with LFS_ENABLE"
 #endif
 
-#if SCRIPT_RUNTIME_STRATEGY == SCRIPT_AOT
+#if SCRIPT_RUNTIME_STRATEGY == SCRIPT_AOT || defined(SCRIPT_BYTECODE_CACHE_ENABLE)
 uint8_t g_script_bytecode_buffer[SCRIPT_BYTECODE_BUFFER_SIZE];
 #endif
 #if SCRIPT_RUNTIME_STRATEGY == SCRIPT_JIT
@@ -73,17 +109,261 @@ static JSGCRef on_exit_func_ref;
 static JSValue *on_exit_func_ptr = NULL;
 static bool on_exit_func_set = false;
 
+static JSGCRef on_events_func_ref; 
+static JSValue *on_events_func_ptr = NULL;
+static bool on_events_func_set = false;
+
+// Preallocated event objects and the array handed to onEvents(), reused every tick
+static JSGCRef event_pool_ref;
+static JSValue *event_pool_ptr = NULL;
+static JSGCRef event_batch_ref;
+static JSValue *event_batch_ptr = NULL;
+
+static EventLoopQueueElm script_event_queue_buffer[SCRIPT_EVENT_QUEUE_LENGTH + 1];
+static EventLoopQueue script_event_queue;
+
 volatile bool g_keyboard_enable_script;
 static bool script_is_loaded = false;
 
+// The buffers still hold what is on flash, restarts load them in place without touching littlefs
+static bool script_buffer_valid = false;
+static size_t script_bytecode_length;
+#if SCRIPT_RUNTIME_STRATEGY == SCRIPT_JIT
+static size_t script_source_length;
+#endif
+
+#define SCRIPT_CACHE_MAGIC 0x4A53434D
+
+typedef struct __ScriptCacheHeader
+{
+    uint32_t magic;
+    uint32_t source_hash;
+    uint32_t bytecode_hash;
+    uint32_t length;
+} ScriptCacheHeader;
+
+static JSContext *js_ctx;
+
+ScriptRuntimeStats g_script_runtime_stats;
+ScriptHeapStats g_script_heap_stats = {
+    .pool_size = SCRIPT_MEMORY_SIZE,
+    .gc_interval = SCRIPT_GC_INTERVAL,
+    .gc_threshold = SCRIPT_GC_THRESHOLD,
+};
+
+// Live bytes right after the last collection
+static uint32_t script_gc_live_bytes;
+static uint16_t script_gc_ticks;
+
+static uint8_t script_budget_depth;
+static bool script_budget_exceeded;
+static uint32_t script_budget_polls;
+static uint32_t script_budget_begin_us;
+
 static void dump_error(JSContext *ctx)
 {
     JSValue obj;
     obj = JS_GetException(ctx);
+    // Budget interrupts are reported by script_budget_end()
+    if (script_budget_exceeded)
+    {
+        return;
+    }
     JS_PrintValueF(ctx, obj, JS_DUMP_LONG);
 }
 
-static JSContext *js_ctx;
+__WEAK uint32_t script_get_time_us(void)
+{
+    return scheduler_get_time_us();
+}
+
+static int script_interrupt_handler(JSContext *ctx, void *opaque)
+{
+    UNUSED(ctx);
+    UNUSED(opaque);
+    if (!script_budget_depth)
+    {
+        return 0;
+    }
+    script_budget_polls++;
+#if SCRIPT_INTERRUPT_BUDGET
+    if (script_budget_polls > SCRIPT_INTERRUPT_BUDGET)
+    {
+        script_budget_exceeded = true;
+    }
+#endif
+#if SCRIPT_TIME_BUDGET_US
+    if (script_get_time_us() - script_budget_begin_us > SCRIPT_TIME_BUDGET_US)
+    {
+        script_budget_exceeded = true;
+    }
+#endif
+    return script_budget_exceeded;
+}
+
+static void script_budget_begin(void)
+{
+    // Hooks re-entered from inside a call share the outer budget
+    if (script_budget_depth++)
+    {
+        return;
+    }
+    script_budget_polls = 0;
+    script_budget_exceeded = false;
+    script_budget_begin_us = script_get_time_us();
+}
+
+static void script_release_pending_keys(void)
+{
+    for (int i = 0; i < SCRIPT_MAX_TIMERS; i++)
+    {
+        JSTimer *th = &js_timer_list[i];
+        if (th->allocated && th->type == TIMER_TYPE_JS_RELEASE_KEYCODE)
+        {
+            js_timer_free(i);
+            js_keyboard_release(js_ctx, th->keycode);
+        }
+    }
+}
+
+static void script_budget_end(void)
+{
+    ScriptRuntimeStats *stats = &g_script_runtime_stats;
+    if (--script_budget_depth)
+    {
+        return;
+    }
+    uint32_t elapsed_us = script_get_time_us() - script_budget_begin_us;
+    stats->invocation_count++;
+    if (script_budget_polls > stats->max_interrupt_polls)
+    {
+        stats->max_interrupt_polls = script_budget_polls;
+    }
+    if (elapsed_us > stats->max_time_us)
+    {
+        stats->max_time_us = elapsed_us;
+    }
+    if (!script_budget_exceeded)
+    {
+        stats->consecutive_overruns = 0;
+        return;
+    }
+    script_budget_exceeded = false;
+    stats->overrun_count++;
+    stats->consecutive_overruns++;
+    console_printf("script: budget overrun (%d/%d)\n", stats->consecutive_overruns, SCRIPT_MAX_OVERRUNS);
+    if (stats->consecutive_overruns >= SCRIPT_MAX_OVERRUNS)
+    {
+        g_keyboard_enable_script = false;
+        stats->suspended_by_budget = true;
+        // Keys pressed by tap() would otherwise stay down while suspended
+        script_release_pending_keys();
+        console_printf("script: suspended after %d overruns\n", stats->consecutive_overruns);
+    }
+}
+
+void script_print_stats(void)
+{
+    const ScriptRuntimeStats *stats = &g_script_runtime_stats;
+    console_printf("script: calls %lu overruns %lu max polls %lu max %luus%s\n",
+                   (unsigned long)stats->invocation_count,
+                   (unsigned long)stats->overrun_count,
+                   (unsigned long)stats->max_interrupt_polls,
+                   (unsigned long)stats->max_time_us,
+                   stats->suspended_by_budget ? " suspended" : "");
+}
+
+static void script_heap_reset_stats(void)
+{
+    script_gc_live_bytes = 0;
+    script_gc_ticks = 0;
+    g_script_heap_stats.live_bytes = 0;
+    g_script_heap_stats.high_water = 0;
+}
+
+// mquickjs keeps its heap pointers private, the allocator reports its heap size through JS_DumpMemory()
+static uint32_t script_heap_measure(void)
+{
+    script_heap_dump_match = 0;
+    script_heap_dump_digits = false;
+    script_heap_dump_done = false;
+    script_heap_dump_value = 0;
+    script_heap_dump_capture = true;
+    JS_DumpMemory(js_ctx, false);
+    script_heap_dump_capture = false;
+    return script_heap_dump_value;
+}
+
+// Live bytes include garbage until the next collection, which compacts the heap down to the reachable objects
+void script_update_heap_stats(void)
+{
+    ScriptHeapStats *stats = &g_script_heap_stats;
+    if (!js_ctx)
+    {
+        return;
+    }
+    stats->live_bytes = script_heap_measure();
+    if (stats->live_bytes > stats->high_water)
+    {
+        stats->high_water = stats->live_bytes;
+    }
+}
+
+void script_collect_garbage(void)
+{
+    ScriptHeapStats *stats = &g_script_heap_stats;
+    if (!js_ctx)
+    {
+        return;
+    }
+    uint32_t begin_us = script_get_time_us();
+    JS_GC(js_ctx);
+    uint32_t pause_us = script_get_time_us() - begin_us;
+    stats->gc_count++;
+    stats->gc_last_pause_us = pause_us;
+    if (pause_us > stats->gc_max_pause_us)
+    {
+        stats->gc_max_pause_us = pause_us;
+    }
+    script_gc_ticks = 0;
+    script_update_heap_stats();
+    script_gc_live_bytes = stats->live_bytes;
+}
+
+static void script_gc_policy(void)
+{
+    ScriptHeapStats *stats = &g_script_heap_stats;
+    script_update_heap_stats();
+    if (stats->gc_interval && ++script_gc_ticks >= stats->gc_interval)
+    {
+        script_collect_garbage();
+        return;
+    }
+    // A heap whose live set stays above the threshold is only collected again once it grows
+    if (stats->gc_threshold && stats->live_bytes > script_gc_live_bytes &&
+        stats->live_bytes * 100 >= stats->pool_size * stats->gc_threshold)
+    {
+        script_collect_garbage();
+    }
+}
+
+void script_print_heap_stats(void)
+{
+    const ScriptHeapStats *stats = &g_script_heap_stats;
+    script_update_heap_stats();
+    console_printf("script: heap %lu peak %lu/%lu gc %lu last %luus max %luus\n",
+                   (unsigned long)stats->live_bytes,
+                   (unsigned long)stats->high_water,
+                   (unsigned long)stats->pool_size,
+                   (unsigned long)stats->gc_count,
+                   (unsigned long)stats->gc_last_pause_us,
+                   (unsigned long)stats->gc_max_pause_us);
+    if (js_ctx)
+    {
+        JS_DumpMemory(js_ctx, false);
+    }
+}
+
 void script_run_function(JSContext *ctx, const char *func_name)
 {
     JSValue global_obj = JS_GetGlobalObject(ctx);
@@ -137,18 +417,56 @@ static bool find_function_by_name(JSContext *ctx, JSValue **func_ptr, JSGCRef *f
     }
 }
 
+static bool script_setup_event_pool(JSContext *ctx)
+{
+    event_pool_ptr = JS_AddGCRef(ctx, &event_pool_ref);
+    *event_pool_ptr = JS_NewArray(ctx, SCRIPT_EVENT_QUEUE_LENGTH);
+    event_batch_ptr = JS_AddGCRef(ctx, &event_batch_ref);
+    *event_batch_ptr = JS_NewArray(ctx, SCRIPT_EVENT_QUEUE_LENGTH);
+    if (JS_IsException(*event_pool_ptr) || JS_IsException(*event_batch_ptr))
+    {
+        return false;
+    }
+    for (uint16_t i = 0; i < SCRIPT_EVENT_QUEUE_LENGTH; i++)
+    {
+        JSGCRef obj_ref;
+        JSValue *obj = JS_PushGCRef(ctx, &obj_ref);
+        *obj = JS_NewObject(ctx);
+        if (JS_IsException(*obj))
+        {
+            JS_PopGCRef(ctx, &obj_ref);
+            return false;
+        }
+        // Properties are created once here, so refilling them later does not allocate
+        JS_SetPropertyStr(ctx, *obj, "id", JS_NewInt32(ctx, 0));
+        JS_SetPropertyStr(ctx, *obj, "keycode", JS_NewInt32(ctx, 0));
+        JS_SetPropertyStr(ctx, *obj, "event", JS_NewInt32(ctx, 0));
+        JS_SetPropertyStr(ctx, *obj, "tick", JS_NewInt32(ctx, 0));
+        JS_SetPropertyUint32(ctx, *event_pool_ptr, i, *obj);
+        JS_PopGCRef(ctx, &obj_ref);
+    }
+    return true;
+}
+
 static void script_setup_hooks(JSContext *ctx)
 {
     loop_func_set = find_function_by_name(ctx, &loop_func_ptr, &loop_func_ref, "loop");
     on_key_down_func_set = find_function_by_name(ctx, &on_key_down_func_ptr, &on_key_down_func_ref, "onKeyDown");
     on_key_up_func_set = find_function_by_name(ctx, &on_key_up_func_ptr, &on_key_up_func_ref, "onKeyUp");
     on_exit_func_set = find_function_by_name(ctx, &on_exit_func_ptr, &on_exit_func_ref, "onExit");
+    on_events_func_set = find_function_by_name(ctx, &on_events_func_ptr, &on_events_func_ref, "onEvents");
+    if (on_events_func_set)
+    {
+        on_events_func_set = script_setup_event_pool(ctx);
+    }
 }
 
 void script_factory_reset(void)
 {
     fs_unlink("scripts/main.js");
     fs_unlink("scripts/main.bin");
+    fs_unlink(SCRIPT_BYTECODE_CACHE_FILENAME);
+    script_invalidate_cache();
 }
 
 void script_reset_runtime(void)
@@ -160,7 +478,12 @@ void script_reset_runtime(void)
         js_ctx = NULL;
     }
     memset(js_timer_list, 0, sizeof(js_timer_list));
+    js_timer_heap_size = 0;
+    scheduler_cancel(js_timer_list);
+    memset(js_analog_threshold_list, 0, sizeof(js_analog_threshold_list));
+    js_analog_array_ptr = NULL;
     memset(js_memory_pool, 0, sizeof(js_memory_pool)); 
+    script_heap_reset_stats();
 
     loop_func_ptr = NULL;
     loop_func_set = false;
@@ -173,30 +496,152 @@ void script_reset_runtime(void)
 
     on_exit_func_ptr = NULL;
     on_exit_func_set = false;
+
+    on_events_func_ptr = NULL;
+    on_events_func_set = false;
+    event_pool_ptr = NULL;
+    event_batch_ptr = NULL;
+    event_loop_queue_init(&script_event_queue, script_event_queue_buffer, SCRIPT_EVENT_QUEUE_LENGTH + 1);
     js_ctx = JS_NewContext(js_memory_pool, sizeof(js_memory_pool), &js_stdlib);
     if (!js_ctx) {
         return;
     }
     JS_SetLogFunc(js_ctx, script_log_func);
+    JS_SetInterruptHandler(js_ctx, script_interrupt_handler);
 }
 
-void script_init(void)
+static size_t script_read_file(const char *name, uint8_t *buf, size_t size)
 {
-    script_reset_runtime();
-    storage_read_script();
-    //memset(g_script_bytecode_buffer, 0, sizeof(g_script_bytecode_buffer));
-#if SCRIPT_RUNTIME_STRATEGY == SCRIPT_AOT
     File file;
-    int res = fs_open(&file, "scripts/main.bin", FS_O_RDWR | FS_O_CREAT);
+    int res = fs_open(&file, name, FS_O_RDWR | FS_O_CREAT);
     if (res < 0)
-    {        
-        return;
+    {
+        return 0;
     }
-    script_update_bytecode(g_script_bytecode_buffer, fs_size(&file));
+    size_t len = fs_read(&file, buf, size);
     fs_close(&file);
+    return len > size ? 0 : len;
+}
+
+#if SCRIPT_RUNTIME_STRATEGY == SCRIPT_JIT && defined(SCRIPT_BYTECODE_CACHE_ENABLE)
+static uint32_t script_hash(const uint8_t *data, size_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static size_t script_cache_load(uint32_t source_hash)
+{
+    File file;
+    ScriptCacheHeader header;
+    size_t len = 0;
+    if (fs_open(&file, SCRIPT_BYTECODE_CACHE_FILENAME, FS_O_RDONLY) < 0)
+    {
+        return 0;
+    }
+    if (fs_read(&file, &header, sizeof(header)) == sizeof(header) &&
+        header.magic == SCRIPT_CACHE_MAGIC &&
+        header.source_hash == source_hash &&
+        header.length <= sizeof(g_script_bytecode_buffer) &&
+        fs_read(&file, g_script_bytecode_buffer, header.length) == header.length &&
+        script_hash(g_script_bytecode_buffer, header.length) == header.bytecode_hash &&
+        JS_IsBytecode(g_script_bytecode_buffer, header.length))
+    {
+        len = header.length;
+    }
+    fs_close(&file);
+    return len;
+}
+
+static size_t script_cache_compile(uint32_t source_hash)
+{
+    JSBytecodeHeader hdr;
+    const uint8_t *data_buf;
+    uint32_t data_len;
+    JSValue func = JS_Parse(js_ctx, (const char *)g_script_source_buffer, script_source_length, "<runtime>", 0);
+    if (JS_IsException(func))
+    {
+        // Falls back to JS_Eval, which reports the error
+        script_reset_runtime();
+        return 0;
+    }
+    JS_PrepareBytecode(js_ctx, &hdr, &data_buf, &data_len, func);
+    size_t len = sizeof(hdr) + data_len;
+    if (len > sizeof(g_script_bytecode_buffer))
+    {
+        console_printf("Error: Bytecode cache too small (%d).\n", (int)len);
+        script_reset_runtime();
+        return 0;
+    }
+    memcpy(g_script_bytecode_buffer, &hdr, sizeof(hdr));
+    memcpy(g_script_bytecode_buffer + sizeof(hdr), data_buf, data_len);
+
+    ScriptCacheHeader header = {
+        .magic = SCRIPT_CACHE_MAGIC,
+        .source_hash = source_hash,
+        .bytecode_hash = script_hash(g_script_bytecode_buffer, len),
+        .length = len,
+    };
+    File file;
+    if (fs_open(&file, SCRIPT_BYTECODE_CACHE_FILENAME, FS_O_WRONLY | FS_O_CREAT | FS_O_TRUNC) >= 0)
+    {
+        fs_write(&file, &header, sizeof(header));
+        fs_write(&file, g_script_bytecode_buffer, len);
+        fs_close(&file);
+    }
+    // Preparing bytecode compacts the heap, so the image is run in a fresh context
+    script_reset_runtime();
+    return len;
+}
+#endif
+
+void script_invalidate_cache(void)
+{
+    script_buffer_valid = false;
+}
+
+void script_init(void)
+{
+    script_reset_runtime();
+#if SCRIPT_RUNTIME_STRATEGY == SCRIPT_AOT
+    if (!script_buffer_valid)
+    {
+        script_bytecode_length = script_read_file("scripts/main.bin", g_script_bytecode_buffer, sizeof(g_script_bytecode_buffer));
+        script_buffer_valid = true;
+    }
+    // Relocation is a no-op once the image sits at its final address
+    script_update_bytecode(g_script_bytecode_buffer, script_bytecode_length);
 #endif
 #if SCRIPT_RUNTIME_STRATEGY == SCRIPT_JIT
-    script_update_source((char *)g_script_source_buffer, strlen(g_script_source_buffer));
+    if (!script_buffer_valid)
+    {
+        memset(g_script_source_buffer, 0, sizeof(g_script_source_buffer));
+        script_read_file("scripts/main.js", g_script_source_buffer, sizeof(g_script_source_buffer) - 1);
+        script_source_length = strlen((char *)g_script_source_buffer);
+        script_bytecode_length = 0;
+#ifdef SCRIPT_BYTECODE_CACHE_ENABLE
+        uint32_t source_hash = script_hash(g_script_source_buffer, script_source_length);
+        script_bytecode_length = script_cache_load(source_hash);
+        if (!script_bytecode_length && script_source_length)
+        {
+            script_bytecode_length = script_cache_compile(source_hash);
+        }
+#endif
+        script_buffer_valid = true;
+    }
+    if (script_bytecode_length)
+    {
+        script_update_bytecode(g_script_bytecode_buffer, script_bytecode_length);
+    }
+    else
+    {
+        script_update_source((char *)g_script_source_buffer, script_source_length);
+    }
 #endif
     JS_SetRandomSeed(js_ctx, g_keyboard_tick);
 }
@@ -254,58 +699,85 @@ void script_update_bytecode(uint8_t *bytecode_buf, size_t len)
 
 static void run_timers(JSContext *ctx)
 {
-    int64_t min_delay, delay, cur_time;
-    BOOL has_timer;
+    const uint32_t now = scheduler_get_time_us();
     int i;
     JSTimer *th;
-    min_delay = 1000;
-    cur_time = get_time_ms();
-    has_timer = FALSE;
-    for(i = 0; i < SCRIPT_MAX_TIMERS; i++) {
+    // Fire every due timer in deadline order, timers created by callbacks wait for a later tick
+    while ((i = js_timer_peek_due(now)) >= 0) {
         th = &js_timer_list[i];
-        if (th->allocated) {
-            has_timer = TRUE;
-            delay = th->timeout - cur_time;
-            if (delay <= 0) {
-                JSValue ret;
-                switch (th->type)
-                {
-                case TIMER_TYPE_JS_TIMEOUT:
-                    /* the timer expired */
-                    if (JS_StackCheck(ctx, 2))
-                        goto fail;
-                    JS_PushArg(ctx, th->func.val); /* func name */
-                    JS_PushArg(ctx, JS_NULL); /* this */
-                    
-                    JS_DeleteGCRef(ctx, &th->func);
-                    th->allocated = FALSE;
-                    
-                    ret = JS_Call(ctx, 0);
-                    if (JS_IsException(ret)) {
-                    fail:
-                        dump_error(js_ctx);
-                        return;
-                    }
-                    min_delay = 0;
-                    break;
-                case TIMER_TYPE_JS_RELEASE_KEYCODE:
-                    /* the timer expired */
-                    js_keyboard_release(ctx, th->keycode);
-                    th->allocated = FALSE;
-                    min_delay = 0;
-                    
-                    break;
-                default:
-                    break;
-                }
-                break;
-            } else if (delay < min_delay) {
-                min_delay = delay;
+        switch (th->type)
+        {
+        case TIMER_TYPE_JS_TIMEOUT:
+        {
+            if (JS_StackCheck(ctx, 2))
+            {
+                dump_error(ctx);
+                return;
+            }
+            JS_PushArg(ctx, th->func.val); /* func name */
+            JS_PushArg(ctx, JS_NULL); /* this */
+
+            JS_DeleteGCRef(ctx, &th->func);
+            js_timer_free(i);
+
+            JSValue ret = JS_Call(ctx, 0);
+            if (JS_IsException(ret)) {
+                dump_error(ctx);
+                return;
             }
+            break;
+        }
+        case TIMER_TYPE_JS_RELEASE_KEYCODE:
+            js_timer_free(i);
+            js_keyboard_release(ctx, th->keycode);
+            break;
+        default:
+            js_timer_free(i);
+            break;
         }
     }
-    if (!has_timer)
-        return;
+}
+
+static void execute_js_hook(JSContext *ctx, JSValue *func_ptr, int argc, JSValue *argv);
+
+// Crossings are detected in C, JS only runs when a threshold is actually crossed
+static void run_analog_thresholds(JSContext *ctx)
+{
+    for (int i = 0; i < SCRIPT_MAX_ANALOG_THRESHOLDS && !script_budget_exceeded; i++)
+    {
+        JSAnalogThreshold *th = &js_analog_threshold_list[i];
+        if (!th->allocated)
+        {
+            continue;
+        }
+        AnalogValue value = keyboard_get_key_effective_analog_value(&g_keyboard_advanced_keys[th->id].key);
+        bool above = th->above ? value + th->hysteresis >= th->threshold : value >= th->threshold;
+        if (above == th->above)
+        {
+            continue;
+        }
+        th->above = above;
+        JSValue argv[3] = {
+            JS_NewInt32(ctx, th->id),
+            JS_NewInt32(ctx, value),
+            JS_NewBool(above),
+        };
+        execute_js_hook(ctx, &th->func.val, 3, argv);
+    }
+}
+
+// Woken by the shared scheduler when the earliest script timer is due
+static void script_timer_wake(void *owner)
+{
+    UNUSED(owner);
+    if (g_keyboard_enable_script)
+    {
+        script_budget_begin();
+        run_timers(js_ctx);
+        script_budget_end();
+    }
+    // run_timers() stops early on errors, timers still due are retried on the next pass
+    js_timer_arm();
 }
 
 void script_watch(uint16_t id)
@@ -319,6 +791,14 @@ void script_process(void)
     {
         return;
     }
+    // Arming fails while the scheduler is full, retry until the earliest timer is mirrored again
+    if (js_timer_heap_size && !scheduler_is_pending(js_timer_list))
+    {
+        js_timer_arm();
+    }
+    script_budget_begin();
+    js_analog_refresh(js_ctx);
+    run_analog_thresholds(js_ctx);
     if (loop_func_set)
     {
         if (JS_StackCheck(js_ctx, 2))
@@ -333,7 +813,8 @@ void script_process(void)
             dump_error(js_ctx);
         }
     }
-    run_timers(js_ctx);
+    script_budget_end();
+    script_gc_policy();
 }
 
 static void execute_js_hook(JSContext *ctx, JSValue *func_ptr, int argc, JSValue *argv)
@@ -355,12 +836,14 @@ static void execute_js_hook(JSContext *ctx, JSValue *func_ptr, int argc, JSValue
     JS_PushArg(ctx, *pfunc);     /* func name */
     JS_PushArg(ctx, JS_NULL);    /* this */
     
+    script_budget_begin();
     JSValue ret = JS_Call(ctx, argc);
     JS_PopGCRef(ctx, &func_ref);
     
     if (JS_IsException(ret)) {
         dump_error(ctx);
     }
+    script_budget_end();
 }
 static void dispatch_js_event(JSContext *ctx, bool is_set, JSValue *func_ptr)
 {
@@ -402,7 +885,11 @@ static void script_event_handler_(KeyboardEvent event)
                     script_init();
                     script_is_loaded = true;
                 }
+                g_script_runtime_stats.consecutive_overruns = 0;
+                g_script_runtime_stats.suspended_by_budget = false;
                 g_keyboard_enable_script = true;
+                // Timers kept while suspended resume from the shared scheduler
+                js_timer_arm();
             }
             break;
         case SCRIPT_TOGGLE:
@@ -413,7 +900,10 @@ static void script_event_handler_(KeyboardEvent event)
                     script_init();
                     script_is_loaded = true;
                 }
+                g_script_runtime_stats.consecutive_overruns = 0;
+                g_script_runtime_stats.suspended_by_budget = false;
                 g_keyboard_enable_script = true;
+                js_timer_arm();
                 break; 
             }
             /* Fall through */
@@ -432,6 +922,10 @@ static void script_event_handler_(KeyboardEvent event)
         case SCRIPT_SUSPEND:
             g_keyboard_enable_script = false;
             break;
+        case SCRIPT_STATS:
+            script_print_stats();
+            script_print_heap_stats();
+            break;
         default:
             break;
         }
@@ -447,6 +941,21 @@ static void script_event_handler_(KeyboardEvent event)
     {
         return;
     }
+    if (on_events_func_set)
+    {
+        // Delivered in one onEvents() call from keyboard_process(), off the scan path
+        if (EVENT_CHANGED(event.event))
+        {
+            EventLoopQueue *q = &script_event_queue;
+            if ((q->rear + 1) % q->len == q->front)
+            {
+                g_script_runtime_stats.dropped_event_count++;
+                return;
+            }
+            event_loop_queue_push(q, (EventLoopQueueElm){event, g_keyboard_tick});
+        }
+        return;
+    }
     switch (event.event)
     {
     case KEYBOARD_EVENT_KEY_DOWN:
@@ -493,6 +1002,39 @@ void script_event_poller(KeyboardEvent event, uint32_t tick)
 #endif
 }
 
+void script_dispatch_events(void)
+{
+    EventLoopQueue *q = &script_event_queue;
+    if (q->front == q->rear)
+    {
+        return;
+    }
+    if (!g_keyboard_enable_script || !on_events_func_set)
+    {
+        q->front = q->rear;
+        return;
+    }
+    uint32_t count = 0;
+    // Refilling the pooled objects does not allocate, but appending to the
+    // batch may grow its storage and run the GC, so the entry stays rooted
+    JSGCRef obj_ref;
+    JSValue *obj = JS_PushGCRef(js_ctx, &obj_ref);
+    JS_SetPropertyStr(js_ctx, *event_batch_ptr, "length", JS_NewInt32(js_ctx, 0));
+    event_loop_queue_foreach(q, EventLoopQueueElm, item)
+    {
+        *obj = JS_GetPropertyUint32(js_ctx, *event_pool_ptr, count);
+        JS_SetPropertyStr(js_ctx, *obj, "id", JS_NewInt32(js_ctx, ((Key*)item->event.key)->id));
+        JS_SetPropertyStr(js_ctx, *obj, "keycode", JS_NewInt32(js_ctx, item->event.keycode));
+        JS_SetPropertyStr(js_ctx, *obj, "event", JS_NewInt32(js_ctx, item->event.event));
+        JS_SetPropertyStr(js_ctx, *obj, "tick", JS_NewInt32(js_ctx, (int32_t)(item->tick & 0x3FFFFFFF)));
+        JS_SetPropertyUint32(js_ctx, *event_batch_ptr, count, *obj);
+        event_loop_queue_pop(q);
+        count++;
+    }
+    JS_PopGCRef(js_ctx, &obj_ref);
+    execute_js_hook(js_ctx, on_events_func_ptr, 1, event_batch_ptr);
+}
+
 void script_deinit(void)
 {
     if (js_ctx) {
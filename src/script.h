@@ -30,10 +30,77 @@ extern "C" {
 #define SCRIPT_MEMORY_SIZE  (4 * 1024)
 #endif
 
+// Compiled bytecode of scripts/main.js is cached in scripts/main.jsc, keyed by a source hash
+#ifndef SCRIPT_BYTECODE_CACHE_FILENAME
+#define SCRIPT_BYTECODE_CACHE_FILENAME "scripts/main.jsc"
+#endif
+
+// Key events buffered for onEvents() between two keyboard_process() calls
+#ifndef SCRIPT_EVENT_QUEUE_LENGTH
+#define SCRIPT_EVENT_QUEUE_LENGTH 16
+#endif
+
+#ifndef SCRIPT_MAX_ANALOG_THRESHOLDS
+#define SCRIPT_MAX_ANALOG_THRESHOLDS 8
+#endif
+
+// Interrupt handler polls allowed per script invocation, opt-in, 0 disables the limit
+#ifndef SCRIPT_INTERRUPT_BUDGET
+#define SCRIPT_INTERRUPT_BUDGET 0
+#endif
+
+// Wall time allowed per script invocation, measured with script_get_time_us(), one polling
+// interval by default so a script cannot delay the next report. 0 disables the limit.
+#ifndef SCRIPT_TIME_BUDGET_US
+#define SCRIPT_TIME_BUDGET_US (1000000 / POLLING_RATE)
+#endif
+
+#if defined(SCRIPT_ENABLE) && !SCRIPT_INTERRUPT_BUDGET && !SCRIPT_TIME_BUDGET_US
+#error "Scripts need SCRIPT_TIME_BUDGET_US or SCRIPT_INTERRUPT_BUDGET to bound their latency"
+#endif
+
+// Consecutive overruns before the script is suspended
+#ifndef SCRIPT_MAX_OVERRUNS
+#define SCRIPT_MAX_OVERRUNS 3
+#endif
+
 #ifndef SCRIPT_MAX_TIMERS
 #define SCRIPT_MAX_TIMERS 16
 #endif
 
+// Script ticks between forced garbage collections, 0 disables periodic collection
+#ifndef SCRIPT_GC_INTERVAL
+#define SCRIPT_GC_INTERVAL 0
+#endif
+
+// Collect when the live bytes grow past this percentage of the pool, 0 disables it
+#ifndef SCRIPT_GC_THRESHOLD
+#define SCRIPT_GC_THRESHOLD 75
+#endif
+
+typedef struct __ScriptRuntimeStats
+{
+    uint32_t invocation_count;
+    uint32_t overrun_count;
+    uint32_t max_interrupt_polls;
+    uint32_t max_time_us;
+    uint32_t dropped_event_count;
+    uint8_t consecutive_overruns;
+    bool suspended_by_budget;
+} ScriptRuntimeStats;
+
+typedef struct __ScriptHeapStats
+{
+    uint32_t pool_size;
+    uint32_t live_bytes;
+    uint32_t high_water;
+    uint32_t gc_count;
+    uint32_t gc_last_pause_us;
+    uint32_t gc_max_pause_us;
+    uint16_t gc_interval;
+    uint8_t gc_threshold;
+} ScriptHeapStats;
+
 void script_init(void);
 void script_factory_reset(void);
 void script_reset_runtime(void);
@@ -42,18 +109,27 @@ void script_update_source(const char *code, size_t len);
 void script_load_bytecode(uint8_t *bytecode_buf, size_t len);
 void script_update_bytecode(uint8_t *bytecode_buf, size_t len);
 void script_watch(uint16_t id);
+void script_invalidate_cache(void);
+uint32_t script_get_time_us(void);
+void script_print_stats(void);
+void script_update_heap_stats(void);
+void script_collect_garbage(void);
+void script_print_heap_stats(void);
 
 void script_process(void);
 void script_event_handler(KeyboardEvent event);
 void script_event_poller(KeyboardEvent event, uint32_t tick);
+void script_dispatch_events(void);
 
-#if SCRIPT_RUNTIME_STRATEGY == SCRIPT_AOT
+#if SCRIPT_RUNTIME_STRATEGY == SCRIPT_AOT || defined(SCRIPT_BYTECODE_CACHE_ENABLE)
 extern uint8_t g_script_bytecode_buffer[SCRIPT_BYTECODE_BUFFER_SIZE];
 #endif
 #if SCRIPT_RUNTIME_STRATEGY == SCRIPT_JIT
 extern uint8_t g_script_source_buffer[SCRIPT_SOURCE_BUFFER_SIZE];
 #endif
 extern volatile bool g_keyboard_enable_script;
+extern ScriptRuntimeStats g_script_runtime_stats;
+extern ScriptHeapStats g_script_heap_stats;
 
 #ifdef __cplusplus
 }
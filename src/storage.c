@@ -12,6 +12,9 @@
 #ifdef SCRIPT_ENABLE
 #include"script.h"
 #endif
+#ifdef MACRO_ENABLE
+#include"macro.h"
+#endif
 #include "file_system.h"
 #include "string.h"
 
@@ -155,8 +158,12 @@ void storage_read_profile(void)
 #endif
 #ifdef DYNAMICKEY_ENABLE
     fs_read(&file, g_dynamic_keys, sizeof(g_dynamic_keys));
+    dynamic_key_update_index();
 #endif
     fs_close(&file);
+#ifdef MACRO_ENABLE
+    macro_load();
+#endif
 }
 
 void storage_save_profile(void)
@@ -182,6 +189,9 @@ void storage_save_profile(void)
     fs_write(&file, g_dynamic_keys, sizeof(g_dynamic_keys));
 #endif
     fs_close(&file);
+#ifdef MACRO_ENABLE
+    macro_save();
+#endif
 }
 
 void storage_save_script(void)
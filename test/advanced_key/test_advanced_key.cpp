@@ -90,39 +90,30 @@ TEST(AdvancedKeyTest, SpeedMode)
             .lower_deadzone = A_ANTI_NORM(0.20),
         },
     };
-    advanced_key_update(&advanced_key, A_ANTI_NORM(0.09));
-    EXPECT_NEAR(advanced_key.difference, A_ANTI_NORM(0.09),A_ANTI_NORM(1e-4));
-    EXPECT_FALSE(advanced_key.key.state);
-    advanced_key_update(&advanced_key, A_ANTI_NORM(0.12));
-    EXPECT_NEAR(advanced_key.difference, A_ANTI_NORM(0.12-0.09), A_ANTI_NORM(1e-4));
-    EXPECT_FALSE(advanced_key.key.state);
-    advanced_key_update(&advanced_key, A_ANTI_NORM(0.20));
-    EXPECT_NEAR(advanced_key.difference, A_ANTI_NORM(0.20-0.12), A_ANTI_NORM(1e-4));
-    EXPECT_TRUE(advanced_key.key.state);
-    advanced_key_update(&advanced_key, A_ANTI_NORM(0.60));
-    EXPECT_NEAR(advanced_key.difference, A_ANTI_NORM(0.60-0.20), A_ANTI_NORM(1e-4));
-    EXPECT_TRUE(advanced_key.key.state);
-    advanced_key_update(&advanced_key, A_ANTI_NORM(0.80));
-    EXPECT_NEAR(advanced_key.difference, A_ANTI_NORM(0.80-0.60), A_ANTI_NORM(1e-4));
-    EXPECT_TRUE(advanced_key.key.state);
-    advanced_key_update(&advanced_key, A_ANTI_NORM(0.78));
-    EXPECT_NEAR(advanced_key.difference, (int16_t)A_ANTI_NORM(0.78-0.80), A_ANTI_NORM(1e-4));
-    EXPECT_TRUE(advanced_key.key.state);
-    advanced_key_update(&advanced_key, A_ANTI_NORM(0.72));
-    EXPECT_NEAR(advanced_key.difference, (int16_t)A_ANTI_NORM(0.72-0.78), A_ANTI_NORM(1e-4));
-    EXPECT_FALSE(advanced_key.key.state);
-    advanced_key_update(&advanced_key, A_ANTI_NORM(0.74));
-    EXPECT_NEAR(advanced_key.difference, A_ANTI_NORM(0.74-0.72), A_ANTI_NORM(1e-4));
-    EXPECT_FALSE(advanced_key.key.state);
-    advanced_key_update(&advanced_key, A_ANTI_NORM(0.76));
-    EXPECT_NEAR(advanced_key.difference, A_ANTI_NORM(0.76-0.74), A_ANTI_NORM(1e-4));
-    EXPECT_FALSE(advanced_key.key.state);
-    advanced_key_update(&advanced_key, A_ANTI_NORM(0.78));
-    EXPECT_NEAR(advanced_key.difference, A_ANTI_NORM(0.78-0.76), A_ANTI_NORM(1e-4));
-    EXPECT_FALSE(advanced_key.key.state);
-    advanced_key_update(&advanced_key, A_ANTI_NORM(0.81));
-    EXPECT_NEAR(advanced_key.difference, A_ANTI_NORM(0.81-0.78), A_ANTI_NORM(1e-4));
-    EXPECT_TRUE(advanced_key.key.state);
+    // Steady strokes of 0.05 per tick, the smoothed velocity crosses the 0.04 speeds a couple of ticks in
+    const struct
+    {
+        float position;
+        bool state;
+    } steps[] =
+    {
+        {0.05, false}, {0.05, false}, {0.05, false},
+        {0.10, false}, {0.15, false}, {0.20, true}, {0.25, true}, {0.30, true},
+        {0.35, true}, {0.40, true}, {0.45, true}, {0.50, true},
+        {0.50, true}, {0.50, true}, {0.50, true}, {0.50, true}, {0.50, true}, {0.50, true},
+        {0.45, true}, {0.40, true}, {0.35, false}, {0.30, false}, {0.25, false},
+        {0.25, false}, {0.25, false}, {0.25, false}, {0.25, false},
+        {0.30, false}, {0.35, false}, {0.40, true}, {0.45, true},
+    };
+    AnalogValue last_value = 0;
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+    {
+        AnalogValue value = A_ANTI_NORM(steps[i].position);
+        advanced_key_update(&advanced_key, value);
+        EXPECT_EQ(advanced_key.difference, (int16_t)(value - last_value)) << "step " << i;
+        EXPECT_EQ(advanced_key.key.state, steps[i].state) << "step " << i;
+        last_value = value;
+    }
 }
 
 TEST(AdvancedKeyTest, Value)
@@ -184,4 +175,38 @@ TEST(AdvancedKeyTest, Calibration)
         EXPECT_EQ(advanced_key.config.calibration_mode, ADVANCED_KEY_AUTO_CALIBRATION_NEGATIVE);
         EXPECT_EQ(advanced_key.config.lower_bound, default_upper_bound-DEFAULT_ESTIMATED_RANGE-500);
     }
-}
\ No newline at end of file
+}
+
+TEST(AdvancedKeyTest, VelocityEstimate)
+{
+    static AdvancedKey advanced_key =
+    {
+        .config =
+        {
+            .mode = ADVANCED_KEY_ANALOG_NORMAL_MODE,
+        },
+    };
+    // A steady stroke converges to its speed with no lag left over
+    for (int i = 1; i <= 24; i++)
+    {
+        advanced_key_update(&advanced_key, i * 1000);
+    }
+    EXPECT_NEAR(ADVANCED_KEY_VELOCITY(&advanced_key), 1000, 2);
+    EXPECT_NEAR(advanced_key.acceleration, 0, 2);
+    // Sample noise around a held position swings the one-sample difference far more than the estimate
+    for (int i = 0; i < 32; i++)
+    {
+        advanced_key_update(&advanced_key, (i & 1) ? 24500 : 23500);
+        if (i >= 16)
+        {
+            EXPECT_EQ(abs(advanced_key.difference), 1000);
+            EXPECT_LT(abs(ADVANCED_KEY_VELOCITY(&advanced_key)) * 8, abs(advanced_key.difference));
+        }
+    }
+    // Once the noise stops the estimate settles back to rest
+    for (int i = 0; i < 32; i++)
+    {
+        advanced_key_update(&advanced_key, 24000);
+    }
+    EXPECT_NEAR(ADVANCED_KEY_VELOCITY(&advanced_key), 0, 1);
+}
@@ -3,6 +3,7 @@
 #include "keyboard.h"
 #include "dynamic_key.h"
 #include "layer.h"
+#include "scheduler.h"
 #include "math.h"
 
 extern uint8_t keyboard_send_buffer[64];
@@ -26,6 +27,7 @@ TEST(DynamicKey, ModTap)
     g_keymap[0][0] = DYNAMIC_KEY | ((0) << 8);
     g_keymap_cache[0] = g_keymap[0][0];
 
+    dynamic_key_update_index();
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(1.0));
     dynamic_key_process();
     keyboard_clear_buffer();
@@ -40,6 +42,7 @@ TEST(DynamicKey, ModTap)
 
 
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(1.0));
+    scheduler_process();
     dynamic_key_process();
     keyboard_clear_buffer();
     dynamic_key_add_buffer();
@@ -63,6 +66,7 @@ TEST(DynamicKey, ModTap)
     g_keyboard_tick += 50;
 
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0.0));
+    scheduler_process();
     dynamic_key_process();
     keyboard_clear_buffer();
     dynamic_key_add_buffer();
@@ -86,6 +90,7 @@ TEST(DynamicKey, ToggleKey)
     g_keymap[0][0] = DYNAMIC_KEY | ((0) << 8);
     g_keymap_cache[0] = g_keymap[0][0];
 
+    dynamic_key_update_index();
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(1.0));
     dynamic_key_process();
     keyboard_clear_buffer();
@@ -144,6 +149,7 @@ TEST(DynamicKey, DynamicKeyStroke)
     g_keymap[0][0] = DYNAMIC_KEY | ((0) << 8);
     g_keymap_cache[0] = g_keymap[0][0];
 
+    dynamic_key_update_index();
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0],A_ANTI_NORM(1));
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0],A_ANTI_NORM(0));
     dynamic_key_process();
@@ -245,6 +251,38 @@ TEST(DynamicKey, DynamicKeyStroke)
     EXPECT_EQ(keyboard_send_buffer[3], KEY_NO_EVENT);
 }
 
+TEST(DynamicKey, DynamicKeyStrokeTapEndsOnTheScheduler)
+{
+    memset(&g_dynamic_keys[0], 0, sizeof(DynamicKey));
+    DynamicKeyStroke4x4 *dynamic_key = &g_dynamic_keys[0].dks;
+    dynamic_key->type = DYNAMIC_KEY_STROKE;
+    dynamic_key->key_binding[0] = KEY_A;
+    dynamic_key->key_control[0] = DKS_KEY_CONTROL(DKS_TAP, DKS_RELEASE, DKS_RELEASE, DKS_RELEASE);
+    dynamic_key->press_begin_distance = A_ANTI_NORM(0.25);
+    dynamic_key->press_fully_distance = A_ANTI_NORM(0.75);
+    dynamic_key->release_begin_distance = A_ANTI_NORM(0.75);
+    dynamic_key->release_fully_distance = A_ANTI_NORM(0.25);
+    g_keymap[0][0] = DYNAMIC_KEY | (0 << 8);
+    g_keymap_cache[0] = g_keymap[0][0];
+    dynamic_key_update_index();
+
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0));
+    dynamic_key_process();
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0.5));
+    dynamic_key_process();
+    EXPECT_EQ(1, dynamic_key->key_state);
+
+    // The key stays still, only the scheduler ends the tap
+    g_keyboard_tick += 10;
+    scheduler_process();
+    EXPECT_EQ(0, dynamic_key->key_state);
+    dynamic_key_process();
+    keyboard_clear_buffer();
+    dynamic_key_add_buffer();
+    keyboard_buffer_send();
+    EXPECT_EQ(keyboard_send_buffer[2], KEY_NO_EVENT);
+}
+
 TEST(DynamicKey, MutexDistancePriority)
 {
     g_keymap[0][0] = DYNAMIC_KEY | (0 << 8);
@@ -259,6 +297,7 @@ TEST(DynamicKey, MutexDistancePriority)
     dynamic_key->m.key_id[0] = 0;
     dynamic_key->m.key_id[1] = 1;
 
+    dynamic_key_update_index();
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0],A_ANTI_NORM(1));
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[1],A_ANTI_NORM(1));
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0],A_ANTI_NORM(0));
@@ -357,6 +396,7 @@ TEST(DynamicKey, MutexLastPriority)
     dynamic_key->m.key_id[0] = 0;
     dynamic_key->m.key_id[1] = 1;
 
+    dynamic_key_update_index();
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0],A_ANTI_NORM(1));
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[1],A_ANTI_NORM(1));
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0],A_ANTI_NORM(0));
@@ -417,6 +457,7 @@ TEST(DynamicKey, MutexKey1Priority)
     dynamic_key->m.key_id[0] = 0;
     dynamic_key->m.key_id[1] = 1;
 
+    dynamic_key_update_index();
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0],A_ANTI_NORM(1));
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[1],A_ANTI_NORM(1));
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0],A_ANTI_NORM(0));
@@ -477,6 +518,7 @@ TEST(DynamicKey, MutexKey2Priority)
     dynamic_key->m.key_id[0] = 0;
     dynamic_key->m.key_id[1] = 1;
 
+    dynamic_key_update_index();
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0],A_ANTI_NORM(1));
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[1],A_ANTI_NORM(1));
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0],A_ANTI_NORM(0));
@@ -538,6 +580,7 @@ TEST(DynamicKey, MutexKeyNeural)
     dynamic_key->m.key_id[0] = 0;
     dynamic_key->m.key_id[1] = 1;
 
+    dynamic_key_update_index();
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0],A_ANTI_NORM(1));
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[1],A_ANTI_NORM(1));
     keyboard_advanced_key_update(&g_keyboard_advanced_keys[0],A_ANTI_NORM(0));
@@ -584,4 +627,156 @@ TEST(DynamicKey, MutexKeyNeural)
     EXPECT_TRUE(g_keyboard_advanced_keys[1].key.state);
     EXPECT_TRUE(g_keyboard_advanced_keys[0].key.report_state);
     EXPECT_TRUE(g_keyboard_advanced_keys[1].key.report_state);
-}
\ No newline at end of file
+}
+TEST(DynamicKey, IndexFollowsLayerCache)
+{
+    memset(&g_dynamic_keys[0], 0, sizeof(DynamicKey));
+    g_dynamic_keys[0].tk.type = DYNAMIC_KEY_TOGGLE_KEY;
+    g_dynamic_keys[0].tk.key_binding = KEY_A;
+    g_dynamic_keys[0].tk.key_id = 0;
+    g_keymap[0][0] = DYNAMIC_KEY | (0 << 8);
+    layer_cache_refresh();
+
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(1.0));
+    dynamic_key_process();
+    EXPECT_TRUE(g_dynamic_keys[0].tk.state);
+
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0.0));
+    dynamic_key_process();
+
+    // Once the key no longer maps to the dynamic key it is left out of dispatch
+    g_keymap[0][0] = KEY_B;
+    layer_unlock(0);
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(1.0));
+    dynamic_key_process();
+    EXPECT_TRUE(g_dynamic_keys[0].tk.state);
+    keyboard_clear_buffer();
+    dynamic_key_add_buffer();
+    keyboard_buffer_send();
+    EXPECT_EQ(keyboard_send_buffer[2], KEY_NO_EVENT);
+
+    g_keymap[0][0] = DYNAMIC_KEY | (0 << 8);
+    layer_cache_refresh();
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0.0));
+    dynamic_key_process();
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(1.0));
+    dynamic_key_process();
+    EXPECT_FALSE(g_dynamic_keys[0].tk.state);
+
+    // Unlocking the key onto the dynamic key again brings it back into dispatch
+    g_keymap[0][0] = KEY_B;
+    layer_unlock(0);
+    g_keymap[0][0] = DYNAMIC_KEY | (0 << 8);
+    layer_unlock(0);
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0.0));
+    dynamic_key_process();
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(1.0));
+    dynamic_key_process();
+    EXPECT_TRUE(g_dynamic_keys[0].tk.state);
+}
+
+TEST(DynamicKey, MultiThreshold)
+{
+    memset(&g_dynamic_keys[0], 0, sizeof(DynamicKey));
+    DynamicKeyMultiThreshold *dynamic_key = &g_dynamic_keys[0].mth;
+    dynamic_key->type = DYNAMIC_KEY_MULTI_THRESHOLD;
+    dynamic_key->key_binding[0] = KEY_A;
+    dynamic_key->key_binding[1] = KEY_B;
+    dynamic_key->key_binding[2] = KEY_C;
+    dynamic_key->threshold[0] = A_ANTI_NORM(0.2);
+    dynamic_key->threshold[1] = A_ANTI_NORM(0.5);
+    dynamic_key->threshold[2] = A_ANTI_NORM(0.8);
+    dynamic_key->threshold_num = 3;
+    dynamic_key->hysteresis = A_ANTI_NORM(0.05);
+    dynamic_key->mode = DK_MULTI_THRESHOLD_HIGHEST;
+    dynamic_key->key_id = 0;
+    g_keymap_lock[0] = false;
+    g_keymap[0][0] = DYNAMIC_KEY | (0 << 8);
+    layer_cache_refresh();
+
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0.6));
+    dynamic_key_process();
+    EXPECT_EQ(2, dynamic_key->level);
+    keyboard_clear_buffer();
+    dynamic_key_add_buffer();
+    keyboard_buffer_send();
+    EXPECT_EQ(keyboard_send_buffer[2], KEY_B);
+    EXPECT_EQ(keyboard_send_buffer[3], KEY_NO_EVENT);
+
+    // Inside the hysteresis band the level holds
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0.47));
+    dynamic_key_process();
+    EXPECT_EQ(2, dynamic_key->level);
+
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0.3));
+    dynamic_key_process();
+    EXPECT_EQ(1, dynamic_key->level);
+
+    dynamic_key->mode = DK_MULTI_THRESHOLD_ALL;
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0.9));
+    dynamic_key_process();
+    EXPECT_EQ(3, dynamic_key->level);
+    keyboard_clear_buffer();
+    dynamic_key_add_buffer();
+    keyboard_buffer_send();
+    EXPECT_EQ(keyboard_send_buffer[2], KEY_A);
+    EXPECT_EQ(keyboard_send_buffer[3], KEY_B);
+    EXPECT_EQ(keyboard_send_buffer[4], KEY_C);
+
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0.0));
+    dynamic_key_process();
+    EXPECT_EQ(0, dynamic_key->level);
+}
+
+TEST(DynamicKey, TapDance)
+{
+    memset(&g_dynamic_keys[0], 0, sizeof(DynamicKey));
+    DynamicKeyTapDance *dynamic_key = &g_dynamic_keys[0].td;
+    dynamic_key->type = DYNAMIC_KEY_TAP_DANCE;
+    dynamic_key->key_binding[0] = KEY_A;
+    dynamic_key->key_binding[1] = KEY_B;
+    dynamic_key->hold_binding[0] = KEY_C;
+    dynamic_key->window = 100;
+    dynamic_key->key_id = 0;
+    g_keymap_lock[0] = false;
+    g_keymap[0][0] = DYNAMIC_KEY | (0 << 8);
+    layer_cache_refresh();
+
+    // Two taps inside the window resolve to the second binding once the window closes
+    for (int i = 0; i < 2; i++) {
+        keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(1.0));
+        dynamic_key_process();
+        g_keyboard_tick += 20;
+        keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0.0));
+        dynamic_key_process();
+        g_keyboard_tick += 20;
+    }
+    EXPECT_EQ(2, dynamic_key->count);
+    EXPECT_EQ(KEY_NO_EVENT, dynamic_key->action);
+    g_keyboard_tick += 100;
+    scheduler_process();
+    dynamic_key_process();
+    EXPECT_EQ(DK_TAP_DANCE_TAP, dynamic_key->state);
+    keyboard_clear_buffer();
+    dynamic_key_add_buffer();
+    keyboard_buffer_send();
+    EXPECT_EQ(keyboard_send_buffer[2], KEY_B);
+    g_keyboard_tick += 10;
+    scheduler_process();
+    dynamic_key_process();
+    EXPECT_EQ(DK_TAP_DANCE_IDLE, dynamic_key->state);
+    EXPECT_EQ(KEY_NO_EVENT, dynamic_key->action);
+
+    // Holding a single press past the window uses the hold binding until release
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(1.0));
+    dynamic_key_process();
+    g_keyboard_tick += 150;
+    scheduler_process();
+    dynamic_key_process();
+    EXPECT_EQ(DK_TAP_DANCE_HOLD, dynamic_key->state);
+    EXPECT_EQ(KEY_C, dynamic_key->action);
+    keyboard_advanced_key_update(&g_keyboard_advanced_keys[0], A_ANTI_NORM(0.0));
+    dynamic_key_process();
+    EXPECT_EQ(DK_TAP_DANCE_IDLE, dynamic_key->state);
+    EXPECT_EQ(KEY_NO_EVENT, dynamic_key->action);
+}
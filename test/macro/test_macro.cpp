@@ -1,63 +1,90 @@
 #include <gtest/gtest.h>
 
 #include "macro.h"
+#include "scheduler.h"
+#include "storage.h"
+#include "test_fixture.h"
 
-TEST(Macro, InitClearsRuntimeStateAndKeepsActionStorage)
+namespace {
+
+MacroAction make_action(uint32_t delay, Keycode keycode, uint8_t event, Key *key)
+{
+    MacroAction action = {};
+    action.delay = delay;
+    action.event = MK_EVENT(keycode, event, key);
+    return action;
+}
+
+} // namespace
+
+TEST(Macro, InitClearsRuntimeStateAndActionPool)
 {
+    macro_init();
+    MacroAction action = make_action(5, KEY_A, KEYBOARD_EVENT_KEY_DOWN, keyboard_get_key(0));
+    ASSERT_TRUE(macro_append(&g_macros[0], &action));
     g_macros[0].state = MACRO_STATE_PLAYING_ONCE;
     g_macros[0].index = 7;
-    g_macros[0].length = 3;
 
     macro_init();
 
     EXPECT_EQ(MACRO_STATE_IDLE, g_macros[0].state);
     EXPECT_EQ(0, g_macros[0].index);
     EXPECT_EQ(0, g_macros[0].length);
-    ASSERT_NE(nullptr, g_macros[0].actions);
+    EXPECT_EQ(0, g_macros[0].size);
+    EXPECT_EQ(MACRO_POOL_SIZE, macro_get_free_space());
 }
 
 TEST(Macro, RecordWritesTimedActionsAndTerminator)
 {
+    macro_init();
     Macro *macro = &g_macros[0];
-    Key key = {};
-    key.id = 0;
+    Key *key = keyboard_get_key(0);
 
     g_keyboard_tick = 100;
     macro_start_record(macro);
 
-    KeyboardEvent down = MK_EVENT(KEY_A, KEYBOARD_EVENT_KEY_DOWN, &key);
+    KeyboardEvent down = MK_EVENT(KEY_A, KEYBOARD_EVENT_KEY_DOWN, key);
     g_keyboard_tick = 125;
     macro_record(macro, down);
 
-    KeyboardEvent up = MK_EVENT(KEY_A, KEYBOARD_EVENT_KEY_UP, &key);
+    KeyboardEvent up = MK_EVENT(KEY_A, KEYBOARD_EVENT_KEY_UP, key);
     g_keyboard_tick = 140;
     macro_record(macro, up);
 
     g_keyboard_tick = 150;
     macro_stop_record(macro);
 
+    MacroAction action;
     EXPECT_EQ(MACRO_STATE_IDLE, macro->state);
     EXPECT_EQ(0, macro->index);
-    EXPECT_EQ(25U, macro->actions[0].delay);
-    EXPECT_EQ(KEY_A, macro->actions[0].event.keycode);
-    EXPECT_EQ(KEYBOARD_EVENT_KEY_DOWN, macro->actions[0].event.event);
-    EXPECT_EQ(40U, macro->actions[1].delay);
-    EXPECT_EQ(KEYBOARD_EVENT_KEY_UP, macro->actions[1].event.event);
-    EXPECT_EQ(50U, macro->actions[2].delay);
-    EXPECT_EQ(KEY_NO_EVENT, macro->actions[2].event.keycode);
+    EXPECT_EQ(3, macro->length);
+    ASSERT_TRUE(macro_get_action(macro, 0, &action));
+    EXPECT_EQ(25U, action.delay);
+    EXPECT_EQ(KEY_A, action.event.keycode);
+    EXPECT_EQ(KEYBOARD_EVENT_KEY_DOWN, action.event.event);
+    EXPECT_EQ(key, action.event.key);
+    ASSERT_TRUE(macro_get_action(macro, 1, &action));
+    EXPECT_EQ(40U, action.delay);
+    EXPECT_EQ(KEYBOARD_EVENT_KEY_UP, action.event.event);
+    EXPECT_EQ(key, action.event.key);
+    ASSERT_TRUE(macro_get_action(macro, 2, &action));
+    EXPECT_EQ(50U, action.delay);
+    EXPECT_EQ(KEY_NO_EVENT, action.event.keycode);
 }
 
 TEST(Macro, PlayOnceReturnsToIdleAtTerminator)
 {
+    macro_init();
     Macro *macro = &g_macros[0];
-    Key key = {};
-    key.id = 0;
-    macro->actions[0].delay = 5;
-    macro->actions[0].event = MK_EVENT(KEY_A, KEYBOARD_EVENT_KEY_DOWN, &key);
-    macro->actions[1].delay = 10;
-    macro->actions[1].event = MK_EVENT(KEY_A, KEYBOARD_EVENT_KEY_UP, &key);
-    macro->actions[2].delay = 15;
-    macro->actions[2].event = MK_EVENT(KEY_NO_EVENT, KEYBOARD_EVENT_NO_EVENT, &key);
+    Key *key = keyboard_get_key(0);
+    MacroAction actions[] = {
+        make_action(5, KEY_A, KEYBOARD_EVENT_KEY_DOWN, key),
+        make_action(10, KEY_A, KEYBOARD_EVENT_KEY_UP, key),
+        make_action(15, KEY_NO_EVENT, KEYBOARD_EVENT_NO_EVENT, key),
+    };
+    for (const MacroAction &action : actions) {
+        ASSERT_TRUE(macro_append(macro, &action));
+    }
 
     g_keyboard_tick = 100;
     macro_start_play_once(macro);
@@ -68,3 +95,170 @@ TEST(Macro, PlayOnceReturnsToIdleAtTerminator)
     EXPECT_EQ(MACRO_STATE_IDLE, macro->state);
     EXPECT_EQ(0, macro->index);
 }
+
+TEST(Macro, PlaybackIsDrivenBySchedulerDeadlines)
+{
+    macro_init();
+    Macro *macro = &g_macros[0];
+    Key *key = keyboard_get_key(0);
+    MacroAction actions[] = {
+        make_action(5, KEY_A, KEYBOARD_EVENT_KEY_DOWN, key),
+        make_action(12, KEY_A, KEYBOARD_EVENT_KEY_UP, key),
+        make_action(20, KEY_NO_EVENT, KEYBOARD_EVENT_NO_EVENT, key),
+    };
+    for (const MacroAction &action : actions) {
+        ASSERT_TRUE(macro_append(macro, &action));
+    }
+
+    g_keyboard_tick = 100;
+    macro_start_play_once(macro);
+    uint32_t deadline = 0;
+    EXPECT_TRUE(scheduler_is_pending(macro));
+    ASSERT_TRUE(scheduler_get_next_deadline(&deadline));
+    EXPECT_EQ(SCHEDULER_TICK_TO_US(105), deadline);
+
+    g_keyboard_tick = 106;
+    scheduler_process();
+    EXPECT_EQ(1, macro->index);
+    ASSERT_TRUE(scheduler_get_next_deadline(&deadline));
+    EXPECT_EQ(SCHEDULER_TICK_TO_US(112), deadline);
+
+    macro_stop_play(macro);
+    EXPECT_FALSE(scheduler_is_pending(macro));
+}
+
+TEST(Macro, CompactActionsShareThePoolAcrossMacros)
+{
+    macro_init();
+    Key *key_a = keyboard_get_key(0);
+    Key *key_b = keyboard_get_key(1);
+    MacroAction down = make_action(20, KEY_A, KEYBOARD_EVENT_KEY_DOWN, key_a);
+    MacroAction up = make_action(35, KEY_A, KEYBOARD_EVENT_KEY_UP, key_a);
+    MacroAction other = make_action(1000, KEY_B, KEYBOARD_EVENT_KEY_DOWN, key_b);
+
+    ASSERT_TRUE(macro_append(&g_macros[1], &other));
+    ASSERT_TRUE(macro_append(&g_macros[0], &down));
+    uint16_t down_size = g_macros[0].size;
+    ASSERT_TRUE(macro_append(&g_macros[0], &up));
+
+    // The release repeats key and keycode, only the flags and the delay are stored
+    EXPECT_EQ(2, g_macros[0].size - down_size);
+    EXPECT_EQ(g_macros[0].size, g_macros[1].offset);
+    EXPECT_EQ(MACRO_POOL_SIZE - g_macros[0].size - g_macros[1].size, macro_get_free_space());
+
+    MacroAction action;
+    ASSERT_TRUE(macro_get_action(&g_macros[0], 1, &action));
+    EXPECT_EQ(35U, action.delay);
+    EXPECT_EQ(KEY_A, action.event.keycode);
+    EXPECT_EQ(key_a, action.event.key);
+    ASSERT_TRUE(macro_get_action(&g_macros[1], 0, &action));
+    EXPECT_EQ(1000U, action.delay);
+    EXPECT_EQ(KEY_B, action.event.keycode);
+    EXPECT_EQ(key_b, action.event.key);
+
+    // Rewriting an action re-encodes the ones relative to it and keeps them
+    MacroAction press = make_action(10, KEY_B, KEYBOARD_EVENT_KEY_DOWN, key_b);
+    ASSERT_TRUE(macro_set_action(&g_macros[0], 0, &press));
+    EXPECT_EQ(2, g_macros[0].length);
+    EXPECT_EQ(g_macros[0].size, g_macros[1].offset);
+    ASSERT_TRUE(macro_get_action(&g_macros[0], 0, &action));
+    EXPECT_EQ(10U, action.delay);
+    EXPECT_EQ(key_b, action.event.key);
+    ASSERT_TRUE(macro_get_action(&g_macros[0], 1, &action));
+    EXPECT_EQ(35U, action.delay);
+    EXPECT_EQ(KEY_A, action.event.keycode);
+    EXPECT_EQ(KEYBOARD_EVENT_KEY_UP, action.event.event);
+    EXPECT_EQ(key_a, action.event.key);
+    ASSERT_TRUE(macro_get_action(&g_macros[1], 0, &action));
+    EXPECT_EQ(KEY_B, action.event.keycode);
+
+    // Appending continues from the re-encoded tail
+    MacroAction again = make_action(50, KEY_A, KEYBOARD_EVENT_KEY_DOWN, key_a);
+    ASSERT_TRUE(macro_set_action(&g_macros[0], 2, &again));
+    ASSERT_TRUE(macro_get_action(&g_macros[0], 2, &action));
+    EXPECT_EQ(50U, action.delay);
+    EXPECT_EQ(key_a, action.event.key);
+}
+
+TEST(Macro, SaveAndLoadRestoresEncodedActions)
+{
+    macro_init();
+    Key *key = keyboard_get_key(2);
+    MacroAction down = make_action(7, KEY_C, KEYBOARD_EVENT_KEY_DOWN, key);
+    MacroAction up = make_action(300, KEY_C, KEYBOARD_EVENT_KEY_UP, key);
+    ASSERT_TRUE(macro_append(&g_macros[2], &down));
+    ASSERT_TRUE(macro_append(&g_macros[2], &up));
+
+    macro_save();
+    macro_init();
+    macro_load();
+
+    MacroAction action;
+    EXPECT_EQ(2, g_macros[2].length);
+    ASSERT_TRUE(macro_get_action(&g_macros[2], 1, &action));
+    EXPECT_EQ(300U, action.delay);
+    EXPECT_EQ(KEY_C, action.event.keycode);
+    EXPECT_EQ(key, action.event.key);
+
+    // Appending after a load continues from the restored encoder state
+    ASSERT_TRUE(macro_append(&g_macros[2], &down));
+    ASSERT_TRUE(macro_get_action(&g_macros[2], 2, &action));
+    EXPECT_EQ(300U, action.delay);
+    EXPECT_EQ(KEYBOARD_EVENT_KEY_DOWN, action.event.event);
+}
+
+TEST(Macro, LongRecordingStreamsFromFlash)
+{
+    g_current_profile_index = 0;
+    macro_init();
+    Macro *macro = &g_macros[1];
+    g_keyboard_tick = 0;
+    macro_start_record(macro);
+    // Alternating keys defeat the repeat compression, so every press is stored in full
+    const uint16_t count = MACRO_POOL_SIZE / 2;
+    for (uint16_t i = 0; i < count; i++) {
+        g_keyboard_tick = 1000 + i * 10;
+        Key *key = keyboard_get_key(i % 2);
+        Keycode keycode = (i % 2) ? KEY_B : KEY_A;
+        macro_record(macro, MK_EVENT(keycode, (i / 2) % 2 ? KEYBOARD_EVENT_KEY_UP : KEYBOARD_EVENT_KEY_DOWN, key));
+    }
+    g_keyboard_tick = 1000 + count * 10;
+    macro_stop_record(macro);
+    macro_task();
+
+    EXPECT_TRUE(macro->streamed);
+    EXPECT_EQ(0, macro->size);
+    EXPECT_EQ(MACRO_POOL_SIZE, macro_get_free_space());
+    EXPECT_GT(macro->stream_size, (uint32_t)MACRO_POOL_SIZE);
+    EXPECT_EQ(count + 1, macro->length);
+
+    MacroAction action;
+    ASSERT_TRUE(macro_get_action(macro, count - 1, &action));
+    EXPECT_EQ(1000U + (count - 1) * 10, action.delay);
+    EXPECT_EQ(KEY_B, action.event.keycode);
+    EXPECT_EQ(keyboard_get_key(1), action.event.key);
+
+    macro_load();
+    EXPECT_TRUE(macro->streamed);
+    EXPECT_EQ(count + 1, macro->length);
+
+    g_keyboard_tick = 0;
+    macro_start_play_once(macro);
+    uint16_t last_index = 0;
+    for (uint32_t tick = 0; tick <= 1025U + count * 10 && macro->state != MACRO_STATE_IDLE; tick += 25) {
+        g_keyboard_tick = tick;
+        macro_process();
+        if (macro->state != MACRO_STATE_IDLE) {
+            EXPECT_GE(macro->index, last_index);
+            last_index = macro->index;
+        }
+    }
+    EXPECT_EQ(MACRO_STATE_IDLE, macro->state);
+    EXPECT_GT(last_index, count - 4);
+
+    // Clearing the macro removes its stream file, so a later load cannot pick it up again
+    uint8_t byte;
+    ASSERT_EQ(1U, libamp_test_read_file("macros/stream01", &byte, sizeof(byte)));
+    macro_clear(macro);
+    EXPECT_EQ(0U, libamp_test_read_file("macros/stream01", &byte, sizeof(byte)));
+}
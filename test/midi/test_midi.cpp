@@ -177,3 +177,83 @@ TEST_F(MidiTest, UsbInputSysexPacketsDrainWithoutAudioSideEffects)
     EXPECT_EQ(0u, audio_stop_note_count);
     EXPECT_EQ(0u, audio_stop_all_notes_count);
 }
+
+TEST_F(MidiTest, HeldAnalogNotesStreamBatchedAftertouch)
+{
+    constexpr uint8_t kCinAftertouch = 0x0A;
+    AdvancedKey *key0 = &g_keyboard_advanced_keys[0];
+    AdvancedKey *key1 = &g_keyboard_advanced_keys[1];
+    key0->value = A_ANTI_NORM(0.5);
+    key1->value = A_ANTI_NORM(0.5);
+    midi_event_handler(MK_EVENT(MIDI_NOTE | (60 << 8), KEYBOARD_EVENT_KEY_DOWN, key0));
+    midi_event_handler(MK_EVENT(MIDI_NOTE | (64 << 8), KEYBOARD_EVENT_KEY_DOWN, key1));
+
+    // Nothing is sent while the pressure is unchanged
+    libamp_test_clear_output_buffers();
+    g_keyboard_tick += MIDI_AFTERTOUCH_INTERVAL;
+    midi_task();
+    EXPECT_EQ(0, midi_send_buffer[0]);
+
+    key0->value = ANALOG_VALUE_MAX;
+    key1->value = ANALOG_VALUE_MIN;
+    midi_task();
+    EXPECT_EQ(kCinAftertouch, midi_send_buffer[0]);
+    EXPECT_EQ(0xA0, midi_send_buffer[1]);
+    EXPECT_EQ(60, midi_send_buffer[2]);
+    EXPECT_EQ(127, midi_send_buffer[3]);
+    EXPECT_EQ(kCinAftertouch, midi_send_buffer[4]);
+    EXPECT_EQ(64, midi_send_buffer[6]);
+    EXPECT_EQ(0, midi_send_buffer[7]);
+
+    // Rate limited per note, and released notes stop streaming
+    libamp_test_clear_output_buffers();
+    key0->value = A_ANTI_NORM(0.7);
+    midi_task();
+    EXPECT_EQ(0, midi_send_buffer[0]);
+    midi_event_handler(MK_EVENT(MIDI_NOTE | (60 << 8), KEYBOARD_EVENT_KEY_UP, key0));
+    libamp_test_clear_output_buffers();
+    g_keyboard_tick += MIDI_AFTERTOUCH_INTERVAL;
+    midi_task();
+    EXPECT_EQ(0, midi_send_buffer[0]);
+}
+
+TEST_F(MidiTest, BusyEndpointQueuesCoalescesAndBatches)
+{
+    midi_send_busy = true;
+    MIDIEventPacket note = make_packet(kCinNoteOn, 0x90, 60, 127);
+    MIDIEventPacket cc = make_packet(kCinControlChange, 0xB0, 1, 10);
+    MIDIEventPacket bend = make_packet(kCinPitchBend, 0xE0, 0, 0x40);
+    EXPECT_EQ(0, midi_send(&note));
+    EXPECT_EQ(0, midi_send(&cc));
+    EXPECT_EQ(0, midi_send(&bend));
+    cc.Data3 = 20;
+    bend.Data2 = 0x10;
+    EXPECT_EQ(0, midi_send(&cc));
+    EXPECT_EQ(0, midi_send(&bend));
+    EXPECT_EQ(2u, midi_tx_stats.coalesced);
+
+    // A note between two values of the same controller keeps them apart
+    MIDIEventPacket note_off = make_packet(kCinNoteOff, 0x80, 60, 0);
+    EXPECT_EQ(0, midi_send(&note_off));
+    cc.Data3 = 30;
+    EXPECT_EQ(0, midi_send(&cc));
+    EXPECT_EQ(0, midi_send_buffer[0]);
+
+    midi_send_busy = false;
+    midi_task();
+    EXPECT_EQ(1u, midi_tx_stats.transfers);
+    EXPECT_EQ(5u, midi_tx_stats.packets);
+    expect_midi_packet(kCinNoteOn, 0x90, 60, 127);
+    EXPECT_EQ(20, midi_send_buffer[7]);
+    EXPECT_EQ(0x10, midi_send_buffer[10]);
+    EXPECT_EQ(0x80, midi_send_buffer[13]);
+    EXPECT_EQ(30, midi_send_buffer[19]);
+
+    midi_send_busy = true;
+    for (uint16_t i = 0; i < MIDI_TX_QUEUE_SIZE; i++) {
+        note.Data2 = i & 0x7F;
+        EXPECT_EQ(0, midi_send(&note));
+    }
+    EXPECT_EQ(1, midi_send(&note));
+    EXPECT_EQ(1u, midi_tx_stats.dropped);
+}
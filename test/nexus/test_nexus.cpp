@@ -6,6 +6,7 @@ extern "C" {
 #include "amp_protocol.h"
 #include "nexus.h"
 #include "packet.h"
+#include "scheduler.h"
 }
 
 extern "C" {
@@ -24,14 +25,21 @@ struct CapturedNexusPacket {
 
 CapturedNexusPacket captured_packets[8];
 size_t captured_packet_count;
+size_t sent_frame_count;
 bool captured_decode_ok;
+bool drop_responses;
+uint8_t captured_seqs[8];
+uint8_t captured_report[NEXUS_REPORT_SIZE];
+uint16_t captured_report_length;
 
 void reset_capture()
 {
     std::memset(captured_packets, 0, sizeof(captured_packets));
     std::memset(g_nexus_slave_buffer, 0, sizeof(g_nexus_slave_buffer));
     captured_packet_count = 0;
+    sent_frame_count = 0;
     captured_decode_ok = true;
+    drop_responses = false;
     g_keyboard_tick = 0;
 }
 
@@ -48,11 +56,22 @@ void set_test_config(uint16_t key_index)
     config->lower_deadzone = 200;
 }
 
+void send_response(uint8_t slave_id, uint8_t seq)
+{
+    uint8_t response[NEXUS_BUFFER_SIZE] = {};
+    AmpFrameHeader *header = (AmpFrameHeader *)response;
+    header->proto = AMP_FRAME_PROTO;
+    header->channel_flags = (uint8_t)((AMP_CHANNEL_NEXUS_CTRL << 4) | AMP_FRAME_FLAG_RESP);
+    header->seq = seq;
+    nexus_process_buffer(slave_id, response, sizeof(response));
+}
+
 } // namespace
 
 extern "C" int nexus_send(uint8_t slave_id, uint8_t *report, uint16_t len)
 {
     AmpFrame frame;
+    sent_frame_count++;
     if (!amp_frame_decode(report, len, &frame) || frame.header.len > sizeof(PacketAdvancedKey) - 2)
     {
         captured_decode_ok = false;
@@ -67,12 +86,20 @@ extern "C" int nexus_send(uint8_t slave_id, uint8_t *report, uint16_t len)
         captured->packet.code = frame.header.code;
         captured->packet.type = frame.header.type;
         std::memcpy(((uint8_t *)&captured->packet) + 2, frame.payload, frame.header.len);
+        captured_seqs[captured_packet_count - 1] = frame.header.seq;
     }
 
-    AmpFrameHeader *response = (AmpFrameHeader *)g_nexus_slave_buffer[slave_id];
-    response->proto = AMP_FRAME_PROTO;
-    response->channel_flags = (uint8_t)((AMP_CHANNEL_NEXUS_CTRL << 4) | AMP_FRAME_FLAG_RESP);
-    response->seq = frame.header.seq;
+    if (!drop_responses)
+    {
+        send_response(slave_id, frame.header.seq);
+    }
+    return 0;
+}
+
+extern "C" int nexus_report(uint8_t *report, uint16_t len)
+{
+    std::memcpy(captured_report, report, len);
+    captured_report_length = len;
     return 0;
 }
 
@@ -122,3 +149,253 @@ TEST(NexusConfigSync, InitSendsAllSlaveLocalConfigs)
     EXPECT_EQ(g_keyboard_advanced_keys[5].config.activation_value, captured_packets[1].packet.data.activation_value);
     EXPECT_EQ(g_keyboard_advanced_keys[8].config.activation_value, captured_packets[2].packet.data.activation_value);
 }
+
+TEST(NexusConfigSync, UnansweredFramesAreRetriedByTheTimer)
+{
+    reset_capture();
+    scheduler_init();
+    drop_responses = true;
+
+    // All three configurations go out at once without waiting for the slave
+    nexus_init();
+    ASSERT_EQ(3u, captured_packet_count);
+
+    send_response(0, captured_seqs[1]);
+    g_keyboard_tick += NEXUS_REQUEST_TIMEOUT;
+    scheduler_process();
+    ASSERT_EQ(5u, captured_packet_count);
+    EXPECT_EQ(0u, captured_packets[3].packet.index);
+    EXPECT_EQ(captured_seqs[0], captured_seqs[3]);
+    EXPECT_EQ(2u, captured_packets[4].packet.index);
+    EXPECT_EQ(captured_seqs[2], captured_seqs[4]);
+
+    send_response(0, captured_seqs[0]);
+    send_response(0, captured_seqs[2]);
+    g_keyboard_tick += NEXUS_REQUEST_TIMEOUT;
+    scheduler_process();
+    EXPECT_EQ(5u, captured_packet_count);
+}
+
+TEST(NexusConfigSync, SilentSlaveIsSkippedUntilHeardFromAgain)
+{
+    reset_capture();
+    scheduler_init();
+    drop_responses = true;
+
+    nexus_init();
+    for (int i = 0; i <= NEXUS_RETRY_COUNT; i++) {
+        g_keyboard_tick += NEXUS_REQUEST_TIMEOUT;
+        scheduler_process();
+    }
+    EXPECT_EQ(3u * (NEXUS_RETRY_COUNT + 1), sent_frame_count);
+
+    // Out of retries, the slave is left alone instead of being flooded again
+    const size_t sent = sent_frame_count;
+    g_keyboard_tick += NEXUS_REQUEST_TIMEOUT;
+    scheduler_process();
+    nexus_process();
+    EXPECT_EQ(sent, sent_frame_count);
+
+    // Any frame from the slave brings it back and the pending configurations go out
+    drop_responses = false;
+    send_response(0, 0);
+    nexus_process();
+    EXPECT_EQ(sent + 3, sent_frame_count);
+}
+
+TEST(NexusReport, MasterAppliesDeltasOnlyOnTopOfRefreshedValues)
+{
+    reset_capture();
+    nexus_init();
+    g_keyboard_advanced_keys[5].value = 777;
+    uint8_t report[sizeof(PacketNexus) + NEXUS_ABSOLUTE_ENTRY_SIZE + NEXUS_DELTA_ENTRY_SIZE] = {};
+    PacketNexus *packet = (PacketNexus *)report;
+    uint8_t *entry = report + sizeof(PacketNexus);
+
+    packet->sequence = 0x81;
+    packet->changed[0] = 0x03;
+    packet->absolute[0] = 0x01;
+    const uint8_t first[] = {0x34, 0x12, 0x56, 0x04, 0x05, 0x00};
+    std::memcpy(entry, first, sizeof(first));
+    nexus_process_buffer(0, report, sizeof(report));
+    EXPECT_EQ(0x1234, g_keyboard_advanced_keys[2].value);
+    EXPECT_EQ(0x0456, g_keyboard_advanced_keys[2].filtered_raw);
+    // The first delta of a key has no base yet
+    EXPECT_EQ(777, g_keyboard_advanced_keys[5].value);
+
+    std::memset(report, 0, sizeof(report));
+    packet->sequence = 0x82;
+    packet->changed[0] = 0x01;
+    entry[0] = 0xCC;
+    entry[1] = 0xFF;
+    nexus_process_buffer(0, report, sizeof(PacketNexus) + NEXUS_DELTA_ENTRY_SIZE);
+    EXPECT_EQ(0x1200, g_keyboard_advanced_keys[2].value);
+
+    // A gap in the sequence drops the base until the next refresh
+    g_keyboard_tick = 7;
+    packet->sequence = 0x84;
+    entry[0] = 0x01;
+    entry[1] = 0x00;
+    nexus_process_buffer(0, report, sizeof(PacketNexus) + NEXUS_DELTA_ENTRY_SIZE);
+    EXPECT_EQ(0x1200, g_keyboard_advanced_keys[2].value);
+
+    nexus_process_buffer(0, report, sizeof(PacketNexus) - 1);
+    const NexusSlaveStats *stats = &g_nexus_slave_stats[0];
+    EXPECT_EQ(3u, stats->frames);
+    EXPECT_EQ(1u, stats->lost_frames);
+    EXPECT_EQ(1u, stats->decode_failures);
+    EXPECT_EQ(7u, stats->max_gap);
+    EXPECT_EQ(7u, stats->last_seen_tick);
+
+    // A report cut short drops the base of the keys it no longer carries
+    std::memset(report, 0, sizeof(report));
+    packet->sequence = 0x85;
+    packet->changed[0] = 0x01;
+    packet->absolute[0] = 0x01;
+    const uint8_t refresh[] = {0x00, 0x10, 0x00, 0x00};
+    std::memcpy(entry, refresh, sizeof(refresh));
+    nexus_process_buffer(0, report, sizeof(PacketNexus) + NEXUS_ABSOLUTE_ENTRY_SIZE);
+    EXPECT_EQ(0x1000, g_keyboard_advanced_keys[2].value);
+    packet->sequence = 0x86;
+    packet->absolute[0] = 0x00;
+    entry[0] = 0x10;
+    entry[1] = 0x00;
+    nexus_process_buffer(0, report, sizeof(PacketNexus) + NEXUS_DELTA_ENTRY_SIZE - 1);
+    EXPECT_EQ(2u, stats->decode_failures);
+    packet->sequence = 0x87;
+    nexus_process_buffer(0, report, sizeof(PacketNexus) + NEXUS_DELTA_ENTRY_SIZE);
+    EXPECT_EQ(0x1000, g_keyboard_advanced_keys[2].value);
+}
+
+TEST(NexusReport, SlavePacksChangedKeysAndRefreshesRoundRobin)
+{
+    for (uint16_t i = 0; i < NEXUS_SLICE_LENGTH_MAX; i++) {
+        g_keyboard_advanced_keys[i].value = 0;
+        g_keyboard_advanced_keys[i].filtered_raw = 0;
+    }
+    PacketNexus *packet = (PacketNexus *)captured_report;
+
+    ASSERT_EQ(0, nexus_send_report());
+    EXPECT_EQ(sizeof(PacketNexus) + NEXUS_ABSOLUTE_ENTRY_SIZE, captured_report_length);
+    EXPECT_EQ(0x01, packet->changed[0]);
+    EXPECT_EQ(0x01, packet->absolute[0]);
+
+    // Small changes travel as deltas, large ones and the refreshed key in full
+    g_keyboard_advanced_keys[3].value = 100;
+    g_keyboard_advanced_keys[4].value = 40000;
+    g_keyboard_advanced_keys[4].filtered_raw = 0x0321;
+    ASSERT_EQ(0, nexus_send_report());
+    EXPECT_EQ(sizeof(PacketNexus) + 2 * NEXUS_ABSOLUTE_ENTRY_SIZE + NEXUS_DELTA_ENTRY_SIZE, captured_report_length);
+    EXPECT_EQ(0x1A, packet->changed[0]);
+    EXPECT_EQ(0x12, packet->absolute[0]);
+    const uint8_t *entry = captured_report + sizeof(PacketNexus) + NEXUS_ABSOLUTE_ENTRY_SIZE;
+    EXPECT_EQ(100, entry[0] | (entry[1] << 8));
+    EXPECT_EQ(40000, entry[2] | (entry[3] << 8));
+    EXPECT_EQ(0x0321, entry[4] | (entry[5] << 8));
+
+    // Keys that do not fit are picked up by the next report, starting with a refresh
+    for (uint16_t i = 0; i < NEXUS_SLICE_LENGTH_MAX; i++) {
+        g_keyboard_advanced_keys[i].value = 2000 + i;
+    }
+    ASSERT_EQ(0, nexus_send_report());
+    EXPECT_LE(captured_report_length, NEXUS_REPORT_SIZE);
+    EXPECT_EQ(0xFC, packet->changed[0]);
+    EXPECT_EQ(0x0F, packet->changed[1]);
+    ASSERT_EQ(0, nexus_send_report());
+    EXPECT_EQ(0x03, packet->changed[0]);
+    EXPECT_EQ(0xF0, packet->changed[1]);
+    EXPECT_EQ(0x00, packet->absolute[0]);
+    EXPECT_EQ(0x10, packet->absolute[1]);
+
+    // An idle slave reports at NEXUS_IDLE_INTERVAL and bursts again on movement
+    g_keyboard_tick += NEXUS_IDLE_TIMEOUT;
+    ASSERT_EQ(0, nexus_send_report());
+    captured_report_length = 0;
+    g_keyboard_tick++;
+    ASSERT_EQ(0, nexus_send_report());
+    EXPECT_EQ(0u, captured_report_length);
+    g_keyboard_advanced_keys[6].value += 1;
+    ASSERT_EQ(0, nexus_send_report());
+    EXPECT_EQ(sizeof(PacketNexus) + NEXUS_ABSOLUTE_ENTRY_SIZE + NEXUS_DELTA_ENTRY_SIZE, captured_report_length);
+
+    // Movement of the key under the cursor alone ends the idle pace as well
+    g_keyboard_tick += NEXUS_IDLE_TIMEOUT;
+    ASSERT_EQ(0, nexus_send_report());
+    uint16_t cursor = 0;
+    while (cursor < NEXUS_SLICE_LENGTH_MAX && !BIT_GET(packet->absolute[cursor / 8], cursor % 8)) {
+        cursor++;
+    }
+    ASSERT_LT(cursor, NEXUS_SLICE_LENGTH_MAX);
+    const uint16_t next = (cursor + 1) % NEXUS_SLICE_LENGTH_MAX;
+    captured_report_length = 0;
+    g_keyboard_tick++;
+    ASSERT_EQ(0, nexus_send_report());
+    EXPECT_EQ(0u, captured_report_length);
+    g_keyboard_advanced_keys[next].value += 1000;
+    g_keyboard_tick++;
+    ASSERT_EQ(0, nexus_send_report());
+    EXPECT_EQ(sizeof(PacketNexus) + NEXUS_ABSOLUTE_ENTRY_SIZE, captured_report_length);
+    EXPECT_TRUE(BIT_GET(packet->absolute[next / 8], next % 8));
+}
+
+TEST(NexusRaw, PackedSamplesRoundTrip)
+{
+    const AnalogRawValue samples[] = {0x0000, 0x0123, 0x0ABC, 0x0FFF, 0x0801};
+    const uint16_t count = sizeof(samples) / sizeof(samples[0]);
+    const AnalogRawValue limit = (AnalogRawValue)(((1UL << NEXUS_RAW_BITS) - 1) << NEXUS_RAW_SHIFT);
+    uint8_t buf[NEXUS_RAW_PAYLOAD_SIZE(count) + 1];
+    std::memset(buf, 0xEE, sizeof(buf));
+    nexus_pack_raw(buf, samples, count);
+    // The payload stays within its computed size
+    EXPECT_EQ(0xEE, buf[NEXUS_RAW_PAYLOAD_SIZE(count)]);
+    EXPECT_LE(NEXUS_RAW_PAYLOAD_SIZE(count), count * sizeof(AnalogRawValue));
+    if (NEXUS_RAW_BITS < 16) {
+        EXPECT_LT(NEXUS_RAW_PAYLOAD_SIZE(count), count * sizeof(AnalogRawValue));
+    }
+
+    AnalogRawValue unpacked[count];
+    std::memset(unpacked, 0, sizeof(unpacked));
+    nexus_unpack_raw(unpacked, buf, count);
+    for (uint16_t i = 0; i < count; i++) {
+        const AnalogRawValue expected = samples[i] > limit ? limit : (samples[i] >> NEXUS_RAW_SHIFT) << NEXUS_RAW_SHIFT;
+        EXPECT_EQ(expected, unpacked[i]);
+    }
+}
+
+TEST(NexusRaw, MasterDecodeChecksHeaderCountAndSequence)
+{
+    const AnalogRawValue samples[] = {0x0123, 0x0456, 0x0789, 0x0ABC};
+    uint8_t report[sizeof(PacketNexusRaw) + NEXUS_RAW_PAYLOAD_SIZE(4)];
+    PacketNexusRaw *packet = (PacketNexusRaw *)report;
+    AnalogRawValue decoded[4] = {};
+    nexus_reset_stats(0);
+    packet->sequence = 0x80 | 1;
+    packet->slave_id = 0;
+    packet->count = 4;
+    nexus_pack_raw(report + sizeof(PacketNexusRaw), samples, 4);
+
+    // Samples past the configured slice length are dropped
+    ASSERT_TRUE(nexus_decode_raw(0, report, sizeof(report), decoded, 3));
+    EXPECT_EQ(samples[0], decoded[0]);
+    EXPECT_EQ(samples[2], decoded[2]);
+    EXPECT_EQ(0, decoded[3]);
+    EXPECT_EQ(1u, g_nexus_slave_stats[0].frames);
+
+    // Reports without the mark, from another slave or cut short are rejected
+    packet->sequence = 2;
+    EXPECT_FALSE(nexus_decode_raw(0, report, sizeof(report), decoded, 4));
+    packet->sequence = 0x80 | 2;
+    packet->slave_id = 1;
+    EXPECT_FALSE(nexus_decode_raw(0, report, sizeof(report), decoded, 4));
+    packet->slave_id = 0;
+    EXPECT_FALSE(nexus_decode_raw(0, report, sizeof(report) - 1, decoded, 4));
+    EXPECT_EQ(3u, g_nexus_slave_stats[0].decode_failures);
+    EXPECT_EQ(1u, g_nexus_slave_stats[0].frames);
+
+    // A skipped sequence number counts the frames lost in between
+    ASSERT_TRUE(nexus_decode_raw(0, report, sizeof(report), decoded, 4));
+    packet->sequence = 0x80 | 5;
+    ASSERT_TRUE(nexus_decode_raw(0, report, sizeof(report), decoded, 4));
+    EXPECT_EQ(2u, g_nexus_slave_stats[0].lost_frames);
+    EXPECT_EQ(samples[3], decoded[3]);
+}
@@ -4,6 +4,7 @@
 #include <cstring>
 
 #include "rgb.h"
+#include "lamp_array.h"
 #include "test_fixture.h"
 
 namespace {
@@ -19,6 +20,8 @@ uint8_t gamma_correct(uint8_t value, uint8_t brightness)
 
 } // namespace
 
+extern "C" uint16_t rgb_bubble_indexed_count;
+
 TEST(Color, ConvertsPrimaryColorsBetweenRgbAndHsv)
 {
     ColorRGB red = {255, 0, 0};
@@ -36,6 +39,40 @@ TEST(Color, ConvertsPrimaryColorsBetweenRgbAndHsv)
     EXPECT_EQ(0, round_trip.b);
 }
 
+TEST(Color, FixedPointHsvBatchMatchesSingleConversion)
+{
+    ColorHSV16 hsv[4] = {
+        {COLOR_HUE16_FROM_DEGREE(0), 255, 255},
+        {COLOR_HUE16_FROM_DEGREE(120), 255, 255},
+        {COLOR_HUE16_FROM_DEGREE(240), 255, 128},
+        {COLOR_HUE16_FROM_DEGREE(60), 0, 200},
+    };
+    ColorRGB rgb[4] = {};
+
+    hsv16_to_rgb_array(rgb, hsv, 4);
+    EXPECT_EQ(255, rgb[0].r);
+    EXPECT_EQ(0, rgb[0].g);
+    EXPECT_EQ(0, rgb[0].b);
+    EXPECT_EQ(0, rgb[1].r);
+    EXPECT_EQ(255, rgb[1].g);
+    EXPECT_EQ(0, rgb[1].b);
+    EXPECT_EQ(0, rgb[2].r);
+    EXPECT_EQ(0, rgb[2].g);
+    EXPECT_EQ(128, rgb[2].b);
+    EXPECT_EQ(200, rgb[3].r);
+    EXPECT_EQ(200, rgb[3].g);
+    EXPECT_EQ(200, rgb[3].b);
+
+    for (int i = 0; i < 4; i++)
+    {
+        ColorRGB single = {};
+        hsv16_to_rgb(&single, &hsv[i]);
+        EXPECT_EQ(single.r, rgb[i].r);
+        EXPECT_EQ(single.g, rgb[i].g);
+        EXPECT_EQ(single.b, rgb[i].b);
+    }
+}
+
 TEST(Color, MixSaturatesAtByteMax)
 {
     ColorRGB dest = {250, 10, 100};
@@ -76,6 +113,23 @@ TEST(RGB, SetAppliesBrightnessAndGammaBeforeWritingLedBuffer)
     EXPECT_EQ(gamma_correct(32, 128), led_color_buffer[3].b);
 }
 
+TEST(RGB, SetTracksBrightnessChangesBetweenCalls)
+{
+    g_rgb_base_config.brightness = 64;
+    rgb_set(5, 200, 100, 50);
+    EXPECT_EQ(gamma_correct(200, 64), led_color_buffer[5].r);
+
+    g_rgb_base_config.brightness = 255;
+    rgb_set(5, 200, 100, 50);
+    EXPECT_EQ(gamma_correct(200, 255), led_color_buffer[5].r);
+    EXPECT_EQ(gamma_correct(100, 255), led_color_buffer[5].g);
+    EXPECT_EQ(gamma_correct(50, 255), led_color_buffer[5].b);
+
+    g_rgb_base_config.brightness = 0;
+    rgb_set(5, 255, 255, 255);
+    EXPECT_EQ(0, led_color_buffer[5].r);
+}
+
 TEST(RGB, FixedModeFlushesDeterministicLedColors)
 {
     libamp_test_clear_output_buffers();
@@ -96,6 +150,97 @@ TEST(RGB, FixedModeFlushesDeterministicLedColors)
     EXPECT_EQ(1U, led_flush_count);
 }
 
+TEST(RGB, SchedulerSplitsFramesAndCountsDroppedFrames)
+{
+    libamp_test_clear_output_buffers();
+    g_rgb_base_config.mode = RGB_BASE_MODE_BLANK;
+    g_rgb_base_config.brightness = 255;
+    for (uint16_t i = 0; i < RGB_NUM; i++) {
+        g_rgb_configs[i].mode = RGB_MODE_FIXED;
+        g_rgb_configs[i].rgb = {0, 0, 0};
+    }
+    g_rgb_configs[RGB_NUM - 1].rgb = {255, 255, 255};
+    g_rgb_scheduler.frame_interval = 10;
+    g_rgb_scheduler.frame_budget = RGB_NUM / 2;
+    g_keyboard_tick = 0;
+
+    rgb_task();
+    EXPECT_EQ(0U, led_flush_count);
+    for (int i = 0; i < 8 && g_rgb_scheduler.frame_count == 0; i++) {
+        rgb_task();
+    }
+    EXPECT_EQ(1U, g_rgb_scheduler.frame_count);
+    EXPECT_EQ(1U, led_flush_count);
+    EXPECT_GT(g_rgb_scheduler.max_frame_slices, 1);
+    EXPECT_EQ(gamma_correct(255, 255), led_color_buffer[RGB_NUM - 1].r);
+
+    g_keyboard_tick = 5;
+    rgb_task();
+    EXPECT_EQ(1U, led_flush_count);
+
+    g_keyboard_tick = 35;
+    rgb_task();
+    EXPECT_EQ(2U, g_rgb_scheduler.dropped_frame_count);
+}
+
+TEST(RGB, BubbleRippleOnlyLightsLedsNearThePressedKey)
+{
+    libamp_test_clear_output_buffers();
+    g_rgb_base_config.mode = RGB_BASE_MODE_BLANK;
+    g_rgb_base_config.brightness = 255;
+    for (uint16_t i = 0; i < RGB_NUM; i++) {
+        g_rgb_configs[i].mode = RGB_MODE_BUBBLE;
+        g_rgb_configs[i].rgb = {255, 255, 255};
+        g_rgb_configs[i].speed = 20;
+    }
+
+    g_keyboard_tick = 0;
+    rgb_activate(g_rgb_mapping[10], 0);
+    g_keyboard_tick = 1000;
+    rgb_process();
+
+    EXPECT_GT(led_color_buffer[10].r, 0);
+    EXPECT_GT(led_color_buffer[11].r, 0);
+    EXPECT_EQ(0, led_color_buffer[8].r);
+    EXPECT_EQ(0, led_color_buffer[60].r);
+}
+
+TEST(RGB, BubbleIndexCoversEveryKeyAndMatchesTheFullScan)
+{
+    ASSERT_EQ(RGB_NUM, rgb_bubble_indexed_count);
+
+    libamp_test_clear_output_buffers();
+    g_rgb_base_config.mode = RGB_BASE_MODE_BLANK;
+    g_rgb_base_config.brightness = 255;
+    for (uint16_t i = 0; i < RGB_NUM; i++) {
+        g_rgb_configs[i].mode = RGB_MODE_BUBBLE;
+        g_rgb_configs[i].rgb = {255, 255, 255};
+        g_rgb_configs[i].speed = 20;
+    }
+
+    g_keyboard_tick = 0;
+    rgb_activate(g_rgb_mapping[30], 0);
+    g_keyboard_tick = 1500;
+    rgb_process();
+    ColorRGB indexed[RGB_NUM];
+    std::memcpy(indexed, led_color_buffer, sizeof(indexed));
+
+    rgb_bubble_indexed_count = 0;
+    libamp_test_clear_output_buffers();
+    rgb_process();
+    rgb_bubble_indexed_count = RGB_NUM;
+
+    uint16_t lit = 0;
+    for (uint16_t i = 0; i < RGB_NUM; i++) {
+        // Indexed distances are rounded to 8 um
+        EXPECT_NEAR(led_color_buffer[i].r, indexed[i].r, 1) << i;
+        EXPECT_NEAR(led_color_buffer[i].g, indexed[i].g, 1) << i;
+        EXPECT_NEAR(led_color_buffer[i].b, indexed[i].b, 1) << i;
+        lit += indexed[i].r > 0;
+    }
+    EXPECT_GT(lit, 1);
+}
+
 TEST(RGB, HidModeOnlyFlushesExistingHostLedState)
 {
     libamp_test_clear_output_buffers();
@@ -110,3 +255,86 @@ TEST(RGB, HidModeOnlyFlushesExistingHostLedState)
     EXPECT_EQ(9, led_color_buffer[0].b);
     EXPECT_EQ(1U, led_flush_count);
 }
+
+TEST(RGB, CompositorBlendsOverlayLayersOverEffects)
+{
+    libamp_test_clear_output_buffers();
+    g_rgb_base_config.mode = RGB_BASE_MODE_BLANK;
+    g_rgb_base_config.brightness = 255;
+    for (uint16_t i = 0; i < RGB_NUM; i++) {
+        g_rgb_configs[i].mode = RGB_MODE_FIXED;
+        g_rgb_configs[i].rgb = {100, 100, 100};
+    }
+    ColorRGB red = {255, 0, 0};
+    rgb_layer_set(RGB_LAYER_SCRIPT, 0, &red, 255);
+    rgb_layer_set(RGB_LAYER_LAMP_ARRAY, 1, &red, 255);
+    rgb_layer_set_blend(RGB_LAYER_LAMP_ARRAY, RGB_BLEND_MODE_MAX, 255);
+
+    rgb_process();
+
+    EXPECT_EQ(gamma_correct(255, 255), led_color_buffer[0].r);
+    EXPECT_EQ(0, led_color_buffer[0].g);
+    EXPECT_EQ(gamma_correct(255, 255), led_color_buffer[1].r);
+    EXPECT_EQ(gamma_correct(100, 255), led_color_buffer[1].g);
+    EXPECT_EQ(gamma_correct(100, 255), led_color_buffer[2].r);
+
+    rgb_layer_clear(RGB_LAYER_SCRIPT);
+    rgb_layer_set_blend(RGB_LAYER_LAMP_ARRAY, RGB_BLEND_MODE_MAX, 0);
+    rgb_process();
+
+    EXPECT_EQ(0U, g_rgb_layers[RGB_LAYER_SCRIPT].coverage);
+    EXPECT_EQ(gamma_correct(100, 255), led_color_buffer[0].r);
+    EXPECT_EQ(gamma_correct(100, 255), led_color_buffer[1].r);
+}
+
+TEST(RGB, LampArrayUpdatesApplyOnlyAfterUpdateComplete)
+{
+    libamp_test_clear_output_buffers();
+    g_rgb_base_config.brightness = 255;
+    LampMultiUpdateReport multi = {};
+    multi.report_id = REPORT_ID_LIGHTING_LAMP_MULTI_UPDATE;
+    multi.lamp_count = 2;
+    multi.lamp_ids[0] = 3;
+    multi.lamp_ids[1] = 3;
+    multi.colors[0] = {10, 0, 0, 1};
+    multi.colors[1] = {20, 0, 0, 1};
+    lamp_array_set_multiple_lamps(reinterpret_cast<const uint8_t*>(&multi));
+
+    lamp_array_apply();
+    EXPECT_EQ(0, led_color_buffer[3].r);
+
+    LampRangeUpdateReport range = {};
+    range.report_id = REPORT_ID_LIGHTING_LAMP_RANGE_UPDATE;
+    range.flags = LAMP_UPDATE_FLAG_UPDATE_COMPLETE;
+    range.lamp_id_start = 4;
+    range.lamp_id_end = 5;
+    range.color = {0, 255, 0, 1};
+    lamp_array_set_lamp_range(reinterpret_cast<const uint8_t*>(&range));
+
+    lamp_array_apply();
+    EXPECT_EQ(gamma_correct(20, 255), led_color_buffer[3].r);
+    EXPECT_EQ(gamma_correct(255, 255), led_color_buffer[4].g);
+    EXPECT_EQ(gamma_correct(255, 255), led_color_buffer[5].g);
+
+    led_color_buffer[3] = {0, 0, 0};
+    lamp_array_apply();
+    EXPECT_EQ(0, led_color_buffer[3].r);
+
+    // Commits between two frames pile up, the next commit goes to the other buffer
+    range.color = {0, 0, 255, 1};
+    range.lamp_id_start = 6;
+    range.lamp_id_end = 6;
+    lamp_array_set_lamp_range(reinterpret_cast<const uint8_t*>(&range));
+    range.lamp_id_start = 7;
+    range.lamp_id_end = 7;
+    lamp_array_set_lamp_range(reinterpret_cast<const uint8_t*>(&range));
+    lamp_array_apply();
+    EXPECT_EQ(gamma_correct(255, 255), led_color_buffer[6].b);
+    EXPECT_EQ(gamma_correct(255, 255), led_color_buffer[7].b);
+
+    range.lamp_id_start = 8;
+    range.lamp_id_end = 8;
+    lamp_array_set_lamp_range(reinterpret_cast<const uint8_t*>(&range));
+    lamp_array_apply();
+    EXPECT_EQ(gamma_correct(255, 255), led_color_buffer[8].b);
+}
@@ -5,6 +5,7 @@
 
 #include "dynamic_key.h"
 #include "file_system.h"
+#include "macro.h"
 #include "rgb.h"
 #include "script.h"
 #include "storage.h"
@@ -205,6 +206,37 @@ TEST(Storage, ProfilesAreIsolated)
     EXPECT_EQ(0, std::memcmp(profile1_keymap.data(), g_keymap, sizeof(g_keymap)));
 }
 
+TEST(Storage, ProfilesKeepTheirOwnMacros)
+{
+    MacroAction action = {};
+    action.event = MK_EVENT(KEY_A, KEYBOARD_EVENT_KEY_DOWN, keyboard_get_key(0));
+
+    g_current_profile_index = 0;
+    macro_init();
+    action.delay = 11;
+    ASSERT_TRUE(macro_append(&g_macros[0], &action));
+    storage_save_profile();
+
+    g_current_profile_index = 1;
+    macro_init();
+    action.delay = 22;
+    ASSERT_TRUE(macro_append(&g_macros[0], &action));
+    ASSERT_TRUE(macro_append(&g_macros[0], &action));
+    storage_save_profile();
+
+    g_current_profile_index = 0;
+    storage_read_profile();
+    ASSERT_EQ(1, g_macros[0].length);
+    ASSERT_TRUE(macro_get_action(&g_macros[0], 0, &action));
+    EXPECT_EQ(11U, action.delay);
+
+    g_current_profile_index = 1;
+    storage_read_profile();
+    ASSERT_EQ(2, g_macros[0].length);
+    ASSERT_TRUE(macro_get_action(&g_macros[0], 1, &action));
+    EXPECT_EQ(22U, action.delay);
+}
+
 TEST(Storage, ProfileIndexRejectsOutOfRangeValue)
 {
     g_current_profile_index = 2;
@@ -14,6 +14,7 @@ uint8_t shared_ep_send_buffer[64];
 uint8_t keyboard_send_buffer[64];
 uint8_t raw_send_buffer[64];
 uint8_t midi_send_buffer[64];
+bool midi_send_busy;
 ColorRGB led_color_buffer[RGB_NUM];
 uint32_t led_flush_count;
 uint32_t audio_play_note_count;
@@ -998,6 +999,10 @@ int hid_send_raw(uint8_t *report, uint16_t len)
 
 int send_midi(uint8_t *report, uint16_t len)
 {
+    if (midi_send_busy)
+    {
+        return 1;
+    }
     memcpy(midi_send_buffer,report,len);
     return 0;
 }
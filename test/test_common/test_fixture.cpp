@@ -2,6 +2,7 @@
 
 #include <cstring>
 
+#include "file_system.h"
 #include "keyboard.h"
 
 extern "C" {
@@ -14,6 +15,7 @@ void libamp_test_clear_output_buffers(void)
     std::memset(keyboard_send_buffer, 0, sizeof(keyboard_send_buffer));
     std::memset(raw_send_buffer, 0, sizeof(raw_send_buffer));
     std::memset(midi_send_buffer, 0, sizeof(midi_send_buffer));
+    midi_send_busy = false;
     std::memset(led_color_buffer, 0, sizeof(ColorRGB) * RGB_NUM);
     led_flush_count = 0;
     audio_play_note_count = 0;
@@ -26,6 +28,18 @@ void libamp_test_clear_output_buffers(void)
     std::memset(&midi_last_message, 0, sizeof(midi_last_message));
 }
 
+size_t libamp_test_read_file(const char *name, void *buf, size_t size)
+{
+    File file;
+    if (fs_open(&file, name, FS_O_RDONLY) < 0)
+    {
+        return 0;
+    }
+    size_t length = fs_read(&file, buf, size);
+    fs_close(&file);
+    return length;
+}
+
 void libamp_test_reset_environment(void)
 {
     std::memset(flash_buffer, 0xFF, LFS_BLOCK_SIZE * LFS_BLOCK_COUNT);
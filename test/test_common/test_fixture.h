@@ -12,6 +12,7 @@ extern uint8_t shared_ep_send_buffer[64];
 extern uint8_t keyboard_send_buffer[64];
 extern uint8_t raw_send_buffer[64];
 extern uint8_t midi_send_buffer[64];
+extern bool midi_send_busy;
 extern ColorRGB led_color_buffer[RGB_NUM];
 extern uint32_t led_flush_count;
 extern uint32_t audio_play_note_count;
@@ -25,6 +26,7 @@ extern MIDIMessage midi_last_message;
 
 void libamp_test_reset_environment(void);
 void libamp_test_clear_output_buffers(void);
+size_t libamp_test_read_file(const char *name, void *buf, size_t size);
 
 #ifdef __cplusplus
 }
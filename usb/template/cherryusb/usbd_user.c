@@ -289,8 +289,12 @@ static struct usbd_endpoint raw_out_ep = {
 #endif
 
 #ifdef MIDI_ENABLE
+// midi_flush sends up to MIDI_PACKETS_PER_TRANSFER 4-byte event packets in one write
+#if MIDI_PACKETS_PER_TRANSFER * 4 > MIDI_STREAM_EPSIZE
+#error "MIDI_PACKETS_PER_TRANSFER does not fit the MIDI endpoint"
+#endif
 static volatile bool  midi_state;
-USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t midi_in_buffer[4];
+USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t midi_in_buffer[MIDI_STREAM_EPSIZE];
 USB_NOCACHE_RAM_SECTION USB_MEM_ALIGNX uint8_t midi_out_buffer[4];
 
 static void usbd_midi_bulk_out(uint8_t busid, uint8_t ep, uint32_t nbytes)
@@ -659,13 +663,13 @@ int usb_send_raw(uint8_t *buffer, uint8_t size)
 int usb_send_midi(uint8_t *buffer, uint8_t size)
 {
 #ifdef MIDI_ENABLE
-    if (midi_state == USB_STATE_BUSY)
+    if (midi_state == USB_STATE_BUSY || size > MIDI_STREAM_EPSIZE)
     {
         return 1;
     }
     midi_state = USB_STATE_BUSY;
     memcpy(midi_in_buffer, buffer, size);
-    int ret = usbd_ep_start_write(0, MIDI_EPIN_ADDR, midi_in_buffer, 4);
+    int ret = usbd_ep_start_write(0, MIDI_EPIN_ADDR, midi_in_buffer, size);
     if (ret < 0)
     {
         midi_state = USB_STATE_IDLE;